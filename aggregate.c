@@ -0,0 +1,250 @@
+#include "aggregate.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*Balances are summed 4 at a time, widened to 64 bits so no sum overflows*/
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef int64_t v4di __attribute__((vector_size(32)));
+
+/*What one thread copies and reduces*/
+struct part {
+  struct account_store* store;
+  uint64_t from_stripe;
+  uint64_t to_stripe;
+  const int32_t* balances;
+  uint64_t from;
+  uint64_t to;
+  int ntop;
+  int64_t total;
+  uint64_t nonzero;
+  uint64_t histogram[AGG_BUCKETS];
+  /*Largest balances of the part as a min-heap of slots*/
+  int nheap;
+  uint64_t heap[AGG_MAX_TOP];
+};
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket(int64_t balance) {
+  if (balance < 0) return 0;
+  if (balance == 0) return 1;
+  if (balance >= 1LL << (AGG_BUCKETS - 3)) return AGG_BUCKETS - 1;
+  return 2 + 31 - __builtin_clz((unsigned int)balance);
+}
+
+/*Put slot in the heap of p if its balance is among the largest*/
+static void heap_offer(struct part* p, uint64_t slot) {
+  const int32_t* b = p->balances;
+  int i;
+  if (p->nheap < p->ntop) {
+    /*Sift up*/
+    i = p->nheap++;
+    while (i > 0 && b[p->heap[(i - 1) / 2]] > b[slot]) {
+      p->heap[i] = p->heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    p->heap[i] = slot;
+    return;
+  }
+  if (b[slot] <= b[p->heap[0]]) return;
+  /*Replace the smallest and sift down*/
+  i = 0;
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= p->nheap) break;
+    if (c + 1 < p->nheap && b[p->heap[c + 1]] < b[p->heap[c]]) c++;
+    if (b[p->heap[c]] >= b[slot]) break;
+    p->heap[i] = p->heap[c];
+    i = c;
+  }
+  p->heap[i] = slot;
+}
+
+static void* copy_part(void* arg) {
+  struct part* p = arg;
+  store_snapshot_stripes(p->store, p->from_stripe, p->to_stripe);
+  return NULL;
+}
+
+static void* scan_part(void* arg) {
+  struct part* p = arg;
+  const int32_t* b = p->balances;
+  v4di sum = {0, 0, 0, 0};
+  v4si nonzero = {0, 0, 0, 0};
+  uint64_t n = p->from;
+
+  for (; n + 4 <= p->to; n += 4) {
+    v4si v;
+    memcpy(&v, b + n, sizeof(v));
+    sum += __builtin_convertvector(v, v4di);
+    /*A true comparison is -1 in every lane*/
+    nonzero -= v != 0;
+  }
+  p->total = sum[0] + sum[1] + sum[2] + sum[3];
+  p->nonzero = (uint64_t)nonzero[0] + nonzero[1] + nonzero[2] + nonzero[3];
+  for (; n < p->to; n++) {
+    p->total += b[n];
+    p->nonzero += b[n] != 0;
+  }
+  for (n = p->from; n < p->to; n++) {
+    p->histogram[bucket(b[n])]++;
+    if (p->ntop > 0) heap_offer(p, n);
+  }
+  return NULL;
+}
+
+static int by_balance(const void* a, const void* b) {
+  const struct aggregate_top* x = a;
+  const struct aggregate_top* y = b;
+  if (x->balance != y->balance) return x->balance < y->balance ? 1 : -1;
+  return x->account < y->account ? -1 : x->account > y->account;
+}
+
+/*Run fn on every part, the last one on the calling thread*/
+static void run_parts(struct part* parts, int threads, void* (*fn)(void*)) {
+  pthread_t tids[threads];
+  int started = 0;
+  for (int i = 0; i < threads - 1; i++)
+    if (pthread_create(&tids[i], NULL, fn, &parts[i]) == 0)
+      started = i + 1;
+    else
+      break;
+  /*Whatever could not get a thread of its own runs here*/
+  for (int i = started; i < threads; i++) fn(&parts[i]);
+  for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+}
+
+int aggregate_run(struct account_store* s, const struct engine* engine,
+                  struct hot_accounts* hot, int threads, int ntop,
+                  struct aggregate* out) {
+  int entries[HOT_MAX];
+  int64_t slots[HOT_MAX];
+  int64_t pending[HOT_MAX];
+  int nhot = 0;
+  uint64_t count;
+
+  /*Its commands do not take the locks the snapshot copies under*/
+  if (engine == &atomic_engine) return -2;
+  if (threads < 1) threads = 1;
+  if (ntop < 0) ntop = 0;
+  if (ntop > AGG_MAX_TOP) ntop = AGG_MAX_TOP;
+  memset(out, 0, sizeof(*out));
+  struct part* parts = calloc(threads, sizeof(struct part));
+  if (parts == NULL) return -1;
+
+  long long start = now_ns();
+  /*The bases of hot accounts do not change until the copy is done, and
+  their sub-balances are taken before it starts. Deposits into them from
+  then on only count after the snapshot, they do not touch the bases.*/
+  if (hot != NULL) nhot = hot_lock_all(hot, entries);
+  for (int i = 0; i < nhot; i++) {
+    slots[i] = hot->entries[entries[i]].slot;
+    pending[i] = hot_pending(hot, entries[i]);
+  }
+  int32_t* balances = store_snapshot_begin(s, &count);
+  if (balances != NULL) {
+    for (int i = 0; i < threads; i++) {
+      parts[i].store = s;
+      parts[i].from_stripe = (uint64_t)STORE_LOCKS * i / threads;
+      parts[i].to_stripe = (uint64_t)STORE_LOCKS * (i + 1) / threads;
+    }
+    run_parts(parts, threads, copy_part);
+    store_snapshot_end(s);
+  }
+  for (int i = 0; i < nhot; i++) hot_unlock(hot, entries[i]);
+  if (balances == NULL) {
+    free(parts);
+    return -1;
+  }
+  /*Accounts opened since they got hot are not in the snapshot*/
+  for (int i = 0; i < nhot; i++)
+    if (slots[i] < 0 || (uint64_t)slots[i] >= count) slots[i] = -1;
+  out->snapshot_ns = now_ns() - start;
+
+  start = now_ns();
+  for (int i = 0; i < threads; i++) {
+    parts[i].balances = balances;
+    parts[i].from = count * i / threads;
+    parts[i].to = count * (i + 1) / threads;
+    parts[i].ntop = ntop;
+  }
+  run_parts(parts, threads, scan_part);
+
+  struct aggregate_top* top =
+      malloc(sizeof(*top) * (threads * ntop + nhot + 1));
+  if (top == NULL) {
+    free(balances);
+    free(parts);
+    return -1;
+  }
+  int candidates = 0;
+  out->accounts = count;
+  for (int i = 0; i < threads; i++) {
+    out->total += parts[i].total;
+    out->nonzero += parts[i].nonzero;
+    for (int k = 0; k < AGG_BUCKETS; k++)
+      out->histogram[k] += parts[i].histogram[k];
+    for (int k = 0; k < parts[i].nheap; k++) {
+      uint64_t slot = parts[i].heap[k];
+      int hot_account = 0;
+      for (int h = 0; h < nhot; h++)
+        hot_account |= slots[h] == (int64_t)slot;
+      /*Hot accounts are added below with their sub-balances*/
+      if (hot_account) continue;
+      top[candidates].account = store_account(s, slot);
+      top[candidates++].balance = balances[slot];
+    }
+  }
+  /*Sub-balances only add to the bases, so a hot account that was among
+  the largest of its part still is*/
+  for (int h = 0; h < nhot; h++) {
+    int64_t slot = slots[h];
+    if (slot < 0) continue;
+    int64_t base = balances[slot];
+    int64_t money = base + pending[h];
+    out->total += pending[h];
+    out->nonzero += (money != 0) - (base != 0);
+    out->histogram[bucket(base)]--;
+    out->histogram[bucket(money)]++;
+    if (ntop > 0) {
+      top[candidates].account = store_account(s, slot);
+      top[candidates++].balance = money;
+    }
+  }
+  qsort(top, candidates, sizeof(*top), by_balance);
+  out->ntop = candidates < ntop ? candidates : ntop;
+  memcpy(out->top, top, sizeof(*top) * out->ntop);
+  out->scan_ns = now_ns() - start;
+
+  free(top);
+  free(balances);
+  free(parts);
+  return 0;
+}
+
+void aggregate_write(FILE* out, const struct aggregate* a) {
+  fprintf(out,
+          "{\"accounts\":%llu,\"total\":%lld,\"nonzero\":%llu,"
+          "\"snapshot_ns\":%lld,\"scan_ns\":%lld,\"top\":[",
+          (unsigned long long)a->accounts, (long long)a->total,
+          (unsigned long long)a->nonzero, a->snapshot_ns, a->scan_ns);
+  for (int i = 0; i < a->ntop; i++)
+    fprintf(out, "%s{\"account\":%llu,\"balance\":%lld}", i ? "," : "",
+            (unsigned long long)a->top[i].account,
+            (long long)a->top[i].balance);
+  /*Buckets by the smallest balance they hold*/
+  fprintf(out, "],\"histogram\":{\"negative\":%llu,\"0\":%llu",
+          (unsigned long long)a->histogram[0],
+          (unsigned long long)a->histogram[1]);
+  for (int k = 2; k < AGG_BUCKETS; k++)
+    fprintf(out, ",\"%lld\":%llu", 1LL << (k - 2),
+            (unsigned long long)a->histogram[k]);
+  fprintf(out, "}}\n");
+}
@@ -0,0 +1,69 @@
+#ifndef __AGGREGATE_H__
+#define __AGGREGATE_H__
+
+/**
+ * @file aggregate.h
+ * @brief Totals over all accounts at one moment
+ *
+ * The balances are copied by a snapshot of the store (see store.h) while
+ * desks go on changing them, no lock is held longer than it takes to copy
+ * one lock stripe. The copy is one packed array of balances, which threads
+ * split between them and reduce with vector instructions: the total, the
+ * accounts that hold money, the largest balances and a histogram with a
+ * bucket per power of two. Sub-balances of hot accounts are added to their
+ * accounts as they are when the snapshot starts. There are no snapshots
+ * with the atomic engine, which changes balances without the locks.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "engine.h"
+#include "hot.h"
+#include "store.h"
+
+/*Largest balances reported at most*/
+#define AGG_MAX_TOP 100
+
+/*Negative, zero, [2^k, 2^(k+1)) for k = 0 to 29, then 2^30 and more*/
+#define AGG_BUCKETS 33
+
+struct aggregate_top {
+  uint64_t account;
+  int64_t balance;
+};
+
+struct aggregate {
+  uint64_t accounts;
+  int64_t total;
+  /*Accounts with a balance other than 0*/
+  uint64_t nonzero;
+  uint64_t histogram[AGG_BUCKETS];
+  /*Largest balances first*/
+  int ntop;
+  struct aggregate_top top[AGG_MAX_TOP];
+  /*Time to copy the balances and to reduce them*/
+  long long snapshot_ns;
+  long long scan_ns;
+};
+
+/**
+ * @brief Take a snapshot of all accounts and reduce it
+ *
+ * @param engine the engine desks change balances with
+ * @param hot the hot accounts, NULL if there are none
+ * @param threads threads to copy and scan with
+ * @param ntop number of largest balances, up to AGG_MAX_TOP
+ * @return 0 on success, -1 if there is not enough memory, -2 if the engine
+ * changes balances without the locks, which no snapshot can wait for
+ */
+int aggregate_run(struct account_store* s, const struct engine* engine,
+                  struct hot_accounts* hot, int threads, int ntop,
+                  struct aggregate* out);
+
+/**
+ * @brief Write an aggregate as one line of JSON
+ */
+void aggregate_write(FILE* out, const struct aggregate* a);
+
+#endif  // __AGGREGATE_H__
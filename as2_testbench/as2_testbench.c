@@ -3,13 +3,21 @@
  * Testbench
  *
  * Single-thread event loop with simple per-client state machines.
+ *
+ * With -L the clients generate load instead: they stay connected and send
+ * commands for a given time, either each waiting for its reply (closed
+ * loop) or at a target rate regardless of replies (open loop), and the
+ * throughput and latencies per command are reported as CSV or JSON.
  */
 
 #include <assert.h>
 #include <fcntl.h>
+#include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -20,22 +28,24 @@ enum state {
   uninit = 0,
   inqueue,  // Waiting for "ready"
   cmdsent,  // Waiting for "ok"/"fail" response
-  exiting   // Waiting for notification of process exiting
+  exiting,  // Waiting for notification of process exiting
+  idle      // Connected, waiting for the active clients to finish
 };
 
 struct session {
   int fdin, fdout;             // pipes to the client
   enum state state;            // state of client connection
   pid_t pid;                   // PID of client process
+  int idle;                    // client only connects and waits
   char response[RESPBUFSIZE];  // buffer for reading responses
 };
 
 /**
  * Initialize a client.
  * \param c Client structure to initialize.
- * \param bin Binary to run for the client.
+ * \param args Binary to run for the client and its arguments.
  * \return 0 on success, -1 on failure. */
-int client_init(struct session *c, const char *bin) {
+int client_init(struct session *c, char *const *args) {
   if (c == NULL) return -1;
   c->state = uninit;
   int pin[2], pout[2];
@@ -62,7 +72,7 @@ int client_init(struct session *c, const char *bin) {
     dup(pin[1]);
     close(pin[1]);
     close(pin[0]);
-    execl(bin, bin, NULL);
+    execv(args[0], args);
     return -1;  // exec() failed
   } else {
     c->pid = pid;
@@ -91,7 +101,7 @@ void client_close(struct session *c) {
  * \param t Client structure table.
  * \param max Size of client table.
  * \param pid Process ID that terminated.
- * \return 0 on success, -1 on failure. */
+ * \return index of the client on success, -1 on failure. */
 int client_reap_pid(struct session *t, int max, int pid) {
   int i;
   for (i = 0; i < max; i++) {
@@ -99,7 +109,7 @@ int client_reap_pid(struct session *t, int max, int pid) {
     if (c->state == uninit) continue;
     if (c->pid == pid) {
       client_close(c);
-      return 0;
+      return i;
     }
   }
   printf("Couldn't fild client with pid %d to reap\n", pid);
@@ -161,6 +171,387 @@ void client_cmdquit(struct session *c, int i) {
   write(c->fdout, cmdquit, strlen(cmdquit));
 }
 
+/*
+ * Load generation
+ */
+
+#define NUMOPS 4            // commands in the mix: l, w, d, t
+#define MAXPENDING 1024     // commands a client may have unanswered
+#define LINEBUFSIZE 1024    // partial reply lines of a client
+#define READYTIMEOUT 10000  // ms to wait for the clients to connect
+#define DRAINTIMEOUT 5000   // ms to wait for replies after the run
+
+static const char opnames[NUMOPS] = {'l', 'w', 'd', 't'};
+
+struct loadconfig {
+  double rate;           // commands per second over all clients, 0 = closed
+  int weights[NUMOPS];   // relative frequency of each command
+  int accounts;          // commands use accounts 0 .. accounts-1
+  double skew;           // Zipf exponent of the accounts, 0 = uniform
+  double warmup;         // seconds before measuring
+  double duration;       // seconds measured
+  int json;              // JSON instead of CSV
+};
+
+struct sent {
+  long long ns;  // when the command was due, or sent in closed loop
+  int op;
+};
+
+struct loadclient {
+  struct sent pending[MAXPENDING];  // unanswered commands, oldest first
+  int head, count;
+  long long next_ns;  // next command is due (open loop)
+  char line[LINEBUFSIZE];
+  int linelen;
+};
+
+struct samples {
+  long long *ns;  // latencies of the measured commands
+  size_t n, cap;
+  long errors;  // commands that were answered with a failure
+};
+
+static double *account_cdf;  // cumulative probability of each account
+
+long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Parse a command mix like "l=40,w=20,d=20,t=20".
+ * \param s Mix given on the command line.
+ * \param w Weight of each command, set from s.
+ * \return 0 on success, -1 if s is not a valid mix. */
+int parse_mix(const char *s, int *w) {
+  int total = 0;
+  memset(w, 0, NUMOPS * sizeof(int));
+  while (*s) {
+    char op;
+    int weight, len;
+    if (sscanf(s, "%c=%d%n", &op, &weight, &len) != 2 || weight < 0)
+      return -1;
+    const char *p = memchr(opnames, op, NUMOPS);
+    if (p == NULL) return -1;
+    w[p - opnames] = weight;
+    total += weight;
+    s += len;
+    if (*s == ',') s++;
+  }
+  return total > 0 ? 0 : -1;
+}
+
+/**
+ * Prepare drawing accounts with probability proportional to 1/(rank+1)^skew.
+ * \param cfg Load configuration.
+ * \return 0 on success, -1 on failure. */
+int accounts_init(const struct loadconfig *cfg) {
+  account_cdf = malloc(cfg->accounts * sizeof(double));
+  if (account_cdf == NULL) return -1;
+  double sum = 0;
+  for (int i = 0; i < cfg->accounts; i++) {
+    sum += 1.0 / pow(i + 1, cfg->skew);
+    account_cdf[i] = sum;
+  }
+  for (int i = 0; i < cfg->accounts; i++) account_cdf[i] /= sum;
+  return 0;
+}
+
+/**
+ * Draw an account number.
+ * \param cfg Load configuration.
+ * \return account number. */
+int draw_account(const struct loadconfig *cfg) {
+  double u = random() / ((double)RAND_MAX + 1);
+  int lo = 0, hi = cfg->accounts - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (account_cdf[mid] <= u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Draw a command from the mix and send it.
+ * \param c Client structure.
+ * \param l Load state of the client.
+ * \param cfg Load configuration.
+ * \param due When the command was due. */
+void load_send(struct session *c, struct loadclient *l,
+               const struct loadconfig *cfg, long long due) {
+  char cmdbuf[CMDBUFSIZ * 2];
+  int total = 0, op = 0, len;
+  for (int i = 0; i < NUMOPS; i++) total += cfg->weights[i];
+  int r = (int)(random() % total);
+  while (r >= cfg->weights[op]) r -= cfg->weights[op++];
+  int amount = (int)(random() % 100) + 1;
+  if (opnames[op] == 't')
+    len = snprintf(cmdbuf, sizeof(cmdbuf), "t %d %d %d\n", draw_account(cfg),
+                   draw_account(cfg), amount);
+  else if (opnames[op] == 'l')
+    len = snprintf(cmdbuf, sizeof(cmdbuf), "l %d\n", draw_account(cfg));
+  else
+    len = snprintf(cmdbuf, sizeof(cmdbuf), "%c %d %d\n", opnames[op],
+                   draw_account(cfg), amount);
+  struct sent *s = &l->pending[(l->head + l->count) % MAXPENDING];
+  s->ns = due;
+  s->op = op;
+  l->count++;
+  write(c->fdout, cmdbuf, len);
+}
+
+/**
+ * Add a latency to the samples of a command.
+ * \param s Samples of the command.
+ * \param ns Latency.
+ * \return 0 on success, -1 if out of memory. */
+int samples_add(struct samples *s, long long ns) {
+  if (s->n == s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 4096;
+    long long *p = realloc(s->ns, cap * sizeof(long long));
+    if (p == NULL) return -1;
+    s->ns = p;
+    s->cap = cap;
+  }
+  s->ns[s->n++] = ns;
+  return 0;
+}
+
+int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Latency below which a fraction p of the sorted samples are, in us.
+ * \param s Sorted samples.
+ * \param p Fraction.
+ * \return latency in microseconds. */
+double percentile_us(const struct samples *s, double p) {
+  if (s->n == 0) return 0;
+  size_t i = (size_t)(p * s->n);
+  if (i >= s->n) i = s->n - 1;
+  return s->ns[i] / 1000.0;
+}
+
+/**
+ * Print one row of results.
+ * \param name Command letter or "all".
+ * \param s Sorted samples.
+ * \param cfg Load configuration.
+ * \param first First row of the JSON object. */
+void report_row(const char *name, const struct samples *s,
+                const struct loadconfig *cfg, int first) {
+  if (cfg->json)
+    printf(
+        "%s\"%s\":{\"count\":%zu,\"throughput\":%.1f,\"errors\":%ld,"
+        "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+        first ? "" : ",", name, s->n, s->n / cfg->duration, s->errors,
+        percentile_us(s, 0.5), percentile_us(s, 0.99),
+        percentile_us(s, 0.999), percentile_us(s, 1));
+  else
+    printf("%s,%zu,%.1f,%ld,%.1f,%.1f,%.1f,%.1f\n", name, s->n,
+           s->n / cfg->duration, s->errors, percentile_us(s, 0.5),
+           percentile_us(s, 0.99), percentile_us(s, 0.999),
+           percentile_us(s, 1));
+}
+
+/**
+ * Handle a reply line of a client.
+ * \param l Load state of the client.
+ * \param line Reply, without the newline.
+ * \param stats Samples per command.
+ * \param from Start of the measured time.
+ * \param to End of the measured time.
+ * \return 1 if the line answered a command, 0 otherwise. */
+int load_reply(struct loadclient *l, const char *line, struct samples *stats,
+               long long from, long long to) {
+  // "ready" and empty lines do not answer a command
+  if (l->count == 0 || line[0] == '\0') return 0;
+  struct sent *s = &l->pending[l->head];
+  l->head = (l->head + 1) % MAXPENDING;
+  l->count--;
+  if (s->ns < from || s->ns >= to) return 1;
+  struct samples *st = &stats[s->op];
+  if (samples_add(st, now_ns() - s->ns) < 0) return 1;
+  if (strncmp(line, "fail", 4) == 0 || strncmp(line, "No account", 10) == 0 ||
+      strstr(line, "not sufficient") != NULL)
+    st->errors++;
+  return 1;
+}
+
+/**
+ * Run clients that send commands for a given time and report latencies.
+ * \param cfg Load configuration.
+ * \param numclients Number of clients.
+ * \param args Client binary and its arguments.
+ * \return 0 on success, -1 on failure. */
+int run_load(const struct loadconfig *cfg, int numclients, char *const *args) {
+  struct session *clients = calloc(numclients, sizeof(struct session));
+  struct loadclient *loads = calloc(numclients, sizeof(struct loadclient));
+  struct pollfd *pfds = calloc(numclients, sizeof(struct pollfd));
+  struct samples stats[NUMOPS + 1];
+  if (clients == NULL || loads == NULL || pfds == NULL ||
+      accounts_init(cfg) < 0)
+    return -1;
+  memset(stats, 0, sizeof(stats));
+
+  for (int i = 0; i < numclients; i++) {
+    if (client_init(&clients[i], args) != 0) {
+      fprintf(stderr, "#%d: Client creation failed, aborting\n", i);
+      return -1;
+    }
+  }
+
+  // Mean time between the commands of one client in open loop
+  double gap_ns = cfg->rate > 0 ? numclients * 1e9 / cfg->rate : 0;
+  long long start = 0, from = 0, to = 0, drained = 0;
+  long long ready_by = now_ns() + READYTIMEOUT * 1000000LL;
+  int numready = 0, outstanding = 0;
+  long dropped = 0;
+  for (;;) {
+    long long now = now_ns();
+    // Start once every client is connected, or the rest never will be
+    if (!start && (numready == numclients || now >= ready_by)) {
+      start = now;
+      from = start + (long long)(cfg->warmup * 1e9);
+      to = from + (long long)(cfg->duration * 1e9);
+      drained = to + DRAINTIMEOUT * 1000000LL;
+      if (numready < numclients)
+        fprintf(stderr, "Only %d of %d clients connected\n", numready,
+                numclients);
+      for (int i = 0; i < numclients; i++) {
+        struct session *c = &clients[i];
+        if (c->state != idle) continue;
+        c->state = cmdsent;
+        if (gap_ns > 0) {
+          loads[i].next_ns = start - (long long)(log(1.0 - random() /
+                                                 ((double)RAND_MAX + 1)) *
+                                                 gap_ns);
+        } else {
+          load_send(c, &loads[i], cfg, now);
+          outstanding++;
+        }
+      }
+    }
+    if (start && (now >= drained || (now >= to && outstanding == 0))) break;
+    // Send what is due, and find out how long we may sleep
+    long long wake = start ? (now < to ? to : drained) : ready_by;
+    for (int i = 0; i < numclients && start && gap_ns > 0 && now < to; i++) {
+      struct loadclient *l = &loads[i];
+      if (clients[i].state != cmdsent) continue;
+      while (l->next_ns <= now && l->next_ns < to) {
+        // A client that is this far behind drops the command
+        if (l->count < MAXPENDING) {
+          load_send(&clients[i], l, cfg, l->next_ns);
+          outstanding++;
+        } else {
+          dropped++;
+        }
+        l->next_ns -= (long long)(log(1.0 - random() /
+                                      ((double)RAND_MAX + 1)) *
+                                  gap_ns);
+      }
+      if (l->next_ns < wake) wake = l->next_ns;
+    }
+    int nfds = 0;
+    for (int i = 0; i < numclients; i++) {
+      if (clients[i].state == uninit) continue;
+      pfds[nfds].fd = clients[i].fdin;
+      pfds[nfds].events = POLLIN;
+      nfds++;
+    }
+    int timeout = (int)((wake - now + 999999) / 1000000);
+    if (poll(pfds, nfds, timeout < 0 ? 0 : timeout) <= 0) continue;
+    nfds = 0;
+    for (int i = 0; i < numclients; i++) {
+      struct session *c = &clients[i];
+      struct loadclient *l = &loads[i];
+      if (c->state == uninit) continue;
+      if (pfds[nfds++].revents == 0) continue;
+      int len = read(c->fdin, l->line + l->linelen,
+                     LINEBUFSIZE - 1 - l->linelen);
+      if (len <= 0) {
+        fprintf(stderr, "#%d: Client closed connection abruptly!\n", i);
+        outstanding -= l->count;
+        client_close(c);
+        continue;
+      }
+      l->linelen += len;
+      l->line[l->linelen] = '\0';
+      char *line = l->line, *nl;
+      while ((nl = strchr(line, '\n')) != NULL) {
+        *nl = '\0';
+        if (c->state == inqueue && strcmp(line, "ready") == 0) {
+          c->state = idle;
+          numready++;
+        } else if (c->state == cmdsent &&
+                   load_reply(l, line, stats, from, to)) {
+          outstanding--;
+          // Closed loop: the reply lets the client send the next command
+          if (gap_ns == 0 && now_ns() < to) {
+            load_send(c, l, cfg, now_ns());
+            outstanding++;
+          }
+        }
+        line = nl + 1;
+      }
+      l->linelen -= line - l->line;
+      memmove(l->line, line, l->linelen);
+      // A line longer than the buffer is not a reply we know
+      if (l->linelen == LINEBUFSIZE - 1) l->linelen = 0;
+    }
+  }
+
+  // Let the clients go and wait for them
+  for (int i = 0; i < numclients; i++) {
+    if (clients[i].state == uninit) continue;
+    write(clients[i].fdout, "q\n", 2);
+    client_close(&clients[i]);
+  }
+  while (wait(NULL) > 0) {
+  }
+
+  struct samples *all = &stats[NUMOPS];
+  for (int op = 0; op < NUMOPS; op++) {
+    for (size_t k = 0; k < stats[op].n; k++)
+      samples_add(all, stats[op].ns[k]);
+    all->errors += stats[op].errors;
+    qsort(stats[op].ns, stats[op].n, sizeof(long long), cmp_ll);
+  }
+  qsort(all->ns, all->n, sizeof(long long), cmp_ll);
+  if (cfg->json)
+    printf(
+        "{\"clients\":%d,\"connected\":%d,\"rate\":%.1f,\"accounts\":%d,"
+        "\"skew\":%.2f,\"warmup_s\":%.1f,\"duration_s\":%.1f,"
+        "\"dropped\":%ld,\"ops\":{",
+        numclients, numready, cfg->rate, cfg->accounts, cfg->skew,
+        cfg->warmup, cfg->duration, dropped);
+  else
+    printf("op,count,throughput,errors,p50_us,p99_us,p999_us,max_us\n");
+  if (dropped > 0 && !cfg->json)
+    fprintf(stderr, "%ld commands were dropped, the clients fell behind\n",
+            dropped);
+  for (int op = 0; op < NUMOPS; op++) {
+    char name[2] = {opnames[op], '\0'};
+    report_row(name, &stats[op], cfg, op == 0);
+  }
+  report_row("all", all, cfg, 0);
+  if (cfg->json) printf("}}\n");
+
+  for (int op = 0; op <= NUMOPS; op++) free(stats[op].ns);
+  free(account_cdf);
+  free(pfds);
+  free(loads);
+  free(clients);
+  return 0;
+}
+
 /**
  * Main function.
  * \param argc Argument count.
@@ -170,10 +561,47 @@ int main(int argc, char **argv) {
   time_t seed = time(NULL);
   int numtests = 100;
   int maxclients = 10;
+  int numidle = 0;
+  int load = 0;
+  struct loadconfig cfg = {.rate = 0,
+                           .weights = {40, 20, 20, 20},
+                           .accounts = 20,
+                           .skew = 0,
+                           .warmup = 1,
+                           .duration = 10,
+                           .json = 0};
 
+  // Options end at the binary, the rest are arguments of the binary
   int opt;
-  while ((opt = getopt(argc, argv, "c:n:s:")) != -1) {
+  while ((opt = getopt(argc, argv, "+c:n:s:i:Lr:m:a:z:W:D:o:")) != -1) {
     switch (opt) {
+      case 'L':
+        load = 1;
+        break;
+      case 'r':
+        cfg.rate = atof(optarg);
+        break;
+      case 'm':
+        if (parse_mix(optarg, cfg.weights) < 0) {
+          printf("Mix is like l=40,w=20,d=20,t=20\n");
+          return -1;
+        }
+        break;
+      case 'a':
+        cfg.accounts = atoi(optarg);
+        break;
+      case 'z':
+        cfg.skew = atof(optarg);
+        break;
+      case 'W':
+        cfg.warmup = atof(optarg);
+        break;
+      case 'D':
+        cfg.duration = atof(optarg);
+        break;
+      case 'o':
+        cfg.json = strcmp(optarg, "json") == 0;
+        break;
       case 'n':
         numtests = atoi(optarg);
         break;
@@ -183,9 +611,17 @@ int main(int argc, char **argv) {
       case 's':
         seed = atoi(optarg);
         break;
+      case 'i':
+        numidle = atoi(optarg);
+        break;
       default:
-        printf("Usage: %s [-c numclients] [-n numtests] [-s seedval] binary\n",
-               argv[0]);
+        printf(
+            "Usage: %s [-c numclients] [-n numtests] [-s seedval] "
+            "[-i numidle] binary [args]\n"
+            "       %s -L [-c numclients] [-r rate] [-m mix] [-a accounts] "
+            "[-z skew] [-W warmup_s] [-D duration_s] [-o csv|json] "
+            "[-s seedval] binary [args]\n",
+            argv[0], argv[0]);
         return -1;
     }
   }
@@ -193,87 +629,123 @@ int main(int argc, char **argv) {
     printf("Missing executable to test\n");
     return -1;
   }
-  // Initialize random number generator with seed value
-  printf("Random seed = %ld\n", seed);
-  srandom(seed);
-
   // argv[optind] is the first non-option paramete
-  char *bin = argv[optind];
+  char **bin = &argv[optind];
 
   signal(SIGPIPE, SIG_IGN);  // Let's ignore SIGPIPE
 
-  struct session *clients = calloc(maxclients, sizeof(struct session));
+  // Idle clients hold two pipes each, allow as many descriptors as we can
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  if (load) {
+    if (maxclients < 1 || cfg.accounts < 1 || cfg.duration <= 0 ||
+        cfg.warmup < 0 || cfg.rate < 0) {
+      printf("Invalid load parameters\n");
+      return -1;
+    }
+    // Results go to stdout, so the seed goes to stderr
+    fprintf(stderr, "Random seed = %ld\n", seed);
+    srandom(seed);
+    return run_load(&cfg, maxclients, bin) < 0 ? -1 : 0;
+  }
+
+  // Initialize random number generator with seed value
+  printf("Random seed = %ld\n", seed);
+  srandom(seed);
+
+  // Active clients are followed by the idle ones in the table
+  int totalclients = maxclients + numidle;
+  struct session *clients = calloc(totalclients, sizeof(struct session));
+  struct pollfd *pfds = calloc(totalclients, sizeof(struct pollfd));
+  int *pidx = calloc(totalclients, sizeof(int));
+  if (clients == NULL || pfds == NULL || pidx == NULL) return -1;
   int numclients = 0;
+  int numactive = 0;
+  int idleready = 0;
+  int idlereleased = 0;
 
   // Create all clients
   int i;
-  for (i = 0; i < maxclients; i++) {
+  for (i = 0; i < totalclients; i++) {
     struct session *c = &clients[i];
-    printf("#%d: Creating a new client\n", i);
+    c->idle = i >= maxclients;
+    printf("#%d: Creating a new %sclient\n", i, c->idle ? "idle " : "");
     if (client_init(c, bin) != 0) {
       printf("%d: Client creation failed, aborting\n", i);
       return -1;
     }
     numclients++;
+    if (!c->idle) numactive++;
   }
 
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   int commands_to_run = numtests;
   int running = 1;
   while (running) {
-    int maxfd = 0, res;
-    fd_set set;
-    // Prepare fdset for select()
-    FD_ZERO(&set);
-    for (i = 0; i < maxclients; i++) {
+    int nfds = 0, res;
+    // Prepare pollfds for poll()
+    for (i = 0; i < totalclients; i++) {
       struct session *c = &clients[i];
       // Add clients that are in state of waiting to read a response
       if ((c->state == cmdsent) || (c->state == inqueue)) {
-        FD_SET(c->fdin, &set);
-        if (c->fdin > maxfd) maxfd = c->fdin;
+        pfds[nfds].fd = c->fdin;
+        pfds[nfds].events = POLLIN;
+        pidx[nfds] = i;
+        nfds++;
       }
     }
-    // select
-    // printf("Entering select()\n");
-    struct timeval timeout = {1, 0};  // 1 second wait
-    res = select(maxfd + 1, &set, NULL, NULL, &timeout);
-    // printf("select() returned: %d\n", res);
+    // poll, 1 second wait
+    res = poll(pfds, nfds, 1000);
     //  check client responses
-    for (i = 0; i < maxclients; i++) {
+    int k;
+    for (k = 0; k < nfds && res > 0; k++) {
+      if (pfds[k].revents == 0) continue;
+      i = pidx[k];
       struct session *c = &clients[i];
-      if (FD_ISSET(c->fdin, &set)) {
-        /* Client is ready for reading, go ahead... */
-        res = read(c->fdin, c->response, RESPBUFSIZE - 1);
-        if (res < 0) {  // read failed
-          printf("#%d: Read from client failed\n", i);
-          client_close(c);
-        } else if (res == 0) {  // pipe closed
-          if (c->state != exiting) {
-            printf("#%d: Client closed connection abruptly!\n", i);
-          }
-          client_close(c);
-        } else {
-          c->response[res] = '\0';
-          printf("#%d: read: %s", i, c->response);
-          if (c->state == inqueue) {
-            if (strncmp("ready\n", c->response, 6) == 0) {
-              if (commands_to_run > 0) {
-                // send next command, decrement count
-                client_newcmd(c, i);
-                commands_to_run--;
-              } else {  // Otherwise, send quit command
+      /* Client is ready for reading, go ahead... */
+      int len = read(c->fdin, c->response, RESPBUFSIZE - 1);
+      if (len < 0) {  // read failed
+        printf("#%d: Read from client failed\n", i);
+        client_close(c);
+      } else if (len == 0) {  // pipe closed
+        if (c->state != exiting) {
+          printf("#%d: Client closed connection abruptly!\n", i);
+        }
+        client_close(c);
+      } else {
+        c->response[len] = '\0';
+        printf("#%d: read: %s", i, c->response);
+        if (c->state == inqueue) {
+          if (strncmp("ready\n", c->response, 6) == 0) {
+            if (c->idle) {
+              // Keep the connection open without sending anything
+              idleready++;
+              if (idlereleased)
                 client_cmdquit(c, i);
-              }
+              else
+                c->state = idle;
+            } else if (commands_to_run > 0) {
+              // send next command, decrement count
+              client_newcmd(c, i);
+              commands_to_run--;
+            } else {  // Otherwise, send quit command
+              client_cmdquit(c, i);
             }
-            continue;
-          }
-          // Are there more commands to run?
-          if (commands_to_run > 0) {
-            // send next command, decrement count
-            client_newcmd(c, i);
-            commands_to_run--;
-          } else {  // Otherwise, send quit command
-            client_cmdquit(c, i);
           }
+          continue;
+        }
+        // Are there more commands to run?
+        if (commands_to_run > 0) {
+          // send next command, decrement count
+          client_newcmd(c, i);
+          commands_to_run--;
+        } else {  // Otherwise, send quit command
+          client_cmdquit(c, i);
         }
       }
     }
@@ -282,14 +754,24 @@ int main(int argc, char **argv) {
     int ret;
     while ((res = waitpid(-1, &ret, WNOHANG)) > 0) {
       printf("Reaping clients\n");
-      client_reap_pid(clients, maxclients, res);
+      int idx = client_reap_pid(clients, totalclients, res);
       numclients--;
+      if (idx >= 0 && !clients[idx].idle) numactive--;
+    }
+    // once the active clients are done, let the idle clients go
+    if ((commands_to_run <= 0) && (numactive == 0) && !idlereleased) {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      idlereleased = 1;
+      for (i = maxclients; i < totalclients; i++) {
+        struct session *c = &clients[i];
+        if (c->state == idle) client_cmdquit(c, i);
+      }
     }
     // if there are no commands left and all clients are dead, break out
     if ((commands_to_run <= 0) && (numclients == 0)) break;
     // if there are commands left, init one new client
-    if ((commands_to_run > 0) && (numclients < maxclients)) {
-      // Find empty client index
+    if ((commands_to_run > 0) && (numactive < maxclients)) {
+      // Find empty client index among the active clients
       for (i = 0; i < maxclients; i++) {
         struct session *c = &clients[i];
         if (c->state != uninit) continue;
@@ -298,12 +780,21 @@ int main(int argc, char **argv) {
           return -1;
         }
         numclients++;
+        numactive++;
       }
     }
-    printf("cmds: %d, clients: %d\n", commands_to_run, numclients);
+    printf("cmds: %d, clients: %d, idle: %d\n", commands_to_run, numclients,
+           idleready);
   }
 
   printf("Test with %d commands successful\n", numtests);
+  if (numidle > 0) {
+    printf("%d of %d idle clients were connected, commands took %.3f s\n",
+           idleready, numidle,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  }
+  free(pidx);
+  free(pfds);
   free(clients);
   return 0;
 }
@@ -0,0 +1,226 @@
+#include "bank.h"
+
+#include <limits.h>
+
+/*Reserve the log records of a change before making it, if there is a log,
+so whoever sees the change commits after its records*/
+static void log_reserve(struct bank* b, int n, struct wal_slots* slots) {
+  if (b->wal != NULL) wal_reserve(b->wal, n, slots);
+}
+
+/*Log a change if it was made, or void the record reserved for it*/
+static void log_change(struct bank* b, const struct wal_slots* slots,
+                       int made, uint8_t op, uint64_t acc1, uint64_t acc2,
+                       int64_t amount) {
+  struct wal_record r = {0, op, 0, acc1, acc2, amount};
+  if (b->wal != NULL) wal_fill(b->wal, slots, &r, made);
+}
+
+/*Add the sub-balances of account to out if it is among the locked hot
+accounts*/
+static void add_pending(struct bank* b, const int* entries, int n,
+                        uint64_t account, int64_t* out) {
+  for (int i = 0; i < n; i++)
+    if (atomic_load(&b->hot->entries[entries[i]].id) == account)
+      *out += hot_pending(b->hot, entries[i]);
+}
+
+static enum proto_status balance(struct bank* b, uint64_t accno,
+                                 int64_t* out) {
+  int e = b->hot != NULL ? hot_lock(b->hot, accno) : -1;
+  enum proto_status status = b->engine->balance(b->store, accno, out);
+  if (e >= 0) {
+    *out += hot_pending(b->hot, e);
+    hot_unlock(b->hot, e);
+  }
+  return status;
+}
+
+static enum proto_status withdraw(struct bank* b, uint64_t accno,
+                                  int32_t amount, int64_t* out) {
+  int e = b->hot != NULL ? hot_lock(b->hot, accno) : -1;
+  enum proto_status status = b->engine->withdraw(b->store, accno, amount, out);
+  if (e >= 0) {
+    /*Only short if the deposits in the sub-balances do not cover it either*/
+    if (status == ST_INSUFFICIENT && hot_fold(b->hot, e) > 0)
+      status = b->engine->withdraw(b->store, accno, amount, out);
+    *out += hot_pending(b->hot, e);
+    hot_unlock(b->hot, e);
+  }
+  return status;
+}
+
+static enum proto_status deposit(struct bank* b, uint64_t accno,
+                                 int32_t amount, int64_t* out) {
+  if (b->hot == NULL) return b->engine->deposit(b->store, accno, amount, out);
+  if (hot_deposit(b->hot, accno, amount, out) == 0) return ST_OK;
+  int e = hot_lock(b->hot, accno);
+  uint64_t waits = engine_waits();
+  enum proto_status status = b->engine->deposit(b->store, accno, amount, out);
+  if (e >= 0) {
+    *out += hot_pending(b->hot, e);
+    hot_unlock(b->hot, e);
+  } else if (status == ST_OK && engine_waits() != waits) {
+    hot_note_wait(b->hot, accno);
+  }
+  return status;
+}
+
+/*Run the legs of a transaction with the hot accounts among them folded*/
+static enum proto_status transact(struct bank* b, const struct leg* legs,
+                                  int n, uint64_t* account, int64_t* out) {
+  int entries[PROTO_MAX_LEGS];
+  int locked = 0;
+  if (b->hot != NULL && n <= PROTO_MAX_LEGS)
+    locked = hot_lock_legs(b->hot, legs, n, entries);
+  enum proto_status status =
+      b->engine->transact(b->store, legs, n, account, out);
+  if (status == ST_OK || status == ST_INSUFFICIENT)
+    if (locked > 0) add_pending(b, entries, locked, *account, out);
+  for (int i = locked - 1; i >= 0; i--) hot_unlock(b->hot, entries[i]);
+  return status;
+}
+
+static enum proto_status transfer(struct bank* b, uint64_t from, uint64_t to,
+                                  int32_t amount, int64_t* out) {
+  struct leg legs[2] = {{from, -(int64_t)amount}, {to, amount}};
+  int entries[2];
+  int locked = b->hot != NULL ? hot_lock_legs(b->hot, legs, 2, entries) : 0;
+  enum proto_status status =
+      b->engine->transfer(b->store, from, to, amount, out);
+  if (status == ST_OK || status == ST_INSUFFICIENT)
+    if (locked > 0) add_pending(b, entries, locked, from, out);
+  for (int i = locked - 1; i >= 0; i--) hot_unlock(b->hot, entries[i]);
+  return status;
+}
+
+/*Run the legs of a transaction and log them as one batch*/
+static enum proto_status execute_transaction(struct bank* b,
+                                             const struct request* req,
+                                             struct response* resp,
+                                             atomic_llong* bal) {
+  struct wal_record records[PROTO_MAX_LEGS];
+  struct wal_slots slots;
+  if (req->nlegs == 0) return ST_BAD_REQUEST;
+  for (int i = 0; i < req->nlegs; i++)
+    if (req->legs[i].amount < INT_MIN || req->legs[i].amount > INT_MAX)
+      return ST_BAD_AMOUNT;
+  log_reserve(b, req->nlegs, &slots);
+  enum proto_status status =
+      transact(b, req->legs, req->nlegs, &resp->account, &resp->value);
+  if (status != ST_OK) {
+    if (b->wal != NULL) wal_fill(b->wal, &slots, NULL, 0);
+    return status;
+  }
+  for (int i = 0; i < req->nlegs; i++) {
+    struct wal_record r = {0, OP_TRANSACT, 0, req->legs[i].account, 0,
+                           req->legs[i].amount};
+    records[i] = r;
+    bank_add_balance(bal, req->legs[i].amount);
+  }
+  if (b->wal != NULL) wal_fill(b->wal, &slots, records, req->nlegs);
+  return ST_OK;
+}
+
+/*Open a new account and log it*/
+static enum proto_status execute_open(struct bank* b,
+                                      const struct request* req) {
+  uint64_t slot;
+  struct wal_slots slots;
+  /*Negative numbers stay account numbers nobody has*/
+  if (req->acc1 > INT64_MAX) return ST_BAD_REQUEST;
+  log_reserve(b, 1, &slots);
+  int ret = store_open_account(b->store, req->acc1, &slot);
+  log_change(b, &slots, ret == 0, OP_OPEN, req->acc1, 0, 0);
+  switch (ret) {
+    case 0:
+      return ST_OK;
+    case 1:
+      return ST_EXISTS;
+    default:
+      return ST_FULL;
+  }
+}
+
+static void execute(struct bank* b, const struct request* req,
+                    struct response* resp, atomic_llong* bal) {
+  uint64_t accno = req->acc1;
+  uint64_t accno2 = req->acc2;
+  int amount = (int)req->amount;
+  struct wal_slots slots;
+
+  resp->op = req->op;
+  resp->status = ST_OK;
+  resp->body_len = 0;
+  resp->value = 0;
+  resp->account = 0;
+  if (b->hot != NULL) hot_tick(b->hot);
+  if (req->amount < INT_MIN || req->amount > INT_MAX) {
+    resp->status = ST_BAD_AMOUNT;
+    return;
+  }
+  switch (req->op) {
+    case OP_QUIT:
+      return;
+    case OP_LIST:
+      resp->status = balance(b, accno, &resp->value);
+      break;
+    case OP_WITHDRAW:
+      log_reserve(b, 1, &slots);
+      resp->status = withdraw(b, accno, amount, &resp->value);
+      if (resp->status == ST_OK) bank_add_balance(bal, -amount);
+      log_change(b, &slots, resp->status == ST_OK, req->op, accno, 0, amount);
+      break;
+    case OP_TRANSFER:
+      log_reserve(b, 1, &slots);
+      resp->status = transfer(b, accno, accno2, amount, &resp->value);
+      log_change(b, &slots, resp->status == ST_OK, req->op, accno, accno2,
+                 amount);
+      break;
+    case OP_DEPOSIT:
+      log_reserve(b, 1, &slots);
+      resp->status = deposit(b, accno, amount, &resp->value);
+      if (resp->status == ST_OK) bank_add_balance(bal, amount);
+      log_change(b, &slots, resp->status == ST_OK, req->op, accno, 0, amount);
+      break;
+    case OP_TRANSACT:
+      resp->status = execute_transaction(b, req, resp, bal);
+      break;
+    case OP_OPEN:
+      resp->status = execute_open(b, req);
+      break;
+    default:
+      resp->status = ST_UNKNOWN;
+      return;
+  }
+  /*Every answer about an account carries its balance, and which account
+  that is for a transaction*/
+  if (resp->status == ST_OK || resp->status == ST_INSUFFICIENT)
+    resp->body_len = sizeof(int64_t);
+  if (resp->body_len > 0 && req->op == OP_TRANSACT)
+    resp->body_len += sizeof(uint64_t);
+}
+
+void bank_execute(struct bank* b, const struct request* req,
+                  struct response* resp, atomic_llong* bal) {
+  if (b->pause != NULL) pthread_rwlock_rdlock(b->pause);
+  execute(b, req, resp, bal);
+  if (b->pause != NULL) pthread_rwlock_unlock(b->pause);
+}
+
+int bank_checkpoint(struct bank* b) {
+  int entries[HOT_MAX];
+  if (b->pause != NULL) pthread_rwlock_wrlock(b->pause);
+  /*Deposits in the sub-balances are in the log, so they go into the
+  balances written*/
+  if (b->hot != NULL) {
+    int n = hot_lock_all(b->hot, entries);
+    for (int i = 0; i < n; i++) hot_fold(b->hot, entries[i]);
+    for (int i = n - 1; i >= 0; i--) hot_unlock(b->hot, entries[i]);
+  }
+  uint64_t lsn = wal_last_lsn(b->wal);
+  int ok = wal_commit(b->wal, lsn) == 0 &&
+           store_checkpoint(b->store, lsn) == 0 && wal_truncate(b->wal) == 0;
+  if (b->pause != NULL) pthread_rwlock_unlock(b->pause);
+  return ok ? 0 : -1;
+}
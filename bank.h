@@ -0,0 +1,74 @@
+#ifndef __BANK_H__
+#define __BANK_H__
+
+/**
+ * @file bank.h
+ * @brief Commands run against the accounts, without any client I/O
+ *
+ * A request is checked, run by the engine and, if it changed something,
+ * appended to the write-ahead log. The response holds what the client is
+ * told, in either protocol. Nothing here reads from or writes to a client,
+ * so the commands can be run and measured on their own.
+ *
+ * With hot accounts, deposits to the accounts that desks keep waiting for
+ * go to sub-balances of the desks, see hot.h.
+ *
+ * A checkpoint writes the balances to the accounts file while the desks
+ * run, so the log does not grow until shutdown. Every command holds the
+ * pause lock for reading, the checkpoint takes it for writing, so it sees
+ * no command halfway and the log it empties holds nothing it did not write.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "engine.h"
+#include "hot.h"
+#include "protocol.h"
+#include "store.h"
+#include "wal.h"
+
+struct bank {
+  struct account_store* store;
+  const struct engine* engine;
+  /*Where changes are logged, NULL to not log them*/
+  struct wal* wal;
+  /*Accounts split into sub-balances, NULL to keep every balance whole*/
+  struct hot_accounts* hot;
+  /*Held by every command, NULL if there are no checkpoints while commands
+  run*/
+  pthread_rwlock_t* pause;
+};
+
+/*Add amount to the balance of a desk, only the desk itself does*/
+static inline void bank_add_balance(atomic_llong* bal, long long amount) {
+  atomic_store_explicit(
+      bal, atomic_load_explicit(bal, memory_order_relaxed) + amount,
+      memory_order_relaxed);
+}
+
+/**
+ * @brief Run a request against the accounts
+ *
+ * Quit only sets an empty ST_OK response, the caller ends the session.
+ *
+ * @param b
+ * @param req
+ * @param resp set to the answer for the client
+ * @param bal deposits minus withdrawals of the calling desk, updated
+ */
+void bank_execute(struct bank* b, const struct request* req,
+                  struct response* resp, atomic_llong* bal);
+
+/**
+ * @brief Wait for the commands running, fold the hot accounts, write the
+ * balances to the accounts file and empty the log
+ *
+ * Commands wait until it is done. Needs a log.
+ *
+ * @return 0 on success, -1 if the log or the accounts file could not be
+ * written, the log is kept then
+ */
+int bank_checkpoint(struct bank* b);
+
+#endif  // __BANK_H__
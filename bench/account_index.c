@@ -0,0 +1,154 @@
+/**
+ * @file account_index.c
+ * @brief Lookup throughput and memory of the account index
+ *
+ * Opens accounts with random 64-bit numbers in an empty store, then threads
+ * look up random opened accounts ("hit"), numbers that were never opened
+ * ("miss") and, for comparison, accounts numbered by their slot
+ * ("numbered"). Memory per account is what the index tables and the store
+ * segments take, and how much the resident set grew while opening. The
+ * store is then reopened, which rebuilds the index.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "store.h"
+
+static const char* path = "account_index.acc";
+static long long accounts = 10000000;
+static int threads_max = 8;
+static int lookups = 2000000;
+
+static struct account_store store;
+static uint64_t* ids;
+static const char* kind;
+
+/*Random 64-bit account number below 2^63*/
+static uint64_t random_id(unsigned int* seed) {
+  uint64_t id = 0;
+  for (int i = 0; i < 4; i++) id = (id << 16) ^ (rand_r(seed) & 0xffff);
+  return id >> 1;
+}
+
+static long resident_bytes(void) {
+  long pages = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return 0;
+  if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+  fclose(f);
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+static void* desk(void* arg) {
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  long long found = 0;
+  for (int i = 0; i < lookups; i++) {
+    uint64_t id;
+    if (!strcmp(kind, "hit"))
+      id = ids[((uint64_t)rand_r(&seed) * RAND_MAX + rand_r(&seed)) %
+               accounts];
+    else if (!strcmp(kind, "miss"))
+      id = random_id(&seed) | 1;
+    else
+      id = rand_r(&seed) % 1000;
+    found += store_find(&store, id) >= 0;
+  }
+  return (void*)(long)found;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[64];
+
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  snprintf(params, sizeof(params), "accounts=%lld,kind=%s,threads=%d",
+           accounts, kind, threads);
+  bench_result("account_index", params, "lookups_per_sec",
+               (double)lookups * threads / (elapsed / 1e9), "lookups/s");
+}
+
+int main(int argc, char** argv) {
+  int layout = STORE_LAYOUT_RECORDS;
+  uint64_t slot;
+  char params[64];
+  int opt;
+  while ((opt = getopt(argc, argv, "l:a:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'l':
+        layout = store_layout_by_name(optarg);
+        break;
+      case 'a':
+        accounts = atoll(optarg);
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        lookups = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-l records|padded|columns] [-a accounts] "
+            "[-t max_threads] [-n lookups_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (layout < 0 || accounts < 1 || threads_max < 1) return -1;
+  ids = malloc(accounts * sizeof(uint64_t));
+  if (ids == NULL) return -1;
+
+  /*Numbered accounts 0 to 999 for the comparison, the rest are opened*/
+  unlink(path);
+  if (store_open(&store, path, 1000, layout) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  unsigned int seed = 42;
+  long before = resident_bytes();
+  long long start = bench_now_ns();
+  for (long long i = 0; i < accounts; i++) {
+    /*Even numbers, so that odd ones are never found*/
+    ids[i] = random_id(&seed) & ~1ULL;
+    if (store_open_account(&store, ids[i], &slot) != 0) i--;
+  }
+  long long elapsed = bench_now_ns() - start;
+  long grown = resident_bytes() - before;
+  snprintf(params, sizeof(params), "accounts=%lld,layout=%s", accounts,
+           store_layout_name(layout));
+  bench_result("account_index", params, "opens_per_sec",
+               accounts / (elapsed / 1e9), "opens/s");
+  bench_result("account_index", params, "index_bytes_per_account",
+               (double)atomic_load(&store.index.bytes) / accounts, "B");
+  bench_result("account_index", params, "store_bytes_per_account",
+               (double)store.segment_size / STORE_SEGMENT_ACCOUNTS, "B");
+  bench_result("account_index", params, "resident_bytes_per_account",
+               (double)grown / accounts, "B");
+
+  const char* kinds[] = {"hit", "miss", "numbered"};
+  for (int k = 0; k < 3; k++) {
+    kind = kinds[k];
+    for (int t = 1; t <= threads_max; t *= 2) run(t);
+  }
+
+  store_checkpoint(&store, 1);
+  store_close(&store);
+  start = bench_now_ns();
+  store_open(&store, path, 1000, layout);
+  elapsed = bench_now_ns() - start;
+  bench_result("account_index", params, "reopen", elapsed / 1e6, "ms");
+  store_close(&store);
+  unlink(path);
+  free(ids);
+  return 0;
+}
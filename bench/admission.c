@@ -0,0 +1,176 @@
+/**
+ * @file admission.c
+ * @brief Connection requests admitted per second and idle CPU of the main
+ * loop
+ *
+ * Clients send connection requests to a private message queue as the
+ * connection program does, and a thread takes them off the queue as the
+ * main loop of the server does. "poll" is the old loop that tries msgrcv
+ * with IPC_NOWAIT and sleeps 1 ms after every request, "block" waits in
+ * msgrcv and takes up to 64 waiting requests at once. A burst of requests
+ * from 4 clients gives the admission rate, requests 2 ms apart give the time
+ * from sending a request until it is admitted, and a second without any
+ * requests gives the CPU the loop uses while idle.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define ADMIT_BATCH 64
+#define MSG_CONNECT 1
+#define MSG_SHUTDOWN 2
+#define CLIENTS 4
+
+struct client {
+  long int message_type;
+  char mtext[100];
+};
+
+enum mode { POLL, BLOCK };
+
+static const char* mode_names[] = {"poll", "block"};
+
+static int requests = 4000;
+static int paced = 500;
+
+static int msgid;
+static enum mode mode;
+static long long* lat;
+static atomic_int admitted;
+
+static void admit_one(struct client* c) {
+  long long sent;
+  memcpy(&sent, c->mtext, sizeof(sent));
+  lat[atomic_fetch_add(&admitted, 1)] = bench_now_ns() - sent;
+}
+
+static void* admitter(void* arg) {
+  struct client reqs[ADMIT_BATCH];
+  for (;;) {
+    if (mode == POLL) {
+      if (msgrcv(msgid, &reqs[0], sizeof(reqs[0].mtext), -MSG_SHUTDOWN,
+                 IPC_NOWAIT) >= 0) {
+        if (reqs[0].message_type == MSG_SHUTDOWN) break;
+        admit_one(&reqs[0]);
+      }
+      usleep(1000);
+      continue;
+    }
+    int n = 0;
+    while (n < ADMIT_BATCH &&
+           msgrcv(msgid, &reqs[n], sizeof(reqs[n].mtext), -MSG_SHUTDOWN,
+                  n == 0 ? 0 : IPC_NOWAIT) >= 0) {
+      if (reqs[n].message_type == MSG_SHUTDOWN) return NULL;
+      n++;
+    }
+    for (int i = 0; i < n; i++) admit_one(&reqs[i]);
+  }
+  return NULL;
+}
+
+static void send_request(long type) {
+  struct client c = {type, ""};
+  long long now = bench_now_ns();
+  memcpy(c.mtext, &now, sizeof(now));
+  while (msgsnd(msgid, &c, sizeof(c.mtext), 0) < 0 && errno == EINTR) {
+  }
+}
+
+static void* client(void* arg) {
+  int n = (long)arg;
+  for (int i = 0; i < n; i++) send_request(MSG_CONNECT);
+  return NULL;
+}
+
+static void start(pthread_t* tid) {
+  atomic_store(&admitted, 0);
+  pthread_create(tid, NULL, admitter, NULL);
+}
+
+static void stop(pthread_t tid) {
+  send_request(MSG_SHUTDOWN);
+  pthread_join(tid, NULL);
+}
+
+static void run(void) {
+  pthread_t tid;
+  pthread_t clients[CLIENTS];
+  char params[40];
+  snprintf(params, sizeof(params), "mode=%s", mode_names[mode]);
+
+  /*Burst*/
+  start(&tid);
+  long long begin = bench_now_ns();
+  for (long i = 0; i < CLIENTS; i++)
+    pthread_create(&clients[i], NULL, client,
+                   (void*)(long)(requests / CLIENTS));
+  for (int i = 0; i < CLIENTS; i++) pthread_join(clients[i], NULL);
+  int total = requests / CLIENTS * CLIENTS;
+  while (atomic_load(&admitted) < total) usleep(100);
+  long long elapsed = bench_now_ns() - begin;
+  stop(tid);
+  bench_result("admission", params, "admitted_per_sec",
+               total / (elapsed / 1e9), "conn/s");
+
+  /*Paced*/
+  start(&tid);
+  for (int i = 0; i < paced; i++) {
+    send_request(MSG_CONNECT);
+    usleep(2000);
+  }
+  while (atomic_load(&admitted) < paced) usleep(100);
+  stop(tid);
+  bench_result("admission", params, "p50_admit",
+               bench_percentile(lat, paced, 50) / 1000.0, "us");
+  bench_result("admission", params, "p99_admit",
+               bench_percentile(lat, paced, 99) / 1000.0, "us");
+
+  /*Idle*/
+  struct timespec cpu0, cpu1;
+  start(&tid);
+  usleep(10000);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu0);
+  begin = bench_now_ns();
+  sleep(1);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu1);
+  elapsed = bench_now_ns() - begin;
+  stop(tid);
+  double cpu =
+      (cpu1.tv_sec - cpu0.tv_sec) * 1e9 + (cpu1.tv_nsec - cpu0.tv_nsec);
+  bench_result("admission", params, "idle_cpu", 100.0 * cpu / elapsed, "%");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+    switch (opt) {
+      case 'n':
+        requests = atoi(optarg);
+        break;
+      case 'p':
+        paced = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-n burst_requests] [-p paced_requests]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (requests < CLIENTS || paced < 1) return -1;
+  if ((msgid = msgget(IPC_PRIVATE, 0600)) < 0) {
+    perror("msgget");
+    return -1;
+  }
+  lat = malloc(sizeof(long long) * (requests > paced ? requests : paced));
+  for (mode = POLL; mode <= BLOCK; mode++) run();
+  msgctl(msgid, IPC_RMID, NULL);
+  free(lat);
+  return 0;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file aggregate.c
+ * @brief Totals over all accounts, one account at a time and from a
+ * snapshot reduced by 1 to 8 threads
+ *
+ * "scan" reads every balance through the engine and adds them up, the way
+ * a client listing every account would. "snapshot" runs aggregate_run,
+ * which copies the balances stripe by stripe and reduces the copy with
+ * vector instructions, for the total, the accounts with money, the top 10
+ * and a histogram. Both run next to 2 writer threads that transfer money
+ * between random accounts with the rwlock engine, so the total never
+ * changes: reported are the time of one query, how many of them saw a
+ * total other than the real one and how many transfers still got through.
+ * A snapshot that sees another total fails the benchmark.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aggregate.h"
+#include "bench.h"
+#include "engine.h"
+
+#define WRITERS 2
+#define QUERIES 20
+
+static const char* path = "aggregate.acc";
+static int threads_max = 8;
+static uint64_t accounts = 1 << 20;
+
+static struct account_store store;
+static int64_t expected;
+static atomic_int stop;
+static atomic_ullong writes;
+
+static void* writer(void* arg) {
+  uint64_t x = (uint64_t)arg * 0x9E3779B97F4A7C15ULL + 1;
+  uint64_t n = 0;
+  int64_t out;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    rwlock_engine.transfer(&store, x % accounts, (x >> 32) % accounts, 1,
+                           &out);
+    n++;
+  }
+  atomic_fetch_add(&writes, n);
+  return NULL;
+}
+
+static int64_t scan(void) {
+  int64_t total = 0;
+  int64_t out;
+  for (uint64_t a = 0; a < accounts; a++) {
+    rwlock_engine.balance(&store, a, &out);
+    total += out;
+  }
+  return total;
+}
+
+/*threads 0 for a scan*/
+static void run(int threads) {
+  pthread_t tids[WRITERS];
+  long long took[QUERIES];
+  struct aggregate* agg = malloc(sizeof(*agg));
+  int off = 0;
+  char params[40];
+
+  atomic_store(&stop, 0);
+  atomic_store(&writes, 0);
+  for (long i = 0; i < WRITERS; i++)
+    pthread_create(&tids[i], NULL, writer, (void*)i);
+  long long start = bench_now_ns();
+  for (int q = 0; q < QUERIES; q++) {
+    long long t = bench_now_ns();
+    int64_t total;
+    if (threads == 0) {
+      total = scan();
+    } else {
+      aggregate_run(&store, &rwlock_engine, NULL, threads, 10, agg);
+      total = agg->total;
+    }
+    took[q] = bench_now_ns() - t;
+    off += total != expected;
+  }
+  double secs = (bench_now_ns() - start) / 1e9;
+  atomic_store(&stop, 1);
+  for (int i = 0; i < WRITERS; i++) pthread_join(tids[i], NULL);
+  free(agg);
+
+  if (threads > 0 && off > 0) {
+    fprintf(stderr, "%d snapshots saw a total other than %lld\n", off,
+            (long long)expected);
+    exit(EXIT_FAILURE);
+  }
+  if (threads == 0)
+    snprintf(params, sizeof(params), "mode=scan");
+  else
+    snprintf(params, sizeof(params), "mode=snapshot,threads=%d", threads);
+  bench_result("aggregate", params, "query_ms_p50",
+               bench_percentile(took, QUERIES, 50) / 1e6, "ms");
+  bench_result("aggregate", params, "wrong_totals", off, "queries");
+  bench_result("aggregate", params, "transfers_per_sec",
+               atomic_load(&writes) / secs, "ops/s");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        accounts = strtoull(optarg, NULL, 10);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-n accounts] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || accounts < 2) return -1;
+  unlink(path);
+  if (store_open(&store, path, accounts, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  /*Some accounts empty, the others with up to 1000*/
+  for (uint64_t a = 0; a < accounts; a++) {
+    int64_t out;
+    if (a % 1001 == 0) continue;
+    rwlock_engine.deposit(&store, a, a % 1001, &out);
+    expected += a % 1001;
+  }
+  run(0);
+  for (int t = 1; t <= threads_max; t *= 2) run(t);
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file balance_reads.c
+ * @brief "l" next to withdrawals, deposits and transfers, reading the
+ * balance under the read lock and through the sequence of the stripe
+ *
+ * Reader threads list the balances of 4 accounts as fast as they can while
+ * 2 writer threads withdraw from, deposit to and transfer between the same
+ * accounts with the rwlock engine. "rdlock" reads a balance the way the
+ * rwlock engine used to, taking the read lock of the account, "seqlock"
+ * through the engine, which reads the sequence of the stripe before and
+ * after the balance and never writes. Reported are reads and writes per
+ * second with 1 to 8 readers.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "engine.h"
+
+#define ACCOUNTS 4
+#define WRITERS 2
+
+static const char* path = "balance_reads.acc";
+static int readers_max = 8;
+static int duration_ms = 500;
+
+static struct account_store store;
+static int seqlock;
+static atomic_int stop;
+static atomic_ullong reads;
+static atomic_ullong writes;
+
+static void* reader(void* arg) {
+  uint64_t n = 0;
+  int64_t out;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    uint64_t a = n++ % ACCOUNTS;
+    if (seqlock) {
+      rwlock_engine.balance(&store, a, &out);
+    } else {
+      pthread_rwlock_rdlock(store_lock(&store, a));
+      out = *store_balance(&store, a);
+      pthread_rwlock_unlock(store_lock(&store, a));
+    }
+  }
+  atomic_fetch_add(&reads, n);
+  return NULL;
+}
+
+static void* writer(void* arg) {
+  uint64_t n = 0;
+  int64_t out;
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    uint64_t a = n % ACCOUNTS;
+    switch (n++ % 3) {
+      case 0:
+        rwlock_engine.deposit(&store, a, 10, &out);
+        break;
+      case 1:
+        rwlock_engine.withdraw(&store, a, 10, &out);
+        break;
+      default:
+        rwlock_engine.transfer(&store, a, (a + 1) % ACCOUNTS, 10, &out);
+    }
+  }
+  atomic_fetch_add(&writes, n);
+  return NULL;
+}
+
+static void run(int readers) {
+  pthread_t tids[readers + WRITERS];
+  char params[40];
+
+  atomic_store(&stop, 0);
+  atomic_store(&reads, 0);
+  atomic_store(&writes, 0);
+  long long start = bench_now_ns();
+  for (int i = 0; i < readers; i++)
+    pthread_create(&tids[i], NULL, reader, NULL);
+  for (int i = 0; i < WRITERS; i++)
+    pthread_create(&tids[readers + i], NULL, writer, NULL);
+  usleep(duration_ms * 1000);
+  atomic_store(&stop, 1);
+  for (int i = 0; i < readers + WRITERS; i++) pthread_join(tids[i], NULL);
+  double secs = (bench_now_ns() - start) / 1e9;
+
+  snprintf(params, sizeof(params), "read=%s,readers=%d",
+           seqlock ? "seqlock" : "rdlock", readers);
+  bench_result("balance_reads", params, "reads_per_sec",
+               atomic_load(&reads) / secs, "ops/s");
+  bench_result("balance_reads", params, "writes_per_sec",
+               atomic_load(&writes) / secs, "ops/s");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        readers_max = atoi(optarg);
+        break;
+      case 'd':
+        duration_ms = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_readers] [-d duration_ms] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (readers_max < 1 || duration_ms < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, ACCOUNTS, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  /*Enough money that no withdrawal or transfer is short*/
+  for (int a = 0; a < ACCOUNTS; a++) {
+    int64_t out;
+    rwlock_engine.deposit(&store, a, 1000000, &out);
+  }
+  for (seqlock = 0; seqlock <= 1; seqlock++)
+    for (int r = 1; r <= readers_max; r *= 2) run(r);
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
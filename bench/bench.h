@@ -0,0 +1,49 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/**
+ * @file bench.h
+ * @brief Timing and reporting helpers shared by the benchmarks
+ *
+ * Every result is printed as one JSON object per line so that runs of
+ * different commits can be compared with ordinary text tools.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*Monotonic time in nanoseconds*/
+static inline long long bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_cmp_ll(const void* a, const void* b) {
+  long long x = *(const long long*)a;
+  long long y = *(const long long*)b;
+  return (x > y) - (x < y);
+}
+
+/*Sort samples in place and return the p:th percentile (0 <= p <= 100)*/
+static inline long long bench_percentile(long long* samples, int n,
+                                         double p) {
+  if (n <= 0) return 0;
+  qsort(samples, n, sizeof(long long), bench_cmp_ll);
+  int idx = (int)(p / 100.0 * (n - 1) + 0.5);
+  return samples[idx];
+}
+
+/*Print one result line, params is a free form "key=value,..." string*/
+static inline void bench_result(const char* bench, const char* params,
+                                const char* metric, double value,
+                                const char* unit) {
+  printf(
+      "{\"bench\":\"%s\",\"params\":\"%s\",\"metric\":\"%s\","
+      "\"value\":%.3f,\"unit\":\"%s\"}\n",
+      bench, params, metric, value, unit);
+  fflush(stdout);
+}
+
+#endif  // __BENCH_H__
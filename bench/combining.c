@@ -0,0 +1,118 @@
+/**
+ * @file combining.c
+ * @brief Withdrawals and deposits on one account from 1 to 32 desks, for
+ * the rwlock and the combining engine
+ *
+ * Every thread alternates "d" and "w" of the same amount on account 0,
+ * which has enough money that no withdrawal is short, so at the end the
+ * balance must be what it was. "rwlock" hands the lock of the account to
+ * the next thread for every command, "combine" lets the thread holding it
+ * run the commands of the waiting threads as well. Reported are commands
+ * per second, the 99th percentile of the time a command takes and how
+ * often a thread found the lock taken.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "engine.h"
+
+#define THREADS_MAX 32
+#define START_BALANCE 1000000
+
+static const char* path = "combining.acc";
+static int threads_max = THREADS_MAX;
+static int ops = 100000;
+
+static struct account_store store;
+static const struct engine* engine;
+static atomic_ullong waits[THREADS_MAX];
+static long long* lat;
+
+static void* desk(void* arg) {
+  long id = (long)arg;
+  long long* my_lat = lat + id * ops;
+  int64_t out;
+  engine_count_waits(&waits[id]);
+  for (int i = 0; i < ops; i++) {
+    long long start = bench_now_ns();
+    if (i % 2 == 0)
+      engine->deposit(&store, 0, 10, &out);
+    else
+      engine->withdraw(&store, 0, 10, &out);
+    my_lat[i] = bench_now_ns() - start;
+  }
+  return NULL;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[40];
+  int64_t out;
+
+  for (int i = 0; i < threads; i++) atomic_store(&waits[i], 0);
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+
+  engine->balance(&store, 0, &out);
+  if (out != START_BALANCE) {
+    fprintf(stderr, "balance %lld, expected %d\n", (long long)out,
+            START_BALANCE);
+    exit(EXIT_FAILURE);
+  }
+  uint64_t waited = 0;
+  for (int i = 0; i < threads; i++) waited += atomic_load(&waits[i]);
+  snprintf(params, sizeof(params), "engine=%s,threads=%d", engine->name,
+           threads);
+  bench_result("combining", params, "ops_per_sec",
+               (double)ops * threads / (elapsed / 1e9), "ops/s");
+  bench_result("combining", params, "p99_latency",
+               bench_percentile(lat, ops * threads, 99), "ns");
+  bench_result("combining", params, "waits_per_1k_ops",
+               waited * 1000.0 / ops / threads, "waits");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-n ops_per_thread] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || threads_max > THREADS_MAX || ops < 1) return -1;
+  lat = malloc(sizeof(long long) * ops * threads_max);
+  unlink(path);
+  if (lat == NULL || store_open(&store, path, 1, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  const struct engine* engines[] = {&rwlock_engine, &combine_engine};
+  for (int e = 0; e < 2; e++) {
+    int64_t out;
+    engine = engines[e];
+    engine->deposit(&store, 0, START_BALANCE, &out);
+    for (int t = 1; t <= threads_max; t *= 2) run(t);
+    engine->withdraw(&store, 0, START_BALANCE, &out);
+  }
+  store_close(&store);
+  unlink(path);
+  free(lat);
+  return 0;
+}
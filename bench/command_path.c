@@ -0,0 +1,176 @@
+/**
+ * @file command_path.c
+ * @brief Commands run by the desks, without the clients
+ *
+ * Threads play desks that run requests through bank_execute, the same
+ * function the server runs them with, for both engines and without the log.
+ * "l", "w" and "d" use one account per thread ("own") or one account shared
+ * by all threads ("shared"). "t" moves money back and forth between two
+ * accounts per thread or two accounts shared by all threads. Then a single
+ * thread runs whole commands the way a desk does: parsing the text,
+ * running it and formatting the answer, or decoding a binary request,
+ * running it and encoding the response.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "bench.h"
+
+#define ACCOUNTS 64
+
+static const char* path = "command_path.acc";
+static int threads_max = 8;
+static int ops = 200000;
+
+static struct account_store store;
+static struct bank bank;
+static uint8_t op;
+static int shared;
+
+static void* desk(void* arg) {
+  long id = (long)arg;
+  atomic_llong bal = 0;
+  struct response resp;
+  struct request req = {.op = op, .amount = 1};
+  req.acc1 = shared ? 0 : id * 2;
+  req.acc2 = req.acc1 + 1;
+  for (int i = 0; i < ops; i++) {
+    bank_execute(&bank, &req, &resp, &bal);
+    if (op == OP_TRANSFER) {
+      uint64_t a = req.acc1;
+      req.acc1 = req.acc2;
+      req.acc2 = a;
+    }
+  }
+  return NULL;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[80];
+
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  snprintf(params, sizeof(params), "engine=%s,op=%c,accounts=%s,threads=%d",
+           bank.engine->name, op, shared ? "shared" : "own", threads);
+  bench_result("command_path", params, "ops_per_sec",
+               (double)ops * threads / (elapsed / 1e9), "ops/s");
+}
+
+/*Parse, run and format the text commands over and over*/
+static void text_path(void) {
+  static const char* lines[] = {"l 1\n", "w 1 1\n", "d 1 1\n", "t 1 2 1\n"};
+  char out[255];
+  atomic_llong bal = 0;
+  struct request req;
+  struct response resp;
+  char params[40];
+
+  for (int l = 0; l < 4; l++) {
+    long long start = bench_now_ns();
+    for (int i = 0; i < ops; i++) {
+      parse_text_request(lines[l], &req);
+      bank_execute(&bank, &req, &resp, &bal);
+      memset(out, 0, sizeof(out));
+      format_text_response(&req, &resp, out, sizeof(out));
+    }
+    long long elapsed = bench_now_ns() - start;
+    snprintf(params, sizeof(params), "engine=%s,protocol=text,op=%c",
+             bank.engine->name, lines[l][0]);
+    bench_result("command_path", params, "ns_per_command",
+                 (double)elapsed / ops, "ns");
+  }
+}
+
+/*Decode, run and encode the binary requests over and over*/
+static void binary_path(void) {
+  static const uint8_t opcodes[] = {OP_LIST, OP_WITHDRAW, OP_DEPOSIT,
+                                    OP_TRANSFER};
+  unsigned char frame[MAX_REQUEST_SIZE];
+  unsigned char out[RESP_HEADER_SIZE + MAX_BODY_SIZE];
+  atomic_llong bal = 0;
+  struct request req;
+  struct response resp;
+  char params[40];
+
+  for (int o = 0; o < 4; o++) {
+    struct request r = {.op = opcodes[o], .acc1 = 1, .acc2 = 2, .amount = 1};
+    size_t len = encode_request(&r, frame);
+    long long start = bench_now_ns();
+    for (int i = 0; i < ops; i++) {
+      decode_request(frame, len, &req);
+      bank_execute(&bank, &req, &resp, &bal);
+      encode_response(&resp, out);
+    }
+    long long elapsed = bench_now_ns() - start;
+    snprintf(params, sizeof(params), "engine=%s,protocol=binary,op=%c",
+             bank.engine->name, opcodes[o]);
+    bench_result("command_path", params, "ns_per_command",
+                 (double)elapsed / ops, "ns");
+  }
+}
+
+int main(int argc, char** argv) {
+  static const uint8_t opcodes[] = {OP_LIST, OP_WITHDRAW, OP_DEPOSIT,
+                                    OP_TRANSFER};
+  const char* only = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'm':
+        only = optarg;
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-m rwlock|atomic] [-t max_threads] "
+            "[-n ops_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || threads_max * 2 > ACCOUNTS || ops < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, ACCOUNTS, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  bank.store = &store;
+  bank.wal = NULL;
+  bank.hot = NULL;
+  const struct engine* engines[] = {&rwlock_engine, &atomic_engine};
+  for (int e = 0; e < 2; e++) {
+    bank.engine = engines[e];
+    if (only != NULL && strcmp(only, bank.engine->name)) continue;
+    /*Enough money that no withdrawal is short*/
+    for (int a = 0; a < ACCOUNTS; a++) {
+      int64_t out;
+      for (int i = 0; i < 4; i++)
+        bank.engine->deposit(&store, a, INT32_MAX / 2, &out);
+    }
+    for (int o = 0; o < 4; o++) {
+      op = opcodes[o];
+      for (shared = 0; shared <= 1; shared++)
+        for (int t = 1; t <= threads_max; t *= 2) run(t);
+    }
+    text_path();
+    binary_path();
+  }
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
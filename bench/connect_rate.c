@@ -0,0 +1,181 @@
+/**
+ * @file connect_rate.c
+ * @brief Connections per second through the named pipes and the socket
+ *
+ * A client connects, waits for the ready message, sends quit and hangs up,
+ * over and over, while a thread answers it the way a desk does. "fifo"
+ * makes two named pipes, sends their paths over a private message queue and
+ * opens them once the server has, "socket" connects to a Unix socket and
+ * sends one byte. The real client also sleeps a second before it sends the
+ * paths, which is left out here. Reported are connections per second and
+ * the time until the client has its ready message.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "protocol.h"
+
+struct client {
+  long int message_type;
+  char mtext[100];
+};
+
+enum transport { FIFO, SOCKET };
+
+static const char* transport_names[] = {"fifo", "socket"};
+
+static int connections = 2000;
+
+static int msgid;
+static int listen_fd;
+static char socket_path[64];
+
+/*Wait for the client to send quit and hang up*/
+static void drain(int fd) {
+  char buf[BUFSIZ];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+}
+
+static void* fifo_server(void* arg) {
+  struct client c;
+  for (int i = 0; i < connections; i++) {
+    if (msgrcv(msgid, &c, sizeof(c.mtext), 0, 0) < 0) break;
+    char* path_out = strtok(c.mtext, "|");
+    char* path_in = strtok(NULL, "|");
+    int out = open(path_out, O_WRONLY);
+    int in = open(path_in, O_RDONLY);
+    write(out, READY_TEXT, sizeof(READY_TEXT));
+    drain(in);
+    close(in);
+    close(out);
+  }
+  return NULL;
+}
+
+static void* socket_server(void* arg) {
+  char hello;
+  for (int i = 0; i < connections; i++) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) break;
+    if (read(fd, &hello, 1) == 1) write(fd, READY_TEXT, sizeof(READY_TEXT));
+    drain(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+/*Connect like connection.c without -u, returns when the server is ready*/
+static void fifo_connect(int n, long long* ready_ns) {
+  struct client c = {1, ""};
+  char path_in[50];
+  char path_out[50];
+  char buf[50];
+  long long start = bench_now_ns();
+  sprintf(path_in, "/tmp/benchin%d_%d", getpid(), n);
+  sprintf(path_out, "/tmp/benchout%d_%d", getpid(), n);
+  mkfifo(path_in, 0666);
+  mkfifo(path_out, 0666);
+  snprintf(c.mtext, sizeof(c.mtext), "%s|%s", path_in, path_out);
+  msgsnd(msgid, &c, sizeof(c.mtext), 0);
+  int in = open(path_in, O_RDONLY);
+  int out = open(path_out, O_WRONLY);
+  read(in, buf, sizeof(buf));
+  *ready_ns = bench_now_ns() - start;
+  write(out, "q", 1);
+  close(out);
+  close(in);
+  unlink(path_in);
+  unlink(path_out);
+}
+
+/*Connect like connection.c with -u, returns when the server is ready*/
+static void socket_connect(int n, long long* ready_ns) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  char hello = HELLO_TEXT;
+  char buf[50];
+  long long start = bench_now_ns();
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  write(fd, &hello, 1);
+  read(fd, buf, sizeof(buf));
+  *ready_ns = bench_now_ns() - start;
+  write(fd, "q", 1);
+  close(fd);
+}
+
+static void run(enum transport t) {
+  pthread_t tid;
+  char params[40];
+  long long* lat = malloc(sizeof(long long) * connections);
+
+  pthread_create(&tid, NULL, t == FIFO ? fifo_server : socket_server, NULL);
+  long long start = bench_now_ns();
+  for (int i = 0; i < connections; i++) {
+    if (t == FIFO)
+      fifo_connect(i, &lat[i]);
+    else
+      socket_connect(i, &lat[i]);
+  }
+  long long elapsed = bench_now_ns() - start;
+  pthread_join(tid, NULL);
+
+  snprintf(params, sizeof(params), "transport=%s", transport_names[t]);
+  bench_result("connect_rate", params, "connections_per_sec",
+               connections / (elapsed / 1e9), "conn/s");
+  bench_result("connect_rate", params, "p50_ready",
+               bench_percentile(lat, connections, 50) / 1000.0, "us");
+  bench_result("connect_rate", params, "p99_ready",
+               bench_percentile(lat, connections, 99) / 1000.0, "us");
+  free(lat);
+}
+
+int main(int argc, char** argv) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        connections = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-n connections]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (connections < 1) return -1;
+
+  if ((msgid = msgget(IPC_PRIVATE, 0600)) < 0) {
+    perror("msgget");
+    return -1;
+  }
+  sprintf(socket_path, "/tmp/bench%d.sock", getpid());
+  strcpy(addr.sun_path, socket_path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, SOMAXCONN) < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  run(FIFO);
+  run(SOCKET);
+
+  close(listen_fd);
+  unlink(socket_path);
+  msgctl(msgid, IPC_RMID, NULL);
+  return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file engine_ops.c
+ * @brief Throughput of the rwlock, atomic and combining account engines
+ *
+ * Threads play desks running a mix of 40% balance queries, 25% deposits,
+ * 25% withdrawals and 10% transfers, without the log. "uniform" spreads the
+ * commands over all accounts, "hot" sends 90% of them to 4 accounts.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "engine.h"
+
+static const char* path = "engine_ops.acc";
+static long long accounts = 1000;
+static int threads_max = 8;
+static int ops = 500000;
+
+static struct account_store store;
+static const struct engine* engine;
+static int hot;
+
+static uint64_t pick(unsigned int* seed) {
+  if (hot && rand_r(seed) % 10 != 0) return rand_r(seed) % 4;
+  return rand_r(seed) % accounts;
+}
+
+static void* desk(void* arg) {
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  int64_t out;
+  for (int i = 0; i < ops; i++) {
+    uint64_t n = pick(&seed);
+    int op = rand_r(&seed) % 100;
+    if (op < 40)
+      engine->balance(&store, n, &out);
+    else if (op < 65)
+      engine->deposit(&store, n, 10, &out);
+    else if (op < 90)
+      engine->withdraw(&store, n, 10, &out);
+    else
+      engine->transfer(&store, n, pick(&seed), 10, &out);
+  }
+  return NULL;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[80];
+
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  snprintf(params, sizeof(params), "engine=%s,workload=%s,threads=%d",
+           engine->name, hot ? "hot" : "uniform", threads);
+  bench_result("engine_ops", params, "ops_per_sec",
+               (double)ops * threads / (elapsed / 1e9), "ops/s");
+}
+
+int main(int argc, char** argv) {
+  const char* only = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:a:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'm':
+        only = optarg;
+        break;
+      case 'a':
+        accounts = atoll(optarg);
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-m rwlock|atomic|combine] [-a accounts] "
+            "[-t max_threads] [-n ops_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (accounts < 4 || threads_max < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, accounts, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  const struct engine* engines[] = {&rwlock_engine, &atomic_engine,
+                                    &combine_engine};
+  for (int e = 0; e < 3; e++) {
+    engine = engines[e];
+    if (only != NULL && strcmp(only, engine->name)) continue;
+    for (hot = 0; hot <= 1; hot++)
+      for (int t = 1; t <= threads_max; t *= 2) run(t);
+  }
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
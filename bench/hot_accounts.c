@@ -0,0 +1,134 @@
+/**
+ * @file hot_accounts.c
+ * @brief Deposits to one account from many desks, whole and split into
+ * sub-balances
+ *
+ * Threads play desks that run requests through bank_execute on account 0:
+ * mostly "d", every 16th command an "l" and every 64th a "w". "whole" runs
+ * them without hot accounts, "hot" with account 0 promoted before the
+ * threads start, so the run measures the sub-balances and not how soon the
+ * account gets promoted. Reported are commands per second and how often a
+ * desk waited for the lock of the account or retried its balance. At the
+ * end the balance must be what was deposited minus what was withdrawn.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bank.h"
+#include "bench.h"
+
+#define ACCOUNTS 64
+#define START_BALANCE 1000000
+
+static const char* path = "hot_accounts.acc";
+static int threads_max = 8;
+static int ops = 200000;
+
+static struct account_store store;
+static struct bank bank;
+static atomic_ullong waits[64];
+static atomic_llong moved;
+
+static void* desk(void* arg) {
+  long id = (long)arg;
+  atomic_llong bal = 0;
+  struct response resp;
+  struct request req = {.acc1 = 0, .amount = 1};
+  engine_count_waits(&waits[id]);
+  hot_set_desk(id);
+  for (int i = 0; i < ops; i++) {
+    req.op = i % 64 == 63 ? OP_WITHDRAW : i % 16 == 15 ? OP_LIST : OP_DEPOSIT;
+    bank_execute(&bank, &req, &resp, &bal);
+  }
+  atomic_fetch_add(&moved, bal);
+  return NULL;
+}
+
+static void run(int hot, int threads) {
+  pthread_t tids[threads];
+  char params[80];
+  int64_t start_balance;
+  int64_t out;
+
+  bank.engine->balance(&store, 0, &start_balance);
+  atomic_store(&moved, 0);
+  bank.hot = NULL;
+  if (hot) {
+    bank.hot = hot_create(&store, bank.engine, threads);
+    for (int i = 0; i < HOT_PROMOTE_WAITS; i++) hot_note_wait(bank.hot, 0);
+  }
+  for (int i = 0; i < threads; i++) atomic_store(&waits[i], 0);
+
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+
+  if (bank.hot != NULL) hot_destroy(bank.hot);
+  bank.hot = NULL;
+  bank.engine->balance(&store, 0, &out);
+  if (out != start_balance + atomic_load(&moved)) {
+    fprintf(stderr, "balance %lld, expected %lld\n", (long long)out,
+            (long long)(start_balance + atomic_load(&moved)));
+    exit(EXIT_FAILURE);
+  }
+  uint64_t waited = 0;
+  for (int i = 0; i < threads; i++) waited += atomic_load(&waits[i]);
+  snprintf(params, sizeof(params), "engine=%s,mode=%s,threads=%d",
+           bank.engine->name, hot ? "hot" : "whole", threads);
+  bench_result("hot_accounts", params, "ops_per_sec",
+               (double)ops * threads / (elapsed / 1e9), "ops/s");
+  bench_result("hot_accounts", params, "waits_per_1k_ops",
+               waited * 1000.0 / ops / threads, "waits");
+}
+
+int main(int argc, char** argv) {
+  const char* only = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'm':
+        only = optarg;
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-m rwlock|atomic] [-t max_threads] "
+            "[-n ops_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || threads_max > 64 || ops < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, ACCOUNTS, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  bank.store = &store;
+  bank.wal = NULL;
+  const struct engine* engines[] = {&rwlock_engine, &atomic_engine};
+  for (int e = 0; e < 2; e++) {
+    int64_t out;
+    bank.engine = engines[e];
+    if (only != NULL && strcmp(only, bank.engine->name)) continue;
+    /*Enough money that no withdrawal is short*/
+    bank.engine->deposit(&store, 0, START_BALANCE, &out);
+    for (int hot = 0; hot <= 1; hot++)
+      for (int t = 1; t <= threads_max; t *= 2) run(hot, t);
+  }
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * @file log_overhead.c
+ * @brief Cost of logging every command
+ *
+ * Threads play desks that log every command before they run it, a deposit
+ * with the rwlock engine, as execute_request does. "none" does not log,
+ * "below" logs below the level of the log, "async" pushes the records for
+ * the flusher of log.c and "sync" formats the time and writes each line with
+ * fprintf, as the server did before. Desks that log faster than the flusher
+ * writes wait for it, so "async" includes the cost of writing the lines.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "engine.h"
+#include "log.h"
+
+enum mode { NONE, BELOW, ASYNC, SYNC };
+
+static const char* mode_names[] = {"none", "below", "async", "sync"};
+
+static const char* path = "log_overhead.acc";
+static const char* log_path = "log_overhead.log";
+static int threads_max = 4;
+static int ops = 200000;
+
+static struct account_store store;
+static enum mode mode;
+static FILE* sync_log;
+
+/*Log line as written by the server before log.c*/
+static void sync_event(FILE* log, char* msg) {
+  char buf[20];
+  struct tm* t;
+
+  time_t now = time(0);
+  t = localtime(&now);
+
+  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", t);
+  fprintf(log, "%s Server: %s \n", buf, msg);
+}
+
+static void* desk(void* arg) {
+  uint64_t n = (long)arg;
+  int64_t out;
+  char msg[40];
+  for (int i = 0; i < ops; i++) {
+    uint8_t op = 'd';
+    if (mode == SYNC) {
+      sprintf(msg, "Processing command '%c'", op);
+      sync_event(sync_log, msg);
+    } else if (mode != NONE) {
+      log_eventf(LOG_DEBUG, "Processing command '%c'", op, 0);
+    }
+    rwlock_engine.deposit(&store, n, 1, &out);
+  }
+  return NULL;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[80];
+
+  unlink(log_path);
+  if (mode == SYNC) {
+    sync_log = fopen(log_path, "a");
+  } else if (mode != NONE &&
+             log_open(log_path, mode == BELOW ? LOG_INFO : LOG_DEBUG) < 0) {
+    perror("log_open");
+    exit(EXIT_FAILURE);
+  }
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  /*Writing out what is left is part of the cost*/
+  if (mode == SYNC)
+    fclose(sync_log);
+  else
+    log_close();
+  long long drained = bench_now_ns() - start;
+  unlink(log_path);
+
+  snprintf(params, sizeof(params), "mode=%s,threads=%d", mode_names[mode],
+           threads);
+  bench_result("log_overhead", params, "ns_per_command",
+               (double)elapsed / ops, "ns");
+  bench_result("log_overhead", params, "ns_per_command_drained",
+               (double)drained / ops, "ns");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-n ops_per_thread] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || ops < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, threads_max, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  for (mode = NONE; mode <= SYNC; mode++)
+    for (int t = 1; t <= threads_max; t *= 2) run(t);
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
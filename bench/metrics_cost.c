@@ -0,0 +1,120 @@
+/**
+ * @file metrics_cost.c
+ * @brief Cost of counting a command in the desk metrics
+ *
+ * Threads play desks that count commands with random opcodes and latencies
+ * in their own metrics. "none" only picks the commands, "record" counts
+ * them and "timed" also reads the clock as record_command does, once per
+ * command. A reader thread writes a snapshot of all desks every
+ * millisecond, and the time to write one is reported as well.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "metrics.h"
+
+static int threads_max = 8;
+static int ops = 2000000;
+
+static const uint8_t opcodes[] = {OP_LIST, OP_WITHDRAW, OP_DEPOSIT,
+                                  OP_TRANSFER};
+
+enum mode { NONE, RECORD, TIMED };
+
+static const char* mode_names[] = {"none", "record", "timed"};
+
+static struct desk_metrics* metrics;
+static enum mode mode;
+static volatile uint64_t sink;
+static atomic_int running;
+
+static void* desk(void* arg) {
+  struct desk_metrics* m = &metrics[(long)arg];
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  long long last = bench_now_ns();
+  for (int i = 0; i < ops; i++) {
+    int r = rand_r(&seed);
+    uint64_t ns = 500 + (r & 0xffff);
+    if (mode == TIMED) {
+      long long now = bench_now_ns();
+      ns = now - last;
+      last = now;
+    }
+    enum proto_status status = (r >> 16) % 10 ? ST_OK : ST_INSUFFICIENT;
+    if (mode == NONE)
+      sink += ns + status;
+    else
+      metrics_command(m, opcodes[r & 3], status, ns);
+  }
+  return NULL;
+}
+
+/*Writes snapshots while the desks run, like a client of the socket*/
+static void* reader(void* arg) {
+  int threads = (long)arg;
+  long long* spent = malloc(sizeof(long long));
+  *spent = 0;
+  FILE* out = fopen("/dev/null", "w");
+  int snapshots = 0;
+  while (atomic_load(&running)) {
+    long long start = bench_now_ns();
+    for (int i = 0; i < threads; i++) metrics_write_desk(out, &metrics[i]);
+    *spent += bench_now_ns() - start;
+    snapshots++;
+    usleep(1000);
+  }
+  fclose(out);
+  if (snapshots > 0) *spent /= snapshots;
+  return spent;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  pthread_t rtid;
+  char params[80];
+  long long* snapshot_ns;
+
+  metrics = metrics_create(threads);
+  atomic_store(&running, 1);
+  pthread_create(&rtid, NULL, reader, (void*)(long)threads);
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  atomic_store(&running, 0);
+  pthread_join(rtid, (void**)&snapshot_ns);
+
+  snprintf(params, sizeof(params), "mode=%s,threads=%d", mode_names[mode],
+           threads);
+  bench_result("metrics_cost", params, "ns_per_command",
+               (double)elapsed / ops, "ns");
+  bench_result("metrics_cost", params, "snapshot", *snapshot_ns / 1000.0,
+               "us");
+  free(snapshot_ns);
+  free(metrics);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-n ops_per_thread]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || ops < 1) return -1;
+  for (mode = NONE; mode <= TIMED; mode++)
+    for (int t = 1; t <= threads_max; t *= 2) run(t);
+  return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * @file proto_cost.c
+ * @brief Bytes and CPU time per operation of the text and binary protocol
+ *
+ * Runs the client and server side of one request and response for each
+ * protocol without any pipes in between. "text" is what the text protocol
+ * does: sscanf of the command on both sides and a BUFSIZE reply formatted
+ * with sprintf. "binary" encodes and decodes the fixed headers.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "protocol.h"
+
+#define BUFSIZE 255
+
+static int ops = 1000000;
+
+/*Keeps the compiler from dropping the work*/
+static volatile long long sink;
+
+static const char* commands[] = {"l 17", "w 17 100", "d 17 250",
+                                 "t 17 42 300"};
+
+static void run_text(void) {
+  char out[BUFSIZE];
+  struct request req;
+  struct response resp = {.status = ST_OK, .value = 12345};
+  long long bytes = 0;
+  long long start = bench_now_ns();
+  for (int i = 0; i < ops; i++) {
+    const char* cmd = commands[i & 3];
+    /*Client validates, server parses again*/
+    parse_text_request(cmd, &req);
+    parse_text_request(cmd, &req);
+    memset(out, 0, BUFSIZE);
+    format_text_response(&req, &resp, out, BUFSIZE);
+    sink += out[0];
+    bytes += 2 * BUFSIZE;
+  }
+  long long elapsed = bench_now_ns() - start;
+  bench_result("proto_cost", "proto=text", "ns_per_op",
+               (double)elapsed / ops, "ns");
+  bench_result("proto_cost", "proto=text", "bytes_per_op",
+               (double)bytes / ops, "B");
+}
+
+static void run_binary(void) {
+  unsigned char frame[REQ_HEADER_SIZE];
+  unsigned char reply[RESP_HEADER_SIZE + sizeof(int64_t)];
+  struct request reqs[4];
+  struct request req;
+  struct response resp;
+  long long bytes = 0;
+  for (int i = 0; i < 4; i++) parse_text_request(commands[i], &reqs[i]);
+  long long start = bench_now_ns();
+  for (int i = 0; i < ops; i++) {
+    size_t len = encode_request(&reqs[i & 3], frame);
+    decode_request(frame, len, &req);
+    resp.op = req.op;
+    resp.status = ST_OK;
+    resp.body_len = sizeof(int64_t);
+    resp.value = req.amount;
+    size_t rlen = encode_response(&resp, reply);
+    decode_response(reply, rlen, &resp);
+    sink += resp.value;
+    bytes += len + rlen;
+  }
+  long long elapsed = bench_now_ns() - start;
+  bench_result("proto_cost", "proto=binary", "ns_per_op",
+               (double)elapsed / ops, "ns");
+  bench_result("proto_cost", "proto=binary", "bytes_per_op",
+               (double)bytes / ops, "B");
+}
+
+int main(int argc, char** argv) {
+  const char* mode = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = optarg;
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-m text|binary] [-n ops]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (ops < 1) return -1;
+  if (mode == NULL || !strcmp(mode, "text")) run_text();
+  if (mode == NULL || !strcmp(mode, "binary")) run_binary();
+  return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file queue_latency.c
+ * @brief Enqueue-to-service latency of the desk queues
+ *
+ * A producer inserts timestamped items at random intervals and a single
+ * consumer removes them, the same way the accept loop and a desk thread do.
+ * "poll" reproduces the old desk loop (removeData() followed by a sleep),
+ * "block" uses the BlockingQueue the desks sleep on now.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "queue.h"
+
+static int samples = 10;
+static int poll_ms = 1000;
+static int max_gap_ms = -1;
+
+static long long* latencies;
+
+/*Queue and lock for the polling variant, kept as it was in the old loop*/
+static struct Queue poll_queue;
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct BlockingQueue block_queue;
+
+static void record(const char* item, int i) {
+  long long sent = atoll(item);
+  latencies[i] = bench_now_ns() - sent;
+}
+
+static void* poll_consumer(void* arg) {
+  char item[ITEM_SIZE];
+  int got = 0;
+  while (got < samples) {
+    char* c;
+    pthread_mutex_lock(&poll_lock);
+    if ((c = removeData(&poll_queue)) != NULL) strcpy(item, c);
+    pthread_mutex_unlock(&poll_lock);
+    if (c != NULL) record(item, got++);
+    usleep(poll_ms * 1000);
+  }
+  return NULL;
+}
+
+static void* block_consumer(void* arg) {
+  struct ConnDesc item;
+  int got = 0;
+  while (got < samples) {
+    if (blockingRemove(&block_queue, &item) == QUEUE_ITEM)
+      record(item.path, got++);
+  }
+  return NULL;
+}
+
+static void run(const char* mode) {
+  int poll = !strcmp(mode, "poll");
+  pthread_t consumer;
+  struct ConnDesc item;
+
+  if (poll) {
+    poll_queue = createQueue();
+    pthread_create(&consumer, NULL, poll_consumer, NULL);
+  } else {
+    createBlockingQueue(&block_queue, SIZE);
+    pthread_create(&consumer, NULL, block_consumer, NULL);
+  }
+  for (int i = 0; i < samples; i++) {
+    /*Random arrivals so the polling phase is not synchronized with them*/
+    usleep((random() % (max_gap_ms + 1)) * 1000);
+    sprintf(item.path, "%lld", bench_now_ns());
+    if (poll) {
+      pthread_mutex_lock(&poll_lock);
+      insert(&poll_queue, item.path);
+      pthread_mutex_unlock(&poll_lock);
+    } else {
+      blockingInsert(&block_queue, &item);
+    }
+  }
+  pthread_join(consumer, NULL);
+  if (poll)
+    destroyQueue(&poll_queue);
+  else
+    destroyBlockingQueue(&block_queue);
+
+  double sum = 0;
+  for (int i = 0; i < samples; i++) sum += latencies[i];
+
+  char params[100];
+  sprintf(params, "mode=%s,samples=%d,poll_ms=%d", mode, samples, poll_ms);
+  bench_result("queue_latency", params, "mean", sum / samples / 1e3, "us");
+  bench_result("queue_latency", params, "p50",
+               bench_percentile(latencies, samples, 50) / 1e3, "us");
+  bench_result("queue_latency", params, "p99",
+               bench_percentile(latencies, samples, 99) / 1e3, "us");
+  bench_result("queue_latency", params, "max",
+               bench_percentile(latencies, samples, 100) / 1e3, "us");
+}
+
+int main(int argc, char** argv) {
+  const char* mode = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:p:g:")) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = optarg;
+        break;
+      case 'n':
+        samples = atoi(optarg);
+        break;
+      case 'p':
+        poll_ms = atoi(optarg);
+        break;
+      case 'g':
+        max_gap_ms = atoi(optarg);
+        break;
+      default:
+        printf(
+            "Usage: %s [-m poll|block] [-n samples] [-p poll_ms] "
+            "[-g max_gap_ms]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (samples <= 0) samples = 1;
+  /*By default arrivals are slower than the polling loop can serve them*/
+  if (max_gap_ms < 0) max_gap_ms = 2 * poll_ms;
+  latencies = calloc(samples, sizeof(long long));
+  if (latencies == NULL) return -1;
+  srandom(1);
+
+  if (mode == NULL || !strcmp(mode, "poll")) run("poll");
+  if (mode == NULL || !strcmp(mode, "block")) run("block");
+  free(latencies);
+  return 0;
+}
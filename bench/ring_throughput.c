@@ -0,0 +1,117 @@
+/**
+ * @file ring_throughput.c
+ * @brief Operations per second of the desk queue ring
+ *
+ * Runs the same number of producer and consumer threads against one ring
+ * and counts completed push/pop pairs. "ring" uses the lock-free ring as
+ * is, "mutex" serializes every operation behind one lock the way the old
+ * Queue had to be used from several threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "queue.h"
+
+static struct Ring* ring;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int locked;
+static long ops_per_thread;
+
+static bool push(const struct ConnDesc* c) {
+  if (!locked) return ringPush(ring, c);
+  pthread_mutex_lock(&ring_lock);
+  bool ok = ringPush(ring, c);
+  pthread_mutex_unlock(&ring_lock);
+  return ok;
+}
+
+static bool pop(struct ConnDesc* c) {
+  if (!locked) return ringPop(ring, c);
+  pthread_mutex_lock(&ring_lock);
+  bool ok = ringPop(ring, c);
+  pthread_mutex_unlock(&ring_lock);
+  return ok;
+}
+
+static void* producer(void* arg) {
+  struct ConnDesc c;
+  memset(&c, 0, sizeof(c));
+  strcpy(c.path, "/tmp/fifoin0|/tmp/fifoout0");
+  for (long i = 0; i < ops_per_thread; i++) {
+    while (!push(&c)) sched_yield();
+  }
+  return NULL;
+}
+
+static void* consumer(void* arg) {
+  struct ConnDesc c;
+  for (long i = 0; i < ops_per_thread; i++) {
+    while (!pop(&c)) sched_yield();
+  }
+  return NULL;
+}
+
+static void run(const char* mode, int threads, long total, size_t capacity) {
+  pthread_t* tids = malloc(sizeof(pthread_t) * threads * 2);
+  locked = !strcmp(mode, "mutex");
+  ops_per_thread = total / threads;
+  ring = createRing(capacity);
+  if (tids == NULL || ring == NULL) exit(EXIT_FAILURE);
+
+  long long start = bench_now_ns();
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&tids[2 * i], NULL, producer, NULL);
+    pthread_create(&tids[2 * i + 1], NULL, consumer, NULL);
+  }
+  for (int i = 0; i < threads * 2; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+
+  char params[100];
+  sprintf(params, "mode=%s,threads=%d,capacity=%zu", mode, threads,
+          ringCapacity(ring));
+  bench_result("ring_throughput", params, "ops_per_sec",
+               (double)ops_per_thread * threads * 1e9 / elapsed, "ops/s");
+  destroyRing(ring);
+  free(tids);
+}
+
+int main(int argc, char** argv) {
+  const char* mode = NULL;
+  long total = 1000000;
+  size_t capacity = SIZE;
+  int max_threads = 64;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:n:c:t:")) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = optarg;
+        break;
+      case 'n':
+        total = atol(optarg);
+        break;
+      case 'c':
+        capacity = atol(optarg);
+        break;
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      default:
+        printf(
+            "Usage: %s [-m ring|mutex] [-n ops] [-c capacity] "
+            "[-t max_threads]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    if (mode == NULL || !strcmp(mode, "ring"))
+      run("ring", threads, total, capacity);
+    if (mode == NULL || !strcmp(mode, "mutex"))
+      run("mutex", threads, total, capacity);
+  }
+  return 0;
+}
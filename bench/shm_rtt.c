@@ -0,0 +1,158 @@
+/**
+ * @file shm_rtt.c
+ * @brief Round trip of an "l" command over a socket and over shared memory
+ *
+ * A client sends binary "l" requests one at a time and waits for each
+ * reply, a thread answers them the way a desk does, decoding the request
+ * and encoding a response. "socket" sends them over a Unix socket pair,
+ * "shm" through the rings of a shared memory channel mapped twice, as the
+ * client and the server map it. Reported are round trips per second and
+ * the round trip time. With one CPU neither side spins, so every round trip
+ * sleeps and wakes on the futexes.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "protocol.h"
+#include "shm.h"
+
+enum transport { SOCKET, SHM };
+
+static const char* transport_names[] = {"socket", "shm"};
+
+static int round_trips = 200000;
+
+static enum transport transport;
+static int fds[2];
+static struct shm_channel* client_ch;
+static struct shm_channel* server_ch;
+
+static ssize_t server_read(void* buf, size_t len) {
+  if (transport == SHM)
+    return shm_read(&server_ch->requests, buf, len, fds[1]);
+  return read(fds[1], buf, len);
+}
+
+static void server_write(const void* buf, size_t len) {
+  if (transport == SHM)
+    shm_write(&server_ch->replies, buf, len, fds[1]);
+  else
+    write(fds[1], buf, len);
+}
+
+static void client_write(const void* buf, size_t len) {
+  if (transport == SHM)
+    shm_write(&client_ch->requests, buf, len, fds[0]);
+  else
+    write(fds[0], buf, len);
+}
+
+static void client_read_full(unsigned char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = transport == SHM
+                    ? shm_read(&client_ch->replies, buf + got, len - got,
+                               fds[0])
+                    : read(fds[0], buf + got, len - got);
+    if (n <= 0) exit(EXIT_FAILURE);
+    got += n;
+  }
+}
+
+/*Answers requests until quit*/
+static void* desk(void* arg) {
+  unsigned char in[MAX_REQUEST_SIZE * 4];
+  unsigned char out[RESP_HEADER_SIZE + MAX_BODY_SIZE];
+  struct request req;
+  struct response resp = {.status = ST_OK, .body_len = sizeof(int64_t)};
+  size_t len = 0;
+  for (;;) {
+    ssize_t n = server_read(in + len, sizeof(in) - len);
+    if (n <= 0) return NULL;
+    len += n;
+    size_t off = 0;
+    ssize_t used;
+    while ((used = decode_request(in + off, len - off, &req)) > 0) {
+      off += used;
+      if (req.op == OP_QUIT) return NULL;
+      resp.op = req.op;
+      resp.value = (int64_t)req.acc1 * 10;
+      server_write(out, encode_response(&resp, out));
+    }
+    memmove(in, in + off, len - off);
+    len -= off;
+  }
+}
+
+static void run(enum transport t) {
+  unsigned char frame[MAX_REQUEST_SIZE];
+  unsigned char reply[RESP_HEADER_SIZE + sizeof(int64_t)];
+  struct request req = {.op = OP_LIST, .acc1 = 1};
+  long long* lat = malloc(sizeof(long long) * round_trips);
+  char params[40];
+  pthread_t tid;
+  int shm_fd;
+
+  transport = t;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  if (t == SHM) {
+    client_ch = shm_channel_create(&shm_fd);
+    server_ch = client_ch != NULL ? shm_channel_map(shm_fd) : NULL;
+    if (server_ch == NULL) {
+      perror("shm");
+      exit(EXIT_FAILURE);
+    }
+    close(shm_fd);
+  }
+  pthread_create(&tid, NULL, desk, NULL);
+
+  size_t len = encode_request(&req, frame);
+  long long start = bench_now_ns();
+  for (int i = 0; i < round_trips; i++) {
+    long long sent = bench_now_ns();
+    client_write(frame, len);
+    client_read_full(reply, sizeof(reply));
+    lat[i] = bench_now_ns() - sent;
+  }
+  long long elapsed = bench_now_ns() - start;
+  req.op = OP_QUIT;
+  client_write(frame, encode_request(&req, frame));
+  pthread_join(tid, NULL);
+
+  snprintf(params, sizeof(params), "transport=%s", transport_names[t]);
+  bench_result("shm_rtt", params, "round_trips_per_sec",
+               round_trips / (elapsed / 1e9), "ops/s");
+  bench_result("shm_rtt", params, "p50_rtt",
+               bench_percentile(lat, round_trips, 50) / 1000.0, "us");
+  bench_result("shm_rtt", params, "p99_rtt",
+               bench_percentile(lat, round_trips, 99) / 1000.0, "us");
+  if (t == SHM) {
+    shm_channel_unmap(client_ch);
+    shm_channel_unmap(server_ch);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  free(lat);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        round_trips = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-n round_trips]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (round_trips < 1) return -1;
+  run(SOCKET);
+  run(SHM);
+  return 0;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file steal_balance.c
+ * @brief Queue wait of clients with skewed session lengths
+ *
+ * Clients arrive at random intervals and are assigned to the shortest desk
+ * queue like the accept loop does. Most sessions are short but some are
+ * long, so a client can end up behind a long session. "nosteal" gives every
+ * desk its own BlockingQueue, "steal" uses WorkQueues where idle desks take
+ * clients waiting for a busy desk.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "queue.h"
+
+static int desks = 4;
+static int clients = 400;
+static int gap_us = 2500;
+static int short_us = 1000;
+static int long_us = 50000;
+static int long_pct = 10;
+
+static int stealing;
+static struct BlockingQueue* own_queues;
+static struct WorkQueues work;
+
+static long long* waits;
+static atomic_int served;
+static atomic_long* steals;
+
+static void* desk(void* arg) {
+  int id = (int)(long)arg;
+  struct ConnDesc c;
+  bool stolen = false;
+  for (;;) {
+    enum queue_status status = stealing
+                                   ? workRemove(&work, id, &c, &stolen)
+                                   : blockingRemove(&own_queues[id], &c);
+    if (status == QUEUE_SHUTDOWN) break;
+    if (status != QUEUE_ITEM) continue;
+    int idx = atomic_fetch_add(&served, 1);
+    waits[idx] = bench_now_ns() - c.enqueued_ns;
+    if (stolen) atomic_fetch_add(&steals[id], 1);
+    /*Serve the session*/
+    usleep(atoi(c.path));
+  }
+  return NULL;
+}
+
+static int size_of(int i) {
+  return stealing ? workSize(&work, i) : blockingSize(&own_queues[i]);
+}
+
+static bool serving(int i) {
+  return stealing ? workServing(&work, i) : blockingServing(&own_queues[i]);
+}
+
+/*Same choice as enqueue() in server.c*/
+static int shortest_queue() {
+  int shortest = SIZE;
+  int shortest_idx = 0;
+  for (int i = 0; i < desks; i++) {
+    int size = size_of(i);
+    if (size < shortest ||
+        (size == shortest && !serving(i) && serving(shortest_idx))) {
+      shortest = size;
+      shortest_idx = i;
+    }
+  }
+  return shortest_idx;
+}
+
+static void run(const char* mode) {
+  pthread_t* tids = malloc(sizeof(pthread_t) * desks);
+  stealing = !strcmp(mode, "steal");
+  atomic_store(&served, 0);
+  for (int i = 0; i < desks; i++) atomic_store(&steals[i], 0);
+  if (stealing) {
+    createWorkQueues(&work, desks, SIZE);
+  } else {
+    own_queues = malloc(sizeof(struct BlockingQueue) * desks);
+    for (int i = 0; i < desks; i++) createBlockingQueue(&own_queues[i], SIZE);
+  }
+  for (int i = 0; i < desks; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)(long)i);
+
+  srandom(1);
+  long long start = bench_now_ns();
+  for (int i = 0; i < clients; i++) {
+    struct ConnDesc c;
+    int session = (random() % 100 < long_pct) ? long_us : short_us;
+    sprintf(c.path, "%d", session);
+    usleep(random() % (2 * gap_us + 1));
+    c.enqueued_ns = bench_now_ns();
+    int idx = shortest_queue();
+    if (stealing)
+      workInsert(&work, idx, &c);
+    else
+      blockingInsert(&own_queues[idx], &c);
+  }
+  while (atomic_load(&served) < clients) usleep(1000);
+  long long elapsed = bench_now_ns() - start;
+
+  if (stealing) {
+    workShutdown(&work);
+  } else {
+    for (int i = 0; i < desks; i++) shutdownQueue(&own_queues[i]);
+  }
+  for (int i = 0; i < desks; i++) pthread_join(tids[i], NULL);
+  if (stealing) {
+    destroyWorkQueues(&work);
+  } else {
+    for (int i = 0; i < desks; i++) destroyBlockingQueue(&own_queues[i]);
+    free(own_queues);
+  }
+
+  char params[100];
+  sprintf(params, "mode=%s,desks=%d,clients=%d,long_pct=%d", mode, desks,
+          clients, long_pct);
+  bench_result("steal_balance", params, "elapsed", elapsed / 1e6, "ms");
+  bench_result("steal_balance", params, "wait_p50",
+               bench_percentile(waits, clients, 50) / 1e3, "us");
+  bench_result("steal_balance", params, "wait_p99",
+               bench_percentile(waits, clients, 99) / 1e3, "us");
+  bench_result("steal_balance", params, "wait_max",
+               bench_percentile(waits, clients, 100) / 1e3, "us");
+  for (int i = 0; i < desks; i++) {
+    char metric[32];
+    sprintf(metric, "steals_desk%d", i + 1);
+    bench_result("steal_balance", params, metric, atomic_load(&steals[i]),
+                 "clients");
+  }
+  free(tids);
+}
+
+int main(int argc, char** argv) {
+  const char* mode = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:d:n:g:s:l:p:")) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = optarg;
+        break;
+      case 'd':
+        desks = atoi(optarg);
+        break;
+      case 'n':
+        clients = atoi(optarg);
+        break;
+      case 'g':
+        gap_us = atoi(optarg);
+        break;
+      case 's':
+        short_us = atoi(optarg);
+        break;
+      case 'l':
+        long_us = atoi(optarg);
+        break;
+      case 'p':
+        long_pct = atoi(optarg);
+        break;
+      default:
+        printf(
+            "Usage: %s [-m nosteal|steal] [-d desks] [-n clients] "
+            "[-g mean_gap_us] [-s short_us] [-l long_us] [-p long_pct]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (desks < 1 || clients < 1) return -1;
+  waits = calloc(clients, sizeof(long long));
+  steals = calloc(desks, sizeof(atomic_long));
+  if (waits == NULL || steals == NULL) return -1;
+
+  if (mode == NULL || !strcmp(mode, "nosteal")) run("nosteal");
+  if (mode == NULL || !strcmp(mode, "steal")) run("steal");
+  free(waits);
+  free(steals);
+  return 0;
+}
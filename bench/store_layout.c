@@ -0,0 +1,128 @@
+/**
+ * @file store_layout.c
+ * @brief Deposit throughput and scan speed of the account store layouts
+ *
+ * Threads play desks that deposit under the account lock like the server.
+ * "uncontended" gives every thread accounts far from the others, "adjacent"
+ * gives thread t the accounts t, t + threads, ... among the first 64, so
+ * threads never share an account but share cache lines unless the layout
+ * is padded. "contended" sends every thread to the same 4 accounts. The
+ * scan sums every balance, like an audit would.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "store.h"
+
+static const char* path = "store_layout.acc";
+static long long accounts = 1000000;
+static int threads_max = 8;
+static int ops = 500000;
+
+static struct account_store store;
+static const char* pattern;
+static int threads;
+
+static void* desk(void* arg) {
+  long t = (long)arg;
+  for (int i = 0; i < ops; i++) {
+    uint64_t n;
+    if (!strcmp(pattern, "uncontended"))
+      n = (uint64_t)t * (accounts / threads) + i % 64;
+    else if (!strcmp(pattern, "adjacent"))
+      n = t + (uint64_t)threads * (i % (64 / threads + 1));
+    else
+      n = i % 4;
+    pthread_rwlock_wrlock(store_lock(&store, n));
+    *store_balance(&store, n) += 1;
+    store_mark_dirty(&store, n);
+    pthread_rwlock_unlock(store_lock(&store, n));
+  }
+  return NULL;
+}
+
+static void run_deposits(const char* layout) {
+  pthread_t tids[threads];
+  char params[96];
+
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  snprintf(params, sizeof(params), "layout=%s,pattern=%s,threads=%d", layout,
+           pattern, threads);
+  bench_result("store_layout", params, "deposits_per_sec",
+               (double)ops * threads / (elapsed / 1e9), "ops/s");
+}
+
+static void run_scan(const char* layout) {
+  char params[64];
+  long long sum = 0;
+  long long samples[5];
+
+  for (int k = 0; k < 5; k++) {
+    long long start = bench_now_ns();
+    for (uint64_t n = 0; n < store.count; n++) sum += *store_balance(&store, n);
+    samples[k] = bench_now_ns() - start;
+  }
+  if (sum == 42) printf("\n");
+  snprintf(params, sizeof(params), "layout=%s,accounts=%lld", layout,
+           accounts);
+  bench_result("store_layout", params, "scan",
+               accounts / (bench_percentile(samples, 5, 50) / 1e9),
+               "accounts/s");
+}
+
+int main(int argc, char** argv) {
+  const char* only = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:a:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'l':
+        only = optarg;
+        break;
+      case 'a':
+        accounts = atoll(optarg);
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        ops = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-l records|padded|columns] [-a accounts] "
+            "[-t max_threads] [-n ops_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (accounts < 64 || threads_max < 1 || threads_max > 64) return -1;
+  const char* patterns[] = {"uncontended", "adjacent", "contended"};
+  for (int l = STORE_LAYOUT_RECORDS; l <= STORE_LAYOUT_COLUMNS; l++) {
+    const char* name = store_layout_name(l);
+    if (only != NULL && strcmp(only, name)) continue;
+    unlink(path);
+    if (store_open(&store, path, accounts, l) < 0) {
+      perror("store_open");
+      return -1;
+    }
+    run_scan(name);
+    for (int p = 0; p < 3; p++) {
+      pattern = patterns[p];
+      for (threads = 1; threads <= threads_max; threads *= 2)
+        run_deposits(name);
+    }
+    store_close(&store);
+    unlink(path);
+  }
+  return 0;
+}
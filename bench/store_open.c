@@ -0,0 +1,143 @@
+/**
+ * @file store_open.c
+ * @brief Startup time of the account store at different account counts
+ *
+ * "legacy" is how the server used to start: one malloc and one fread per
+ * account from a file of account_storage records. "store" maps the
+ * accounts file and checks its header. The checkpoint is the sync at
+ * shutdown after a number of accounts were changed.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "store.h"
+
+static const char* path = "store_open.acc";
+static long long max_accounts = 100000000;
+static int touched = 1000;
+static int runs = 5;
+
+/*What the server used to keep per account*/
+struct legacy_account {
+  int accnumber;
+  int balance;
+  pthread_rwlock_t lock;
+};
+
+struct legacy_record {
+  int accnumber;
+  int balance;
+};
+
+/*Legacy files need one malloc per account, only try them while that fits
+in memory*/
+#define LEGACY_MAX 1000000
+
+static void run_legacy(long long count) {
+  char params[64];
+  struct legacy_record r = {0, 0};
+  long long samples[runs];
+
+  FILE* f = fopen(path, "w");
+  for (long long i = 0; i < count; i++) {
+    r.accnumber = i;
+    fwrite(&r, sizeof(r), 1, f);
+  }
+  fclose(f);
+  for (int k = 0; k < runs; k++) {
+    long long start = bench_now_ns();
+    struct legacy_account** accounts = malloc(sizeof(*accounts) * count);
+    f = fopen(path, "r");
+    for (long long i = 0; i < count; i++) {
+      accounts[i] = malloc(sizeof(struct legacy_account));
+      pthread_rwlock_init(&accounts[i]->lock, NULL);
+      fread(&r, sizeof(r), 1, f);
+      accounts[i]->accnumber = r.accnumber;
+      accounts[i]->balance = r.balance;
+    }
+    fclose(f);
+    samples[k] = bench_now_ns() - start;
+    for (long long i = 0; i < count; i++) free(accounts[i]);
+    free(accounts);
+  }
+  unlink(path);
+  snprintf(params, sizeof(params), "accounts=%lld,mode=legacy", count);
+  bench_result("store_open", params, "startup",
+               bench_percentile(samples, runs, 50) / 1e6, "ms");
+}
+
+static void run_store(long long count) {
+  struct account_store s;
+  char params[64];
+  long long samples[runs];
+
+  unlink(path);
+  long long start = bench_now_ns();
+  if (store_open(&s, path, count, STORE_LAYOUT_RECORDS) < 0) {
+    perror("store_open");
+    exit(EXIT_FAILURE);
+  }
+  store_close(&s);
+  long long created = bench_now_ns() - start;
+
+  for (int k = 0; k < runs; k++) {
+    start = bench_now_ns();
+    store_open(&s, path, count, STORE_LAYOUT_RECORDS);
+    /*First access to an account*/
+    *store_balance(&s, count / 2) += 1;
+    samples[k] = bench_now_ns() - start;
+    store_close(&s);
+  }
+
+  store_open(&s, path, count, STORE_LAYOUT_RECORDS);
+  unsigned int seed = 1;
+  for (int i = 0; i < touched; i++) {
+    long long n = ((long long)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % count;
+    *store_balance(&s, n) += 1;
+    store_mark_dirty(&s, n);
+  }
+  start = bench_now_ns();
+  store_checkpoint(&s, 1);
+  long long checkpoint = bench_now_ns() - start;
+  store_close(&s);
+  unlink(path);
+
+  snprintf(params, sizeof(params), "accounts=%lld,mode=store", count);
+  bench_result("store_open", params, "create", created / 1e6, "ms");
+  bench_result("store_open", params, "startup",
+               bench_percentile(samples, runs, 50) / 1e6, "ms");
+  snprintf(params, sizeof(params), "accounts=%lld,touched=%d", count,
+           touched);
+  bench_result("store_open", params, "checkpoint", checkpoint / 1e6, "ms");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:f:")) != -1) {
+    switch (opt) {
+      case 'm':
+        max_accounts = atoll(optarg);
+        break;
+      case 't':
+        touched = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-m max_accounts] [-t touched] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (max_accounts < 1 || touched < 0) return -1;
+  long long counts[] = {1000, 1000000, 100000000};
+  for (int i = 0; i < 3 && counts[i] <= max_accounts; i++) {
+    if (counts[i] <= LEGACY_MAX) run_legacy(counts[i]);
+    run_store(counts[i]);
+  }
+  return 0;
+}
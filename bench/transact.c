@@ -0,0 +1,113 @@
+/**
+ * @file transact.c
+ * @brief Throughput of multi-leg transactions for both account engines
+ *
+ * Every transaction takes 1 from half of its legs and pays it to the other
+ * half. "overlap" picks the accounts of the legs from 16 accounts, so
+ * concurrent transactions keep touching the same accounts in different
+ * orders, "spread" picks them from all accounts.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "engine.h"
+
+static const char* path = "transact.acc";
+static long long accounts = 100000;
+static int threads_max = 8;
+static int txns = 200000;
+
+static struct account_store store;
+static const struct engine* engine;
+static int overlap;
+static int nlegs;
+static atomic_long failed;
+
+static void* desk(void* arg) {
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  struct leg legs[PROTO_MAX_LEGS];
+  uint64_t account;
+  int64_t out;
+  long short_of_funds = 0;
+  for (int i = 0; i < txns; i++) {
+    for (int l = 0; l < nlegs; l++) {
+      legs[l].account = rand_r(&seed) % (overlap ? 16 : accounts);
+      legs[l].amount = l < nlegs / 2 ? -1 : 1;
+    }
+    if (engine->transact(&store, legs, nlegs, &account, &out) != ST_OK)
+      short_of_funds++;
+  }
+  atomic_fetch_add(&failed, short_of_funds);
+  return NULL;
+}
+
+static void run(int threads) {
+  pthread_t tids[threads];
+  char params[96];
+
+  atomic_store(&failed, 0);
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  snprintf(params, sizeof(params), "engine=%s,accounts=%s,legs=%d,threads=%d",
+           engine->name, overlap ? "overlap" : "spread", nlegs, threads);
+  bench_result("transact", params, "txns_per_sec",
+               (double)txns * threads / (elapsed / 1e9), "txn/s");
+  bench_result("transact", params, "failed", atomic_load(&failed), "txn");
+}
+
+int main(int argc, char** argv) {
+  const char* only = NULL;
+  int64_t out;
+  int opt;
+  while ((opt = getopt(argc, argv, "m:a:t:n:f:")) != -1) {
+    switch (opt) {
+      case 'm':
+        only = optarg;
+        break;
+      case 'a':
+        accounts = atoll(optarg);
+        break;
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        txns = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf(
+            "Usage: %s [-m rwlock|atomic] [-a accounts] [-t max_threads] "
+            "[-n txns_per_thread] [-f file]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (accounts < 16 || threads_max < 1) return -1;
+  unlink(path);
+  if (store_open(&store, path, accounts, STORE_LAYOUT_PADDED) < 0) {
+    perror("store_open");
+    return -1;
+  }
+  /*Enough money that transactions rarely fail*/
+  for (long long i = 0; i < accounts; i++)
+    rwlock_engine.deposit(&store, i, 1000000, &out);
+  const struct engine* engines[] = {&rwlock_engine, &atomic_engine};
+  for (int e = 0; e < 2; e++) {
+    engine = engines[e];
+    if (only != NULL && strcmp(only, engine->name)) continue;
+    for (overlap = 0; overlap <= 1; overlap++)
+      for (nlegs = 2; nlegs <= PROTO_MAX_LEGS; nlegs *= 2)
+        for (int t = 1; t <= threads_max; t *= 4) run(t);
+  }
+  store_close(&store);
+  unlink(path);
+  return 0;
+}
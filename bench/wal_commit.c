@@ -0,0 +1,97 @@
+/**
+ * @file wal_commit.c
+ * @brief Commit throughput and latency of the write-ahead log
+ *
+ * Every thread plays a desk that appends a deposit and waits for it to be
+ * durable before it "replies", as flush_replies does. The log is synced in
+ * groups: "window" is how long the flusher waits for more records and
+ * "group" how many records make it sync right away. With window 0 a group
+ * is whatever was appended while the previous sync ran.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "wal.h"
+
+static const char* path = "wal_commit.wal";
+static int threads_max = 64;
+static int commits = 200;
+
+static struct wal wal;
+static long long* lat;
+
+static void* desk(void* arg) {
+  long long* my = lat + (long)arg * commits;
+  for (int i = 0; i < commits; i++) {
+    long long start = bench_now_ns();
+    wal_commit(&wal, wal_append(&wal, 'd', (long)arg, 0, 1));
+    my[i] = bench_now_ns() - start;
+  }
+  return NULL;
+}
+
+static void run(int threads, long window_us, int group) {
+  pthread_t tids[threads];
+  char params[80];
+
+  unlink(path);
+  if (wal_open(&wal, path, 0, window_us, group) < 0) {
+    perror("wal_open");
+    exit(EXIT_FAILURE);
+  }
+  long long start = bench_now_ns();
+  for (long i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, desk, (void*)i);
+  for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+  long long elapsed = bench_now_ns() - start;
+  long long syncs = atomic_load(&wal.stats.syncs);
+  wal_close(&wal);
+  unlink(path);
+
+  int n = threads * commits;
+  snprintf(params, sizeof(params), "threads=%d,window_us=%ld,group=%d",
+           threads, window_us, group);
+  bench_result("wal_commit", params, "commits_per_sec",
+               n / (elapsed / 1e9), "ops/s");
+  bench_result("wal_commit", params, "records_per_sync",
+               (double)n / syncs, "records");
+  bench_result("wal_commit", params, "p50_commit",
+               bench_percentile(lat, n, 50) / 1000.0, "us");
+  bench_result("wal_commit", params, "p99_commit",
+               bench_percentile(lat, n, 99) / 1000.0, "us");
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:f:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads_max = atoi(optarg);
+        break;
+      case 'n':
+        commits = atoi(optarg);
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-n commits_per_thread] [-f file]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if (threads_max < 1 || commits < 1) return -1;
+  lat = calloc((size_t)threads_max * commits, sizeof(long long));
+  if (lat == NULL) return -1;
+
+  /*Groups formed while the previous sync is running, a single thread gets
+  one sync per commit*/
+  for (int t = 1; t <= threads_max; t *= 8) run(t, 0, 0);
+  /*Waiting for a group of a given size, or at most 1 ms*/
+  for (int g = 4; g <= threads_max; g *= 4) run(threads_max, 1000, g);
+  free(lat);
+  return 0;
+}
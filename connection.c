@@ -5,36 +5,228 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/msg.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "protocol.h"
+#include "shm.h"
+
 #define BUFSIZE 255
 
+/*Commands sent ahead of their replies in pipelined mode. The replies to a
+full window fit in a pipe, so the server never blocks on a client that is
+still writing.*/
+#define WINDOW 128
+
+/*Largest command sent in either protocol*/
+#define FRAME_SIZE (MAX_REQUEST_SIZE > BUFSIZE ? MAX_REQUEST_SIZE : BUFSIZE)
+
 struct client {
   long int message_type;
   char mtext[100];
 };
 
 int input, output;
+/*Protocol agreed on with the server*/
+enum proto_mode mode = PROTO_TEXT;
+/*Memory shared with the server, commands and replies go through it instead
+of input and output when the server took it*/
+struct shm_channel* shm = NULL;
+
+/*Send bytes to the server*/
+ssize_t send_bytes(const void* buf, size_t len) {
+  if (shm != NULL) return shm_write(&shm->requests, buf, len, output);
+  return write(output, buf, len);
+}
+
+/*Receive what the server sent, up to len bytes*/
+ssize_t recv_bytes(void* buf, size_t len) {
+  if (shm != NULL) return shm_read(&shm->replies, buf, len, input);
+  return read(input, buf, len);
+}
+
+/*Tell the server we are done, in the protocol we agreed on*/
+void send_quit(void) {
+  if (mode == PROTO_BINARY) {
+    unsigned char frame[REQ_HEADER_SIZE];
+    struct request req = {.op = OP_QUIT};
+    send_bytes(frame, encode_request(&req, frame));
+  } else {
+    /*Text commands are always BUFSIZE bytes, the rest zeroed*/
+    char msg[BUFSIZE] = {'q'};
+    send_bytes(msg, BUFSIZE);
+  }
+}
 
 /*Signal handler to tell the server we are exiting*/
 void sig_int(int signum) {
   printf("\nCaught signal SIGINT, disconnecting...\n");
-  write(output, "q", BUFSIZE);
+  send_quit();
   printf("Disconnected\n");
   exit(0);
 }
+
+/*Read exactly len bytes from the server, returns -1 if it went away*/
+int read_full(unsigned char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t n = recv_bytes(buf + got, len - got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    got += n;
+  }
+  return 0;
+}
+
+/*Send a text command and print its reply, which may arrive in pieces on
+the socket, returns -1 if the server went away*/
+int text_command(char* buf) {
+  send_bytes(buf, BUFSIZE);
+  if (read_full((unsigned char*)buf, BUFSIZE) < 0) {
+    printf("Lost connection to server\n");
+    return -1;
+  }
+  buf[BUFSIZE - 1] = '\0';
+  printf("%s\n", buf);
+  return 0;
+}
+
+/*Command sent in pipelined mode and not yet answered*/
+struct pending {
+  struct request req;
+  /*Answered locally without asking the server*/
+  const char* local;
+};
+
+/*Read the reply to a command and print it*/
+int print_reply(struct pending* p) {
+  unsigned char frame[RESP_HEADER_SIZE + MAX_BODY_SIZE];
+  char text[BUFSIZE];
+  struct response resp;
+
+  if (p->local != NULL) {
+    printf("%s\n", p->local);
+    return 0;
+  }
+  if (mode == PROTO_TEXT) {
+    if (read_full(frame, BUFSIZE) < 0) return -1;
+    frame[BUFSIZE - 1] = '\0';
+    printf("%s\n", (char*)frame);
+    return 0;
+  }
+  if (read_full(frame, RESP_HEADER_SIZE) < 0) return -1;
+  uint16_t body_len = frame[2] | (frame[3] << 8);
+  if (body_len > MAX_BODY_SIZE ||
+      read_full(frame + RESP_HEADER_SIZE, body_len) < 0)
+    return -1;
+  decode_response(frame, RESP_HEADER_SIZE + body_len, &resp);
+  format_text_response(&p->req, &resp, text, sizeof(text));
+  printf("%s\n", text);
+  return 0;
+}
+
+/**
+ * @brief Send one command typed by the user as a binary request and print
+ * the answer the same way the text protocol would
+ *
+ * @param line the command as typed
+ * @return 1 if the command was quit, -1 if the server went away, else 0
+ */
+int binary_command(const char* line) {
+  unsigned char frame[MAX_REQUEST_SIZE];
+  struct pending p = {.local = NULL};
+
+  switch (parse_text_request(line, &p.req)) {
+    case -2:
+      printf("fail: Unknown command\n");
+      return 0;
+    case -1:
+      printf("fail: Error in command\n");
+      return 0;
+    default:
+      break;
+  }
+  if (p.req.op == OP_QUIT) {
+    send_quit();
+    return 1;
+  }
+  send_bytes(frame, encode_request(&p.req, frame));
+  return print_reply(&p);
+}
+
+/**
+ * @brief Send commands from in without waiting for each reply
+ *
+ * Commands are sent in batches of up to WINDOW per write and replies are
+ * printed in the order the commands were read, like in interactive mode.
+ *
+ * @param in
+ * @return 0 when all commands were answered, -1 if the server went away
+ */
+int pipeline_commands(FILE* in) {
+  static struct pending window[WINDOW];
+  static unsigned char batch[WINDOW * FRAME_SIZE];
+  char line[BUFSIZE];
+  int head = 0;
+  int count = 0;
+  int done = 0;
+
+  while (!done || count > 0) {
+    size_t len = 0;
+    /*Read commands until the window is full*/
+    while (!done && count < WINDOW) {
+      if (fgets(line, BUFSIZE, in) == NULL) {
+        done = 1;
+        break;
+      }
+      struct pending* p = &window[(head + count) % WINDOW];
+      int parsed = parse_text_request(line, &p->req);
+      p->local = NULL;
+      if (parsed == -2) {
+        p->local = "fail: Unknown command";
+      } else if (parsed == -1) {
+        p->local = "fail: Error in command";
+      } else if (p->req.op == OP_QUIT) {
+        done = 1;
+        break;
+      } else if (mode == PROTO_BINARY) {
+        len += encode_request(&p->req, batch + len);
+      } else {
+        memset(batch + len, 0, BUFSIZE);
+        format_text_request(&p->req, (char*)batch + len, BUFSIZE);
+        len += BUFSIZE;
+      }
+      count++;
+    }
+    if (len > 0 && send_bytes(batch, len) < 0) return -1;
+    /*Keep half a window in flight while there are more commands*/
+    int keep = done ? 0 : WINDOW / 2;
+    while (count > keep) {
+      if (print_reply(&window[head]) < 0) return -1;
+      head = (head + 1) % WINDOW;
+      count--;
+    }
+  }
+  send_quit();
+  return 0;
+}
+
 /**
  * @brief Connects to server by passing 2 named pipes via a message queue
  *
  * @param fname file that contains msgqid
  * @param input the variable which will store our input side of the named pipe
  * @param output the variable which will store our output side of the named pip
+ * @param binary ask the server for the binary protocol, mode tells if it
+ * agreed
  * @return int
  */
-int connect_to_server(const char* fname, int* input, int* output) {
+int connect_to_server(const char* fname, int* input, int* output,
+                      int binary) {
   FILE* runfile;
   int msgqid = -1;
   struct client c;
@@ -43,16 +235,17 @@ int connect_to_server(const char* fname, int* input, int* output) {
   char path_in[50];
   char path_out[50];
   char to_child[100];
-  char* buf = malloc(BUFSIZE);
+  char* buf = calloc(sizeof(char), BUFSIZE);
   /*Use pid to guarantee unique name for named pipe*/
   sprintf(path_in, "/tmp/fifoin%d", pid);
   sprintf(path_out, "/tmp/fifoout%d", pid);
   mkfifo(path_in, 0666);
   mkfifo(path_out, 0666);
 
-  strcat(to_child, path_in);
+  strcpy(to_child, path_in);
   strcat(to_child, "|");
   strcat(to_child, path_out);
+  if (binary) strcat(to_child, "|b");
   strcpy(c.mtext, to_child);
   c.message_type = 1;
 
@@ -73,7 +266,9 @@ int connect_to_server(const char* fname, int* input, int* output) {
   if (*input < 0 || *output < 0) return -1;
   /*Block until we get write from server*/
   int n = read(*input, buf, 49);
-  if (n >= 0 && !strcmp(buf, "ready\n")) {
+  if (n >= 0 && !strcmp(buf, READY_BINARY)) mode = PROTO_BINARY;
+  /*A server without the binary protocol answers plain ready*/
+  if (n >= 0 && (mode == PROTO_BINARY || !strcmp(buf, READY_TEXT))) {
     free(buf);
     return msgqid;
   }
@@ -81,6 +276,82 @@ int connect_to_server(const char* fname, int* input, int* output) {
   return -1;
 }
 
+/*Send the first byte to the server, with the descriptor of the shared
+memory if shm_fd is not -1*/
+int send_hello(int fd, char hello, int shm_fd) {
+  struct iovec iov = {&hello, 1};
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+  if (shm_fd >= 0) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &shm_fd, sizeof(int));
+  }
+  return sendmsg(fd, &msg, 0) == 1 ? 0 : -1;
+}
+
+/**
+ * @brief Connects to server through its Unix socket, which takes one round
+ * trip and leaves no pipes behind
+ *
+ * @param path of the socket
+ * @param input the variable which will store the socket
+ * @param output the variable which will store the socket as well
+ * @param binary ask the server for the binary protocol, mode tells if it
+ * agreed
+ * @param shared offer the server memory to send commands and replies
+ * through, shm is set if it took it
+ * @return the socket, -1 if the server could not be reached
+ */
+int connect_to_socket(const char* path, int* input, int* output, int binary,
+                      int shared) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  struct shm_channel* ch = NULL;
+  int shm_fd = -1;
+  char buf[50] = "";
+  char hello = binary ? HELLO_BINARY : HELLO_TEXT;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+  /*Without shared memory we carry on over the socket*/
+  if (shared) ch = shm_channel_create(&shm_fd);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      send_hello(fd, hello, shm_fd) < 0)
+    goto fail;
+  /*The server has its own descriptor now*/
+  if (shm_fd >= 0) close(shm_fd);
+  shm_fd = -1;
+  *input = *output = fd;
+  /*Block until the server is ready*/
+  int n = read(fd, buf, sizeof(buf) - 1);
+  if (n <= 0) goto fail;
+  if (!strcmp(buf, READY_BINARY) || !strcmp(buf, READY_SHM_BINARY))
+    mode = PROTO_BINARY;
+  if (!strcmp(buf, READY_SHM_TEXT) || !strcmp(buf, READY_SHM_BINARY)) {
+    shm = ch;
+    return fd;
+  }
+  /*A server in event mode answers over the socket*/
+  if (mode == PROTO_BINARY || !strcmp(buf, READY_TEXT)) {
+    if (ch != NULL) shm_channel_unmap(ch);
+    return fd;
+  }
+fail:
+  if (fd >= 0) close(fd);
+  if (shm_fd >= 0) close(shm_fd);
+  if (ch != NULL) shm_channel_unmap(ch);
+  return -1;
+}
+
 int main(int argc, char** argv) {
   setvbuf(stdin, NULL, _IOLBF, 0);
   setvbuf(stdout, NULL, _IOLBF, 0);
@@ -89,32 +360,81 @@ int main(int argc, char** argv) {
   that is use to pass the named pipe that will
   be used for ipc with the server*/
   const char* fname = "runfile";
-  int msgqid;
+  int conn;
+  int binary = 0;
+  int pipelined = 0;
+  int use_socket = 0;
+  int shared = 0;
+  int opt;
+
+  /*-b asks the server for the binary protocol, -p sends commands without
+  waiting for each reply, -u connects through the socket of the server
+  instead of named pipes, -s also shares memory with the server*/
+  while ((opt = getopt(argc, argv, "bpsu")) != -1) {
+    switch (opt) {
+      case 'b':
+        binary = 1;
+        break;
+      case 'p':
+        pipelined = 1;
+        break;
+      case 's':
+        shared = 1;
+        use_socket = 1;
+        break;
+      case 'u':
+        use_socket = 1;
+        break;
+      default:
+        printf("Usage: %s [-b] [-u] [-s] [-p [file]]\n", argv[0]);
+        return -1;
+    }
+  }
 
   if (access(fname, F_OK) == 0) {
     char* buf = calloc(sizeof(char), BUFSIZE);
     int quit = 0;
 
-    if ((msgqid = connect_to_server(fname, &input, &output)) >= 0) {
+    if (use_socket)
+      conn = connect_to_socket(BANK_SOCKET, &input, &output, binary, shared);
+    else
+      conn = connect_to_server(fname, &input, &output, binary);
+    if (conn >= 0) {
       /*Connect to server uses blocking function call read() which means
       that we won't enter before server is ready to communicate*/
       printf("ready\n");
       /*Init signal handler*/
       signal(SIGINT, sig_int);
+      if (pipelined) {
+        /*Commands come from the file if one is given, else stdin*/
+        FILE* in = optind < argc ? fopen(argv[optind], "r") : stdin;
+        if (in == NULL) {
+          printf("Could not open %s\n", argv[optind]);
+          send_quit();
+        } else if (pipeline_commands(in) < 0) {
+          printf("Lost connection to server\n");
+        }
+        if (in != NULL && in != stdin) fclose(in);
+        quit = 1;
+      }
       while (!quit) {
         /*Parse commands and communicate with server*/
         if (fgets(buf, BUFSIZE, stdin) == NULL) break;
+        if (mode == PROTO_BINARY) {
+          int res = binary_command(buf);
+          if (res < 0) printf("Lost connection to server\n");
+          quit = res != 0;
+          continue;
+        }
         switch (buf[0]) {
           case 'q':
             quit = 1;
-            write(output, "q", BUFSIZE);
+            send_quit();
             break;
           case 'l': {
             int accno = -1;
             if (sscanf(buf, "l %d", &accno) == 1) {
-              write(output, buf, BUFSIZE);
-              read(input, buf, BUFSIZE);
-              printf("%s\n", buf);
+              quit = text_command(buf) < 0;
             } else
               printf("fail: Error in command\n");
             break;
@@ -123,9 +443,7 @@ int main(int argc, char** argv) {
             int accno = -1;
             int amount = 0;
             if ((sscanf(buf, "w %d %d", &accno, &amount)) == 2) {
-              write(output, buf, BUFSIZE);
-              read(input, buf, BUFSIZE);
-              printf("%s\n", buf);
+              quit = text_command(buf) < 0;
             } else
               printf("fail: Error in command\n");
             break;
@@ -134,9 +452,7 @@ int main(int argc, char** argv) {
             int accno = -1;
             int amount = 0;
             if ((sscanf(buf, "d %d %d", &accno, &amount)) == 2) {
-              write(output, buf, BUFSIZE);
-              read(input, buf, BUFSIZE);
-              printf("%s\n", buf);
+              quit = text_command(buf) < 0;
             } else
               printf("fail: Error in command\n");
             break;
@@ -146,9 +462,16 @@ int main(int argc, char** argv) {
             int accno2 = -1;
             int amount = 0;
             if ((sscanf(buf, "t %d %d %d", &accno1, &accno2, &amount)) == 3) {
-              write(output, buf, BUFSIZE);
-              read(input, buf, BUFSIZE);
-              printf("%s\n", buf);
+              quit = text_command(buf) < 0;
+            } else
+              printf("fail: Error in command\n");
+            break;
+          }
+          case 'o':
+          case 'x': {
+            struct request req;
+            if (parse_text_request(buf, &req) == 0) {
+              quit = text_command(buf) < 0;
             } else
               printf("fail: Error in command\n");
             break;
@@ -161,7 +484,8 @@ int main(int argc, char** argv) {
     }
     free(buf);
     close(input);
-    close(output);
+    if (output != input) close(output);
+    if (shm != NULL) shm_channel_unmap(shm);
   } else {
     /*The runfile does not exists -> server is not running*/
     printf("server is not running\n");
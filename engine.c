@@ -0,0 +1,475 @@
+#include "engine.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+/*Where the calling thread counts its waits*/
+static __thread atomic_ullong* my_waits;
+
+void engine_count_waits(atomic_ullong* waits) { my_waits = waits; }
+
+uint64_t engine_waits(void) {
+  if (my_waits == NULL) return 0;
+  return atomic_load_explicit(my_waits, memory_order_relaxed);
+}
+
+static void count_wait(void) {
+  if (my_waits == NULL) return;
+  atomic_store_explicit(
+      my_waits, atomic_load_explicit(my_waits, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+/*Whether other threads run while we spin, -1 until we know*/
+static int many_cpus = -1;
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/*Let another thread finish what it is doing, with one CPU it only can if
+we give the CPU up*/
+static void let_other_run(void) {
+  if (many_cpus < 0) many_cpus = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  if (many_cpus)
+    cpu_relax();
+  else
+    sched_yield();
+}
+
+/*The rwlock and the combining engine change a balance only with the lock
+of its stripe held for writing, and count the sequence of the stripe up
+before and after, so it is odd while balances of the stripe change.
+Balances are read without the lock: a reader reads the sequence, the
+balance and the sequence again, and reads again if a writer was busy in
+between, so readers never write anything that writers use.*/
+
+static void write_begin(struct account_store* s, uint64_t n,
+                        unsigned int epoch) {
+  atomic_uint* seq = store_seq(s, n);
+  /*A snapshot being taken gets the balances from before*/
+  store_before_write(s, n, epoch);
+  unsigned int v = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, v + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(struct account_store* s, uint64_t n) {
+  atomic_uint* seq = store_seq(s, n);
+  unsigned int v = atomic_load_explicit(seq, memory_order_relaxed);
+  atomic_store_explicit(seq, v + 1, memory_order_release);
+}
+
+/*Read the balance in slot n as no writer left it halfway*/
+static int32_t read_balance(struct account_store* s, uint64_t n) {
+  atomic_uint* seq = store_seq(s, n);
+  int32_t* balance = store_balance(s, n);
+  int waited = 0;
+  for (;;) {
+    unsigned int before = atomic_load_explicit(seq, memory_order_acquire);
+    if (!(before & 1)) {
+      int32_t value = __atomic_load_n(balance, __ATOMIC_RELAXED);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(seq, memory_order_relaxed) == before)
+        return value;
+    }
+    if (!waited++) count_wait();
+    let_other_run();
+  }
+}
+
+/*Take a lock, counting a wait if someone else has it*/
+static void lock_write(pthread_rwlock_t* lock) {
+  if (pthread_rwlock_trywrlock(lock) == 0) return;
+  count_wait();
+  pthread_rwlock_wrlock(lock);
+}
+
+/*Sum of the amounts of the legs on the account of leg i, or 0 if an
+earlier leg is on the same account, so each account is counted once*/
+static int64_t net_amount(const struct leg* legs, int n, int i) {
+  int64_t sum = 0;
+  for (int j = 0; j < n; j++) {
+    if (legs[j].account != legs[i].account) continue;
+    if (j < i) return 0;
+    sum += legs[j].amount;
+  }
+  return sum;
+}
+
+/*Find the slots of the accounts of all legs*/
+static enum proto_status find_legs(struct account_store* s,
+                                   const struct leg* legs, int n,
+                                   int64_t* slots) {
+  if (n < 1 || n > PROTO_MAX_LEGS) return ST_BAD_REQUEST;
+  for (int i = 0; i < n; i++)
+    if ((slots[i] = store_find(s, legs[i].account)) < 0) return ST_NO_ACCOUNT;
+  return ST_OK;
+}
+
+/*Lock the stripes of the slots of a transaction for writing, in ascending
+order and each only once as accounts may share a stripe, so two
+transactions never wait for each other. Returns the number of stripes.*/
+static int lock_stripes(struct account_store* s, const int64_t* slots,
+                        int n, size_t* stripes) {
+  int nstripes = 0;
+  for (int i = 0; i < n; i++) {
+    size_t stripe = slots[i] % STORE_LOCKS;
+    int j = nstripes;
+    while (j > 0 && stripes[j - 1] > stripe) j--;
+    if (j > 0 && stripes[j - 1] == stripe) continue;
+    memmove(stripes + j + 1, stripes + j, (nstripes - j) * sizeof(*stripes));
+    stripes[j] = stripe;
+    nstripes++;
+  }
+  for (int i = 0; i < nstripes; i++)
+    lock_write(store_lock(s, stripes[i]));
+  return nstripes;
+}
+
+static void unlock_stripes(struct account_store* s, const size_t* stripes,
+                           int nstripes) {
+  for (int i = nstripes - 1; i >= 0; i--)
+    pthread_rwlock_unlock(store_lock(s, stripes[i]));
+}
+
+static enum proto_status rw_balance(struct account_store* s, uint64_t id,
+                                    int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  *out = read_balance(s, n);
+  return ST_OK;
+}
+
+static enum proto_status rw_withdraw(struct account_store* s, uint64_t id,
+                                     int32_t amount, int64_t* out) {
+  enum proto_status status = ST_OK;
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  int32_t* balance = store_balance(s, n);
+  lock_write(store_lock(s, n));
+  if (*balance >= amount) {
+    write_begin(s, n, store_snap_epoch(s));
+    *balance -= amount;
+    write_end(s, n);
+    store_mark_dirty(s, n);
+  } else {
+    status = ST_INSUFFICIENT;
+  }
+  *out = *balance;
+  pthread_rwlock_unlock(store_lock(s, n));
+  return status;
+}
+
+static enum proto_status rw_deposit(struct account_store* s, uint64_t id,
+                                    int32_t amount, int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  int32_t* balance = store_balance(s, n);
+  lock_write(store_lock(s, n));
+  write_begin(s, n, store_snap_epoch(s));
+  *balance += amount;
+  write_end(s, n);
+  store_mark_dirty(s, n);
+  *out = *balance;
+  pthread_rwlock_unlock(store_lock(s, n));
+  return ST_OK;
+}
+
+static enum proto_status rw_transact(struct account_store* s,
+                                     const struct leg* legs, int n,
+                                     uint64_t* account, int64_t* out) {
+  int64_t slots[PROTO_MAX_LEGS];
+  size_t stripes[PROTO_MAX_LEGS];
+  enum proto_status status = find_legs(s, legs, n, slots);
+  if (status != ST_OK) return status;
+  int nstripes = lock_stripes(s, slots, n, stripes);
+
+  /*Only accounts that lose money can run short, the one reported is the
+  first of them or the one short of money*/
+  int reported = -1;
+  for (int i = 0; i < n && status == ST_OK; i++) {
+    int64_t net = net_amount(legs, n, i);
+    if (net >= 0) continue;
+    if (reported < 0) reported = i;
+    if (*store_balance(s, slots[i]) + net < 0) {
+      status = ST_INSUFFICIENT;
+      reported = i;
+    }
+  }
+  if (reported < 0) reported = 0;
+  if (status == ST_OK) {
+    /*Legs on the same account pass through balances nobody may see*/
+    unsigned int epoch = store_snap_epoch(s);
+    for (int i = 0; i < nstripes; i++) write_begin(s, stripes[i], epoch);
+    for (int i = 0; i < n; i++) {
+      *store_balance(s, slots[i]) += legs[i].amount;
+      store_mark_dirty(s, slots[i]);
+    }
+    for (int i = 0; i < nstripes; i++) write_end(s, stripes[i]);
+  }
+  *account = legs[reported].account;
+  *out = *store_balance(s, slots[reported]);
+  unlock_stripes(s, stripes, nstripes);
+  return status;
+}
+
+static enum proto_status rw_transfer(struct account_store* s, uint64_t from,
+                                     uint64_t to, int32_t amount,
+                                     int64_t* out) {
+  struct leg legs[2] = {{from, -(int64_t)amount}, {to, amount}};
+  uint64_t account;
+  if (from == to) return ST_NO_ACCOUNT;
+  return rw_transact(s, legs, 2, &account, out);
+}
+
+const struct engine rwlock_engine = {"rwlock",    rw_balance,  rw_withdraw,
+                                     rw_deposit,  rw_transfer, rw_transact};
+
+/*The combining engine runs withdrawals and deposits through the list of
+requests waiting for a lock stripe. A request is pushed on the list, and
+the thread that then gets the write lock takes the whole list and runs
+every request on it, its own among them, before it lets go of the lock.
+The others wait for their request to be marked done, so while one thread
+holds the lock the balances stay in its cache and the lock changes hands
+once per batch instead of once per command.*/
+
+/*Lists the lock holder takes before it lets go of the lock*/
+#define COMBINE_PASSES 4
+
+/*Checks of its request a waiting thread makes before it tries the lock,
+with more than one CPU*/
+#define COMBINE_SPIN 200
+
+struct combine_request {
+  _Alignas(CACHE_LINE) struct combine_request* next;
+  int64_t slot;
+  int32_t amount;
+  int withdraw;
+  enum proto_status status;
+  int64_t out;
+  atomic_int done;
+};
+
+/*Run the requests waiting for a stripe, its write lock held. The list is
+newest first, they run in the order they came.*/
+static void combine(struct account_store* s, atomic_uintptr_t* waiting,
+                    uint64_t stripe) {
+  for (int pass = 0; pass < COMBINE_PASSES; pass++) {
+    struct combine_request* r =
+        (struct combine_request*)atomic_exchange(waiting, 0);
+    if (r == NULL) return;
+    struct combine_request* order = NULL;
+    while (r != NULL) {
+      struct combine_request* next = r->next;
+      r->next = order;
+      order = r;
+      r = next;
+    }
+    write_begin(s, stripe, store_snap_epoch(s));
+    while (order != NULL) {
+      /*The request belongs to a thread that goes on once it is done*/
+      struct combine_request* next = order->next;
+      int32_t* balance = store_balance(s, order->slot);
+      order->status = ST_OK;
+      if (!order->withdraw)
+        *balance += order->amount;
+      else if (*balance >= order->amount)
+        *balance -= order->amount;
+      else
+        order->status = ST_INSUFFICIENT;
+      if (order->status == ST_OK) store_mark_dirty(s, order->slot);
+      order->out = *balance;
+      atomic_store_explicit(&order->done, 1, memory_order_release);
+      order = next;
+    }
+    write_end(s, stripe);
+  }
+}
+
+static enum proto_status cb_apply(struct account_store* s, uint64_t id,
+                                  int32_t amount, int withdraw,
+                                  int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  struct combine_request req = {NULL, n, amount, withdraw, ST_OK, 0, 0};
+  atomic_uintptr_t* waiting = store_waiting(s, n);
+  pthread_rwlock_t* lock = store_lock(s, n);
+  uintptr_t head = atomic_load_explicit(waiting, memory_order_relaxed);
+  do {
+    req.next = (struct combine_request*)head;
+  } while (!atomic_compare_exchange_weak(waiting, &head, (uintptr_t)&req));
+
+  int waited = 0;
+  while (!atomic_load_explicit(&req.done, memory_order_acquire)) {
+    /*Whoever gets the lock takes our request along with the rest*/
+    if (pthread_rwlock_trywrlock(lock) == 0) {
+      combine(s, waiting, n % STORE_LOCKS);
+      pthread_rwlock_unlock(lock);
+      continue;
+    }
+    if (!waited++) count_wait();
+    for (int i = 0; i < COMBINE_SPIN && many_cpus > 0; i++) {
+      if (atomic_load_explicit(&req.done, memory_order_relaxed)) break;
+      cpu_relax();
+    }
+    let_other_run();
+  }
+  *out = req.out;
+  return req.status;
+}
+
+static enum proto_status cb_withdraw(struct account_store* s, uint64_t id,
+                                     int32_t amount, int64_t* out) {
+  return cb_apply(s, id, amount, 1, out);
+}
+
+static enum proto_status cb_deposit(struct account_store* s, uint64_t id,
+                                    int32_t amount, int64_t* out) {
+  return cb_apply(s, id, amount, 0, out);
+}
+
+/*Everything else takes the locks like the rwlock engine*/
+const struct engine combine_engine = {"combine",   rw_balance,  cb_withdraw,
+                                      cb_deposit,  rw_transfer, rw_transact};
+
+/*The atomic engine uses the atomic builtins on the balances in the mapping,
+they are plain int32_t in the store. Withdrawals and deposits never lock;
+transactions take the locks of their stripes like the rwlock engine, so
+they never run into each other, and keep the sequence of the stripes odd
+while they change balances, so readers and withdrawals wait them out.*/
+
+static enum proto_status at_balance(struct account_store* s, uint64_t id,
+                                    int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  *out = read_balance(s, n);
+  return ST_OK;
+}
+
+/*Withdraw from slot n an amount that may be more than a balance can hold,
+as the sum of the legs of a transaction*/
+static enum proto_status at_take(struct account_store* s, uint64_t n,
+                                 int64_t amount, int64_t* out) {
+  int32_t* balance = store_balance(s, n);
+  int32_t old = __atomic_load_n(balance, __ATOMIC_RELAXED);
+  for (;;) {
+    if (old < amount) {
+      *out = old;
+      return ST_INSUFFICIENT;
+    }
+    if (__atomic_compare_exchange_n(balance, &old, old - amount, 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+    count_wait();
+  }
+  store_mark_dirty(s, n);
+  *out = old - amount;
+  return ST_OK;
+}
+
+/*Deposit into slot n*/
+static int64_t at_add(struct account_store* s, uint64_t n, int32_t amount) {
+  int64_t balance =
+      __atomic_add_fetch(store_balance(s, n), amount, __ATOMIC_ACQ_REL);
+  store_mark_dirty(s, n);
+  return balance;
+}
+
+/*A withdrawal short of money may have seen a transaction that took money
+and gives it back, so it only fails if no transaction ran on the stripe
+while it looked, and tries again once the transaction is done otherwise*/
+static enum proto_status at_withdraw(struct account_store* s, uint64_t id,
+                                     int32_t amount, int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  atomic_uint* seq = store_seq(s, n);
+  int waited = 0;
+  for (;;) {
+    unsigned int before = atomic_load_explicit(seq, memory_order_acquire);
+    enum proto_status status = at_take(s, n, amount, out);
+    if (status == ST_OK) return status;
+    atomic_thread_fence(memory_order_acquire);
+    if (!(before & 1) &&
+        atomic_load_explicit(seq, memory_order_relaxed) == before)
+      return status;
+    if (!waited++) count_wait();
+    let_other_run();
+  }
+}
+
+static enum proto_status at_deposit(struct account_store* s, uint64_t id,
+                                    int32_t amount, int64_t* out) {
+  int64_t n = store_find(s, id);
+  if (n < 0) return ST_NO_ACCOUNT;
+  *out = at_add(s, n, amount);
+  return ST_OK;
+}
+
+static enum proto_status at_transact(struct account_store* s,
+                                     const struct leg* legs, int n,
+                                     uint64_t* account, int64_t* out) {
+  int64_t slots[PROTO_MAX_LEGS];
+  size_t stripes[PROTO_MAX_LEGS];
+  enum proto_status status = find_legs(s, legs, n, slots);
+  if (status != ST_OK) return status;
+  int nstripes = lock_stripes(s, slots, n, stripes);
+  unsigned int epoch = store_snap_epoch(s);
+  for (int i = 0; i < nstripes; i++) write_begin(s, stripes[i], epoch);
+
+  /*Take the money first, withdrawals that do not lock may still get some
+  of it before, then nothing can fail once it is taken*/
+  int reported = -1;
+  int64_t balance = 0;
+  for (int i = 0; i < n; i++) {
+    int64_t net = net_amount(legs, n, i);
+    if (net >= 0) continue;
+    status = at_take(s, slots[i], -net, &balance);
+    if (reported < 0 || status != ST_OK) reported = i;
+    if (status == ST_OK) continue;
+    /*Give back what the earlier legs took*/
+    for (int j = 0; j < i; j++) {
+      int64_t back = net_amount(legs, n, j);
+      if (back < 0) at_add(s, slots[j], (int32_t)-back);
+    }
+    break;
+  }
+  if (status == ST_OK) {
+    for (int i = 0; i < n; i++) {
+      int64_t net = net_amount(legs, n, i);
+      if (net > 0) at_add(s, slots[i], (int32_t)net);
+    }
+  }
+  if (reported < 0) reported = 0;
+  *account = legs[reported].account;
+  *out = status == ST_OK ? __atomic_load_n(store_balance(s, slots[reported]),
+                                           __ATOMIC_RELAXED)
+                         : balance;
+
+  for (int i = 0; i < nstripes; i++) write_end(s, stripes[i]);
+  unlock_stripes(s, stripes, nstripes);
+  return status;
+}
+
+static enum proto_status at_transfer(struct account_store* s, uint64_t from,
+                                     uint64_t to, int32_t amount,
+                                     int64_t* out) {
+  struct leg legs[2] = {{from, -(int64_t)amount}, {to, amount}};
+  uint64_t account;
+  if (from == to) return ST_NO_ACCOUNT;
+  return at_transact(s, legs, 2, &account, out);
+}
+
+const struct engine atomic_engine = {"atomic",    at_balance,  at_withdraw,
+                                     at_deposit,  at_transfer, at_transact};
+
+const struct engine* engine_by_name(const char* name) {
+  if (!strcmp(name, rwlock_engine.name)) return &rwlock_engine;
+  if (!strcmp(name, atomic_engine.name)) return &atomic_engine;
+  if (!strcmp(name, combine_engine.name)) return &combine_engine;
+  return NULL;
+}
@@ -0,0 +1,86 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+/**
+ * @file engine.h
+ * @brief Ways of changing the balances in the account store
+ *
+ * The rwlock engine takes the lock of an account for every command that
+ * changes it, and reads a balance between two reads of a sequence that
+ * writers count up, without writing anything itself. The atomic engine
+ * reads a balance with an atomic load, deposits with an atomic add and
+ * withdraws with a compare-and-swap that keeps the check for sufficient
+ * funds.
+ *
+ * A transaction pays into and takes from any number of accounts at once,
+ * completely or not at all: it fails if any account would end up below
+ * zero. The rwlock engine locks the accounts of a transaction in the order
+ * of their locks, so two transactions can never wait for each other. The
+ * atomic engine locks them the same way and then takes the money with
+ * compare-and-swap, as withdrawals that do not lock may take some at the
+ * same time. It gives it back if one account is short; balances read and
+ * withdrawals short of money wait until the transaction is done, so no
+ * desk sees it halfway. A transfer is a transaction of two legs.
+ *
+ * The combining engine withdraws and deposits by putting the request on
+ * a list of the lock of the account. The thread that gets the lock runs
+ * all requests on the list, the others wait for theirs to be done, so
+ * desks that all use one account do not hand its lock to each other for
+ * every command. Everything else it does like the rwlock engine.
+ *
+ * Every operation returns ST_OK, ST_NO_ACCOUNT or ST_INSUFFICIENT and sets
+ * out to the balance of the (first) account afterwards.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "protocol.h"
+#include "store.h"
+
+struct engine {
+  const char* name;
+  enum proto_status (*balance)(struct account_store* s, uint64_t id,
+                               int64_t* out);
+  enum proto_status (*withdraw)(struct account_store* s, uint64_t id,
+                                int32_t amount, int64_t* out);
+  enum proto_status (*deposit)(struct account_store* s, uint64_t id,
+                               int32_t amount, int64_t* out);
+  enum proto_status (*transfer)(struct account_store* s, uint64_t from,
+                                uint64_t to, int32_t amount, int64_t* out);
+  /*Legs with amounts that fit a balance, up to PROTO_MAX_LEGS, account is
+  set to the account out belongs to: the first one that was short, or the
+  account of the first leg*/
+  enum proto_status (*transact)(struct account_store* s,
+                                const struct leg* legs, int n,
+                                uint64_t* account, int64_t* out);
+};
+
+extern const struct engine rwlock_engine;
+extern const struct engine atomic_engine;
+extern const struct engine combine_engine;
+
+/**
+ * @brief Engine named "rwlock", "atomic" or "combine"
+ *
+ * @return the engine, NULL if there is none by that name
+ */
+const struct engine* engine_by_name(const char* name);
+
+/**
+ * @brief Count the times the calling thread finds the lock of an account
+ * taken or has to retry a compare-and-swap on a balance
+ *
+ * Only the calling thread may write the counter.
+ *
+ * @param waits incremented on every wait, NULL to stop counting
+ */
+void engine_count_waits(atomic_ullong* waits);
+
+/**
+ * @brief Waits counted so far by the calling thread, 0 if it does not count
+ * them
+ */
+uint64_t engine_waits(void);
+
+#endif  // __ENGINE_H__
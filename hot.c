@@ -0,0 +1,272 @@
+#include "hot.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*Desk of the calling thread, which sub-balance it deposits into*/
+static __thread int my_desk = -1;
+/*Commands the calling thread ran, to look at the clock once in a while*/
+static __thread unsigned int my_commands;
+
+void hot_set_desk(int desk) { my_desk = desk; }
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*Add to a counter only the calling desk writes*/
+static void add_own(atomic_ullong* c, uint64_t n) {
+  atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                        memory_order_relaxed);
+}
+
+/*Entry of an account that is hot, or being demoted if demoting is set*/
+static int find(struct hot_accounts* h, uint64_t id, int demoting) {
+  if (atomic_load_explicit(&h->active, memory_order_relaxed) == 0) return -1;
+  for (int i = 0; i < HOT_MAX; i++) {
+    struct hot_entry* e = &h->entries[i];
+    int state = atomic_load_explicit(&e->state, memory_order_acquire);
+    if (state == HOT_FREE || (state == HOT_DEMOTING && !demoting)) continue;
+    if (atomic_load_explicit(&e->id, memory_order_relaxed) == id) return i;
+  }
+  return -1;
+}
+
+static uint64_t all_deposits(struct hot_accounts* h, struct hot_entry* e) {
+  uint64_t sum = 0;
+  for (int d = 0; d < h->desks; d++)
+    sum += atomic_load_explicit(&e->subs[d].deposits, memory_order_relaxed);
+  return sum;
+}
+
+struct hot_accounts* hot_create(struct account_store* s,
+                                const struct engine* engine, int desks) {
+  struct hot_accounts* h = aligned_alloc(CACHE_LINE, sizeof(*h));
+  if (h == NULL) return NULL;
+  memset(h, 0, sizeof(*h));
+  h->store = s;
+  h->engine = engine;
+  h->desks = desks;
+  pthread_mutex_init(&h->lock, NULL);
+  atomic_init(&h->period_start_ns, now_ns());
+  for (int i = 0; i < HOT_MAX; i++) {
+    struct hot_entry* e = &h->entries[i];
+    pthread_mutex_init(&e->lock, NULL);
+    e->subs = aligned_alloc(CACHE_LINE, sizeof(struct hot_sub) * desks);
+    if (e->subs == NULL) {
+      while (i-- > 0) free(h->entries[i].subs);
+      free(h);
+      return NULL;
+    }
+    memset(e->subs, 0, sizeof(struct hot_sub) * desks);
+  }
+  return h;
+}
+
+void hot_destroy(struct hot_accounts* h) {
+  for (int i = 0; i < HOT_MAX; i++) {
+    struct hot_entry* e = &h->entries[i];
+    if (atomic_load(&e->state) != HOT_FREE) hot_fold(h, i);
+    pthread_mutex_destroy(&e->lock);
+    free(e->subs);
+  }
+  pthread_mutex_destroy(&h->lock);
+  free(h);
+}
+
+int hot_deposit(struct hot_accounts* h, uint64_t id, int32_t amount,
+                int64_t* out) {
+  /*A negative amount would let a withdrawal pass on a base that only
+  holds more than the account because of it*/
+  if (my_desk < 0 || my_desk >= h->desks || amount < 0) return -1;
+  int i = find(h, id, 0);
+  if (i < 0) return -1;
+  struct hot_entry* e = &h->entries[i];
+  struct hot_sub* sub = &e->subs[my_desk];
+  /*Say we are busy before the last look, so either we see a demotion
+  that started or the demotion waits for us*/
+  atomic_store(&sub->busy, 1);
+  if (atomic_load(&e->state) != HOT_ACTIVE || atomic_load(&e->id) != id) {
+    atomic_store_explicit(&sub->busy, 0, memory_order_release);
+    return -1;
+  }
+  atomic_fetch_add_explicit(&sub->amount, amount, memory_order_relaxed);
+  add_own(&sub->deposits, 1);
+  *out = __atomic_load_n(store_balance(h->store, e->slot), __ATOMIC_RELAXED) +
+         hot_pending(h, i);
+  atomic_store_explicit(&sub->busy, 0, memory_order_release);
+  return 0;
+}
+
+int hot_lock(struct hot_accounts* h, uint64_t id) {
+  int i = find(h, id, 1);
+  if (i < 0) return -1;
+  struct hot_entry* e = &h->entries[i];
+  pthread_mutex_lock(&e->lock);
+  /*It may have been demoted, or even given to another account, since*/
+  if (atomic_load(&e->state) == HOT_FREE || atomic_load(&e->id) != id) {
+    pthread_mutex_unlock(&e->lock);
+    return -1;
+  }
+  return i;
+}
+
+void hot_unlock(struct hot_accounts* h, int entry) {
+  pthread_mutex_unlock(&h->entries[entry].lock);
+}
+
+int64_t hot_pending(struct hot_accounts* h, int entry) {
+  struct hot_entry* e = &h->entries[entry];
+  int64_t sum = 0;
+  for (int d = 0; d < h->desks; d++)
+    sum += atomic_load_explicit(&e->subs[d].amount, memory_order_relaxed);
+  return sum;
+}
+
+int64_t hot_fold(struct hot_accounts* h, int entry) {
+  struct hot_entry* e = &h->entries[entry];
+  uint64_t id = atomic_load_explicit(&e->id, memory_order_relaxed);
+  int64_t sum = 0;
+  int64_t out;
+  for (int d = 0; d < h->desks; d++)
+    sum += atomic_exchange_explicit(&e->subs[d].amount, 0,
+                                    memory_order_relaxed);
+  /*The engine deposits amounts that fit a command*/
+  for (int64_t left = sum; left > 0;) {
+    int32_t part = left > INT_MAX ? INT_MAX : (int32_t)left;
+    h->engine->deposit(h->store, id, part, &out);
+    left -= part;
+  }
+  return sum;
+}
+
+int hot_lock_legs(struct hot_accounts* h, const struct leg* legs, int n,
+                  int* entries) {
+  int found = 0;
+  for (int i = 0; i < n; i++) {
+    int e = find(h, legs[i].account, 1);
+    if (e < 0) continue;
+    /*Sorted and each entry once, so two transactions never wait for each
+    other*/
+    int j = found;
+    while (j > 0 && entries[j - 1] > e) j--;
+    if (j > 0 && entries[j - 1] == e) continue;
+    memmove(entries + j + 1, entries + j, (found - j) * sizeof(*entries));
+    entries[j] = e;
+    found++;
+  }
+  int locked = 0;
+  for (int i = 0; i < found; i++) {
+    struct hot_entry* e = &h->entries[entries[i]];
+    pthread_mutex_lock(&e->lock);
+    /*It may have been demoted, or given to another account, since it was
+    found*/
+    int still = 0;
+    if (atomic_load(&e->state) != HOT_FREE) {
+      uint64_t id = atomic_load(&e->id);
+      for (int l = 0; l < n; l++) still |= legs[l].account == id;
+    }
+    if (!still) {
+      hot_unlock(h, entries[i]);
+      continue;
+    }
+    hot_fold(h, entries[i]);
+    entries[locked++] = entries[i];
+  }
+  return locked;
+}
+
+int hot_lock_all(struct hot_accounts* h, int* entries) {
+  int locked = 0;
+  for (int i = 0; i < HOT_MAX; i++) {
+    struct hot_entry* e = &h->entries[i];
+    pthread_mutex_lock(&e->lock);
+    if (atomic_load(&e->state) == HOT_FREE)
+      pthread_mutex_unlock(&e->lock);
+    else
+      entries[locked++] = i;
+  }
+  return locked;
+}
+
+/*Make an account hot, if it is not yet and there is a free entry*/
+static void promote(struct hot_accounts* h, uint64_t id) {
+  pthread_mutex_lock(&h->lock);
+  int64_t slot = store_find(h->store, id);
+  if (slot >= 0 && find(h, id, 1) < 0) {
+    for (int i = 0; i < HOT_MAX; i++) {
+      struct hot_entry* e = &h->entries[i];
+      if (atomic_load(&e->state) != HOT_FREE) continue;
+      atomic_store(&e->id, id);
+      e->slot = slot;
+      e->period_deposits = all_deposits(h, e);
+      e->promoted_late = 1;
+      atomic_store(&e->state, HOT_ACTIVE);
+      atomic_fetch_add(&h->active, 1);
+      atomic_fetch_add(&h->promoted, 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&h->lock);
+}
+
+/*Fold an account back into its base and free its entry, with the lock of
+the hot accounts held*/
+static void demote(struct hot_accounts* h, int entry) {
+  struct hot_entry* e = &h->entries[entry];
+  atomic_store(&e->state, HOT_DEMOTING);
+  /*Deposits that saw it active finish first*/
+  for (int d = 0; d < h->desks; d++)
+    while (atomic_load(&e->subs[d].busy)) sched_yield();
+  pthread_mutex_lock(&e->lock);
+  hot_fold(h, entry);
+  atomic_store(&e->state, HOT_FREE);
+  pthread_mutex_unlock(&e->lock);
+  atomic_fetch_sub(&h->active, 1);
+  atomic_fetch_add(&h->demoted, 1);
+}
+
+void hot_note_wait(struct hot_accounts* h, uint64_t id) {
+  struct hot_candidate* c =
+      &h->candidates[(id * 0x9E3779B97F4A7C15ULL) >> 58 & (HOT_CANDIDATES - 1)];
+  /*Another account takes over the counter, the busier one wins it back*/
+  if (atomic_load_explicit(&c->id, memory_order_relaxed) != id) {
+    atomic_store_explicit(&c->id, id, memory_order_relaxed);
+    atomic_store_explicit(&c->waits, 1, memory_order_relaxed);
+    return;
+  }
+  if (atomic_fetch_add_explicit(&c->waits, 1, memory_order_relaxed) + 1 ==
+      HOT_PROMOTE_WAITS)
+    promote(h, id);
+}
+
+void hot_tick(struct hot_accounts* h) {
+  if (++my_commands % HOT_TICK_COMMANDS != 0) return;
+  long long now = now_ns();
+  if (now - atomic_load_explicit(&h->period_start_ns, memory_order_relaxed) <
+      HOT_PERIOD_MS * 1000000LL)
+    return;
+  /*Another desk is already starting the period*/
+  if (pthread_mutex_trylock(&h->lock) != 0) return;
+  atomic_store_explicit(&h->period_start_ns, now, memory_order_relaxed);
+  for (int i = 0; i < HOT_CANDIDATES; i++)
+    atomic_store_explicit(&h->candidates[i].waits, 0, memory_order_relaxed);
+  for (int i = 0; i < HOT_MAX; i++) {
+    struct hot_entry* e = &h->entries[i];
+    if (atomic_load(&e->state) != HOT_ACTIVE) continue;
+    uint64_t deposits = all_deposits(h, e);
+    /*Only judged on a whole period*/
+    if (!e->promoted_late &&
+        deposits - e->period_deposits < HOT_DEMOTE_DEPOSITS)
+      demote(h, i);
+    else
+      e->period_deposits = deposits;
+    e->promoted_late = 0;
+  }
+  pthread_mutex_unlock(&h->lock);
+}
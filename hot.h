@@ -0,0 +1,186 @@
+#ifndef __HOT_H__
+#define __HOT_H__
+
+/**
+ * @file hot.h
+ * @brief Accounts that most deposits go to, split into per-desk balances
+ *
+ * When deposits to an account keep finding its lock taken, the account is
+ * promoted: every desk gets a sub-balance of its own for it, on its own
+ * cache line, and a deposit only adds to the sub-balance of its desk, so
+ * desks depositing to the same account no longer wait for each other. The
+ * balance of the account in the store stays the base, the money of the
+ * account is the base plus its sub-balances.
+ *
+ * Everything else on a hot account takes the lock of its entry here and
+ * folds the sub-balances into the base when it needs them: "l" adds them to
+ * the base without moving them, a withdrawal that the base does not cover
+ * folds them and checks again, and transfers and transactions fold them
+ * before they run. Sub-balances only ever grow between folds, so a
+ * withdrawal that the base covers is covered by the account, and one that
+ * fails was short even with every deposit that came before it.
+ *
+ * Deposits that waited on the lock of a cold account are counted per
+ * account, an account that gets HOT_PROMOTE_WAITS of them within a period
+ * of HOT_PERIOD_MS is promoted if there is room. A hot account that gets
+ * fewer than HOT_DEMOTE_DEPOSITS deposits within a period is folded and
+ * demoted again. Only threads that called hot_set_desk() with their desk
+ * deposit into sub-balances, others take the lock of the entry.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "engine.h"
+#include "store.h"
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+/*Accounts that can be hot at the same time*/
+#define HOT_MAX 16
+
+/*Cold accounts whose waits are counted at the same time*/
+#define HOT_CANDIDATES 64
+
+#define HOT_PERIOD_MS 100
+#define HOT_PROMOTE_WAITS 64
+#define HOT_DEMOTE_DEPOSITS 256
+
+/*Commands a desk runs between looking at the clock for a new period*/
+#define HOT_TICK_COMMANDS 1024
+
+/*A desk's share of a hot account, written by that desk only, except for
+amount which a fold empties*/
+struct hot_sub {
+  _Alignas(CACHE_LINE) atomic_llong amount;
+  atomic_ullong deposits;
+  /*Set while the desk deposits, so a demotion can wait for it*/
+  atomic_int busy;
+};
+
+enum hot_state { HOT_FREE, HOT_ACTIVE, HOT_DEMOTING };
+
+struct hot_entry {
+  _Alignas(CACHE_LINE) atomic_int state;
+  atomic_ullong id;
+  int64_t slot;
+  /*Taken by everything but deposits, and by folds*/
+  pthread_mutex_t lock;
+  /*Deposits of all desks at the start of the period, and whether it was
+  promoted during the last one*/
+  uint64_t period_deposits;
+  int promoted_late;
+  struct hot_sub* subs;
+};
+
+struct hot_candidate {
+  atomic_ullong id;
+  atomic_uint waits;
+};
+
+struct hot_accounts {
+  struct account_store* store;
+  const struct engine* engine;
+  int desks;
+  /*Entries that are not free, so cold accounts skip the lookup when none
+  is hot*/
+  atomic_int active;
+  /*Taken to promote, demote and start a period*/
+  pthread_mutex_t lock;
+  atomic_llong period_start_ns;
+  atomic_ullong promoted;
+  atomic_ullong demoted;
+  struct hot_entry entries[HOT_MAX];
+  struct hot_candidate candidates[HOT_CANDIDATES];
+};
+
+/**
+ * @brief Allocate the hot accounts of a bank, none of them hot yet
+ *
+ * @param desks number of desks that may call hot_set_desk()
+ * @return the hot accounts, NULL if there is not enough memory
+ */
+struct hot_accounts* hot_create(struct account_store* s,
+                                const struct engine* engine, int desks);
+
+/**
+ * @brief Fold every hot account and free them, no desk may use them
+ */
+void hot_destroy(struct hot_accounts* h);
+
+/**
+ * @brief Set the desk of the calling thread, -1 for none
+ */
+void hot_set_desk(int desk);
+
+/**
+ * @brief Deposit into the sub-balance of the calling desk if the account
+ * is hot
+ *
+ * @param out set to the money of the account afterwards, which other desks
+ * may be changing at the same time
+ * @return 0 if deposited, -1 if the account is not hot or the thread has
+ * no desk, then the caller deposits the usual way
+ */
+int hot_deposit(struct hot_accounts* h, uint64_t id, int32_t amount,
+                int64_t* out);
+
+/**
+ * @brief Lock the entry of an account if it is hot
+ *
+ * While it is locked the base only changes by what the holder does, and
+ * the entry stays hot.
+ *
+ * @return the entry, -1 if the account is not hot
+ */
+int hot_lock(struct hot_accounts* h, uint64_t id);
+
+void hot_unlock(struct hot_accounts* h, int entry);
+
+/**
+ * @brief Money in the sub-balances of a locked entry, not in the base
+ */
+int64_t hot_pending(struct hot_accounts* h, int entry);
+
+/**
+ * @brief Move the sub-balances of a locked entry into the base
+ *
+ * @return the amount moved
+ */
+int64_t hot_fold(struct hot_accounts* h, int entry);
+
+/**
+ * @brief Lock and fold the entries of the hot accounts among the legs, in
+ * the order of the entries
+ *
+ * @param entries set to the locked entries
+ * @return the number of locked entries
+ */
+int hot_lock_legs(struct hot_accounts* h, const struct leg* legs, int n,
+                  int* entries);
+
+/**
+ * @brief Lock the entries of all hot accounts, in the order of the entries
+ *
+ * @param entries set to the locked entries, HOT_MAX of them at most
+ * @return the number of locked entries
+ */
+int hot_lock_all(struct hot_accounts* h, int* entries);
+
+/**
+ * @brief Count a deposit to a cold account that waited for its lock, which
+ * may promote the account
+ */
+void hot_note_wait(struct hot_accounts* h, uint64_t id);
+
+/**
+ * @brief Count a command of the calling desk, every HOT_TICK_COMMANDS
+ * commands it checks whether a new period started, demotes the accounts
+ * that cooled down and starts counting waits afresh
+ */
+void hot_tick(struct hot_accounts* h);
+
+#endif  // __HOT_H__
@@ -0,0 +1,141 @@
+#include "index.h"
+
+#include <stdlib.h>
+
+/*Mix the bits of an account number, consecutive numbers end up far
+apart*/
+static uint64_t hash(uint64_t id) {
+  id ^= id >> 30;
+  id *= 0xbf58476d1ce4e5b9ULL;
+  id ^= id >> 27;
+  id *= 0x94d049bb133111ebULL;
+  return id ^ (id >> 31);
+}
+
+static struct index_shard* shard_of(struct account_index* x, uint64_t h) {
+  return &x->shards[h % INDEX_SHARDS];
+}
+
+/*Position to start probing at, from the bits not used to pick the shard*/
+static size_t home(const struct index_table* t, uint64_t h) {
+  return (h / INDEX_SHARDS) & t->mask;
+}
+
+static struct index_table* new_table(struct account_index* x, size_t size) {
+  size_t bytes = sizeof(struct index_table) + size * sizeof(struct index_entry);
+  struct index_table* t = calloc(1, bytes);
+  if (t == NULL) return NULL;
+  t->mask = size - 1;
+  atomic_fetch_add(&x->bytes, bytes);
+  return t;
+}
+
+int index_init(struct account_index* x) {
+  atomic_init(&x->bytes, 0);
+  x->shards =
+      aligned_alloc(CACHE_LINE, INDEX_SHARDS * sizeof(struct index_shard));
+  if (x->shards == NULL) return -1;
+  for (int i = 0; i < INDEX_SHARDS; i++) {
+    struct index_table* t = new_table(x, INDEX_MIN_ENTRIES);
+    if (t == NULL) {
+      for (int j = 0; j < i; j++) free(x->shards[j].table);
+      free(x->shards);
+      x->shards = NULL;
+      return -1;
+    }
+    pthread_mutex_init(&x->shards[i].lock, NULL);
+    atomic_init(&x->shards[i].table, t);
+    x->shards[i].used = 0;
+  }
+  return 0;
+}
+
+int64_t index_find(struct account_index* x, uint64_t id) {
+  uint64_t h = hash(id);
+  struct index_table* t =
+      atomic_load_explicit(&shard_of(x, h)->table, memory_order_acquire);
+  for (size_t i = home(t, h);; i = (i + 1) & t->mask) {
+    uint64_t key =
+        atomic_load_explicit(&t->entries[i].key, memory_order_acquire);
+    if (key == id + 1) return t->entries[i].slot;
+    if (key == 0) return -1;
+  }
+}
+
+/*Copy the entries of a shard into a table twice the size and make it the
+one desks probe, with the lock of the shard held*/
+static struct index_table* grow(struct account_index* x,
+                                struct index_shard* sh,
+                                struct index_table* t) {
+  struct index_table* bigger = new_table(x, (t->mask + 1) * 2);
+  if (bigger == NULL) return NULL;
+  for (size_t i = 0; i <= t->mask; i++) {
+    uint64_t key = atomic_load_explicit(&t->entries[i].key,
+                                        memory_order_relaxed);
+    if (key == 0) continue;
+    size_t j = home(bigger, hash(key - 1));
+    while (atomic_load_explicit(&bigger->entries[j].key,
+                                memory_order_relaxed) != 0)
+      j = (j + 1) & bigger->mask;
+    bigger->entries[j].slot = t->entries[i].slot;
+    atomic_store_explicit(&bigger->entries[j].key, key, memory_order_relaxed);
+  }
+  bigger->old = t;
+  atomic_store_explicit(&sh->table, bigger, memory_order_release);
+  return bigger;
+}
+
+int64_t index_add(struct account_index* x, uint64_t id,
+                  int64_t (*new_slot)(uint64_t id, void* arg), void* arg,
+                  int* added) {
+  uint64_t h = hash(id);
+  struct index_shard* sh = shard_of(x, h);
+  int64_t slot = -1;
+  size_t i;
+
+  *added = 0;
+  /*The key of the largest number would be 0*/
+  if (id == UINT64_MAX) return -1;
+  pthread_mutex_lock(&sh->lock);
+  struct index_table* t =
+      atomic_load_explicit(&sh->table, memory_order_relaxed);
+  for (i = home(t, h);; i = (i + 1) & t->mask) {
+    uint64_t key =
+        atomic_load_explicit(&t->entries[i].key, memory_order_relaxed);
+    if (key == id + 1) {
+      slot = t->entries[i].slot;
+      goto out;
+    }
+    if (key == 0) break;
+  }
+  if ((sh->used + 1) * 4 > (t->mask + 1) * 3) {
+    if ((t = grow(x, sh, t)) == NULL) goto out;
+    for (i = home(t, h); atomic_load_explicit(&t->entries[i].key,
+                                              memory_order_relaxed) != 0;
+         i = (i + 1) & t->mask) {
+    }
+  }
+  if ((slot = new_slot(id, arg)) < 0) goto out;
+  /*The slot must be there before desks can find the key*/
+  t->entries[i].slot = slot;
+  atomic_store_explicit(&t->entries[i].key, id + 1, memory_order_release);
+  sh->used++;
+  *added = 1;
+out:
+  pthread_mutex_unlock(&sh->lock);
+  return slot;
+}
+
+void index_destroy(struct account_index* x) {
+  if (x->shards == NULL) return;
+  for (int i = 0; i < INDEX_SHARDS; i++) {
+    struct index_table* t = atomic_load(&x->shards[i].table);
+    while (t != NULL) {
+      struct index_table* old = t->old;
+      free(t);
+      t = old;
+    }
+    pthread_mutex_destroy(&x->shards[i].lock);
+  }
+  free(x->shards);
+}
@@ -0,0 +1,93 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+/**
+ * @file index.h
+ * @brief Hash index from account numbers to slots of the account store
+ *
+ * The index is split into INDEX_SHARDS shards by a hash of the account
+ * number, each an open-addressing table with linear probing that is at
+ * most three quarters full. Finding an account takes no lock. Adding one
+ * takes the lock of its shard only, so desks keep finding accounts while
+ * others are added. A full table is copied into one twice its size that
+ * replaces it; desks still probing the old table find everything that was
+ * in it, so old tables are kept until the index is destroyed. Together
+ * they take less memory than the current tables.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define INDEX_SHARDS 256
+
+/*Entries of a shard before it first grows*/
+#define INDEX_MIN_ENTRIES 16
+
+/*Account number + 1, so that 0 is an empty entry*/
+struct index_entry {
+  atomic_ullong key;
+  uint64_t slot;
+};
+
+struct index_table {
+  /*Table this one replaced*/
+  struct index_table* old;
+  size_t mask;
+  struct index_entry entries[];
+};
+
+/*Shards are on separate cache lines*/
+struct index_shard {
+  _Alignas(CACHE_LINE) pthread_mutex_t lock;
+  struct index_table* _Atomic table;
+  size_t used;
+};
+
+struct account_index {
+  struct index_shard* shards;
+  /*Memory taken by all tables*/
+  atomic_size_t bytes;
+};
+
+/**
+ * @brief Create an empty index
+ *
+ * @return 0 on success, -1 if there is not enough memory
+ */
+int index_init(struct account_index* x);
+
+/**
+ * @brief Slot of account id
+ *
+ * @return the slot, -1 if the account is not in the index
+ */
+int64_t index_find(struct account_index* x, uint64_t id);
+
+/**
+ * @brief Find account id or add it
+ *
+ * @param x
+ * @param id
+ * @param new_slot called with the lock of the shard held when id is not in
+ * the index yet, returns the slot of the new account or -1 if there is none
+ * @param arg passed to new_slot
+ * @param added set to 1 if the account was added, else 0
+ * @return the slot of the account, -1 if it was not there and could not be
+ * added
+ */
+int64_t index_add(struct account_index* x, uint64_t id,
+                  int64_t (*new_slot)(uint64_t id, void* arg), void* arg,
+                  int* added);
+
+/**
+ * @brief Free all tables of the index
+ */
+void index_destroy(struct account_index* x);
+
+#endif  // __INDEX_H__
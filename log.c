@@ -0,0 +1,253 @@
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Records formatted per write*/
+#define LOG_BATCH 4096
+
+/*Formatted lines buffered per write, and the longest line*/
+#define LOG_OUT_SIZE 65536
+#define LOG_LINE_MAX 1024
+
+enum log_level log_threshold = LOG_OFF;
+
+static const char* level_names[] = {"debug", "info", "warn", "error", "off"};
+
+static int fd = -1;
+static pthread_t flusher;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/*Signalled when a ring is half full or the log is closed*/
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int woken;
+static int stop;
+/*Rings of every thread that logged since log_open*/
+static struct log_ring* _Atomic rings;
+/*Incremented by log_open, a thread whose ring is from an earlier one makes a
+new ring*/
+static atomic_int generation;
+
+static __thread struct log_ring* my_ring;
+static __thread int my_generation;
+
+/*Records of a batch and the order to write them in*/
+static struct log_record* batch;
+static int* order;
+
+int log_level_by_name(const char* name) {
+  for (int i = LOG_DEBUG; i <= LOG_OFF; i++)
+    if (strcmp(name, level_names[i]) == 0) return i;
+  return -1;
+}
+
+/*Ring of the calling thread, NULL if there is not enough memory*/
+static struct log_ring* ring(void) {
+  int gen = atomic_load_explicit(&generation, memory_order_acquire);
+  if (my_ring != NULL && my_generation == gen) return my_ring;
+  struct log_ring* r = aligned_alloc(CACHE_LINE, sizeof(struct log_ring));
+  if (r == NULL) return NULL;
+  atomic_init(&r->head, 0);
+  atomic_init(&r->tail, 0);
+  r->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &r->next, r)) {
+  }
+  my_ring = r;
+  my_generation = gen;
+  return r;
+}
+
+void log_push(const char* msg, long a, long b) {
+  struct log_ring* r = ring();
+  if (r == NULL) return;
+  size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t used;
+  while ((used = h - atomic_load_explicit(&r->tail, memory_order_acquire)) ==
+         LOG_RING_RECORDS)
+    sched_yield();
+  struct log_record* rec = &r->records[h % LOG_RING_RECORDS];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  rec->msg = msg;
+  rec->args[0] = a;
+  rec->args[1] = b;
+  atomic_store_explicit(&r->head, h + 1, memory_order_release);
+  /*Do not wait for the next flush when the ring is filling up*/
+  if (used + 1 == LOG_RING_RECORDS / 2) {
+    pthread_mutex_lock(&lock);
+    woken = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static int write_all(const char* p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*Format the message of a record, returns its length*/
+static size_t format(char* p, size_t room, const struct log_record* r) {
+  size_t n = 0;
+  int arg = 0;
+  for (const char* f = r->msg; *f != '\0' && n + 24 < room; f++) {
+    if (*f != '%' || f[1] == '\0') {
+      p[n++] = *f;
+      continue;
+    }
+    long v = arg < LOG_MAX_ARGS ? r->args[arg] : 0;
+    switch (*++f) {
+      case 'd':
+        n += sprintf(p + n, "%ld", v);
+        arg++;
+        break;
+      case 'x':
+        n += sprintf(p + n, "%lx", (unsigned long)v);
+        arg++;
+        break;
+      case 'c':
+        p[n++] = (char)v;
+        arg++;
+        break;
+      default:
+        p[n++] = *f;
+    }
+  }
+  return n;
+}
+
+/*Append one line per record to the file, the date is formatted again only
+when the second changes*/
+static void write_lines(struct log_record* recs, int* idx, int n) {
+  static char out[LOG_OUT_SIZE];
+  static char prefix[40];
+  static size_t prefix_len;
+  static time_t prefix_sec = -1;
+  size_t len = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct log_record* r = &recs[idx[i]];
+    time_t sec = r->ns / 1000000000LL;
+    if (sec != prefix_sec) {
+      struct tm t;
+      localtime_r(&sec, &t);
+      prefix_len =
+          strftime(prefix, sizeof(prefix), "%Y-%m-%d %H:%M:%S Server: ", &t);
+      prefix_sec = sec;
+    }
+    if (LOG_OUT_SIZE - len < LOG_LINE_MAX) {
+      write_all(out, len);
+      len = 0;
+    }
+    memcpy(out + len, prefix, prefix_len);
+    len += prefix_len;
+    len += format(out + len, LOG_LINE_MAX - prefix_len - 2, r);
+    memcpy(out + len, " \n", 2);
+    len += 2;
+  }
+  if (len > 0) write_all(out, len);
+}
+
+static int by_time(const void* a, const void* b) {
+  int x = *(const int*)a;
+  int y = *(const int*)b;
+  if (batch[x].ns != batch[y].ns) return batch[x].ns < batch[y].ns ? -1 : 1;
+  /*Records of one thread keep their order*/
+  return (x > y) - (x < y);
+}
+
+/*Take up to LOG_BATCH records from the rings and write them, returns how
+many there were*/
+static int drain(void) {
+  int n = 0;
+
+  for (struct log_ring* r = atomic_load(&rings); r != NULL; r = r->next) {
+    size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+    for (; t != h && n < LOG_BATCH; t++, n++) {
+      batch[n] = r->records[t % LOG_RING_RECORDS];
+      order[n] = n;
+    }
+    atomic_store_explicit(&r->tail, t, memory_order_release);
+  }
+  qsort(order, n, sizeof(int), by_time);
+  write_lines(batch, order, n);
+  return n;
+}
+
+static void* flush_rings(void* arg) {
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    if (!woken && !stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&wake, &lock, &deadline);
+    }
+    woken = 0;
+    int stopping = stop;
+    pthread_mutex_unlock(&lock);
+    while (drain() == LOG_BATCH) {
+    }
+    pthread_mutex_lock(&lock);
+    if (stopping) break;
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int log_open(const char* path, enum log_level level) {
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return -1;
+  batch = malloc(LOG_BATCH * sizeof(struct log_record));
+  order = malloc(LOG_BATCH * sizeof(int));
+  if (batch == NULL || order == NULL) goto fail;
+  woken = 0;
+  stop = 0;
+  atomic_store(&rings, NULL);
+  atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+  if (pthread_create(&flusher, NULL, flush_rings, NULL) != 0) goto fail;
+  log_threshold = level;
+  return 0;
+fail:
+  free(batch);
+  free(order);
+  close(fd);
+  fd = -1;
+  return -1;
+}
+
+void log_close(void) {
+  if (fd < 0) return;
+  log_threshold = LOG_OFF;
+  pthread_mutex_lock(&lock);
+  stop = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(flusher, NULL);
+  struct log_ring* r = atomic_exchange(&rings, NULL);
+  while (r != NULL) {
+    struct log_ring* next = r->next;
+    free(r);
+    r = next;
+  }
+  free(batch);
+  free(order);
+  close(fd);
+  fd = -1;
+}
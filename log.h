@@ -0,0 +1,99 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/**
+ * @file log.h
+ * @brief Server log written by a background thread
+ *
+ * A thread that logs pushes a fixed-size record, the time, message and up
+ * to LOG_MAX_ARGS numbers, into a ring of its own that no other thread
+ * writes to, so logging takes no lock and makes no system call. A
+ * flusher thread takes the records of all rings every LOG_FLUSH_MS
+ * milliseconds, or sooner when a ring fills up, puts them in time order,
+ * formats them and appends them to the log file in one write. The date and
+ * time in front of each line is formatted once per second.
+ *
+ * A message is a string constant, it is formatted by the flusher long after
+ * the call. Its numbers are printed where it has %d, in decimal, %x, in
+ * hexadecimal, and %c, as a character. A thread whose ring is full waits
+ * for the flusher, no record is lost.
+ *
+ * Records below the level given to log_open are not pushed at all, such a
+ * call costs a comparison.
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define LOG_MAX_ARGS 2
+
+/*Records per thread*/
+#define LOG_RING_RECORDS 2048
+
+/*How often the flusher writes out the rings*/
+#define LOG_FLUSH_MS 10
+
+enum log_level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+struct log_record {
+  /*Wall clock time*/
+  int64_t ns;
+  const char* msg;
+  long args[LOG_MAX_ARGS];
+};
+
+/*Records of one thread, pushed by the thread and taken by the flusher*/
+struct log_ring {
+  _Alignas(CACHE_LINE) atomic_size_t head;
+  _Alignas(CACHE_LINE) atomic_size_t tail;
+  struct log_ring* next;
+  struct log_record records[LOG_RING_RECORDS];
+};
+
+/*Records below this level are not logged, LOG_OFF until log_open*/
+extern enum log_level log_threshold;
+
+/**
+ * @brief Open the log file for appending and start the flusher
+ *
+ * @param path
+ * @param level lowest level that is logged
+ * @return 0 on success, -1 on failure
+ */
+int log_open(const char* path, enum log_level level);
+
+/**
+ * @brief Level named "debug", "info", "warn", "error" or "off"
+ *
+ * @return the level, -1 if there is none by that name
+ */
+int log_level_by_name(const char* name);
+
+/*Push a record into the ring of the calling thread*/
+void log_push(const char* msg, long a, long b);
+
+/*Log msg and the numbers a and b*/
+static inline void log_eventf(enum log_level level, const char* msg, long a,
+                              long b) {
+  if (level < log_threshold) return;
+  log_push(msg, a, b);
+}
+
+/*Log msg*/
+static inline void log_event(enum log_level level, const char* msg) {
+  log_eventf(level, msg, 0, 0);
+}
+
+/**
+ * @brief Write out what is left, stop the flusher and close the log
+ *
+ * No thread may log while or after this runs.
+ */
+void log_close(void);
+
+#endif  // __LOG_H__
@@ -0,0 +1,169 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*Names of the entries of the commands array*/
+static const char* op_names[METRICS_OPS] = {"l", "w", "d", "t",
+                                            "x", "o", "other"};
+
+static int listen_fd = -1;
+static pthread_t listener;
+static atomic_int stop;
+static char* socket_path;
+static void (*write_snapshot)(FILE*, void*);
+static void* snapshot_arg;
+
+struct desk_metrics* metrics_create(int n) {
+  struct desk_metrics* m =
+      aligned_alloc(CACHE_LINE, n * sizeof(struct desk_metrics));
+  if (m == NULL) return NULL;
+  memset(m, 0, n * sizeof(struct desk_metrics));
+  return m;
+}
+
+/*Smallest value counted in bucket b*/
+static uint64_t bucket_low(int b) {
+  if (b < METRICS_SUB_BUCKETS) return b;
+  int bits = b / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+  return (uint64_t)(METRICS_SUB_BUCKETS + b % METRICS_SUB_BUCKETS)
+         << (bits - METRICS_SUB_BITS);
+}
+
+/*Largest value counted in bucket b*/
+static uint64_t bucket_high(int b) {
+  if (b == METRICS_BUCKETS - 1) return UINT64_MAX;
+  return bucket_low(b + 1) - 1;
+}
+
+/*Value below which p percent of the counts are, at most max*/
+static uint64_t percentile(const uint64_t* buckets, uint64_t count,
+                           uint64_t max, double p) {
+  uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+  uint64_t seen = 0;
+  if (rank == 0) rank = 1;
+  for (int b = 0; b < METRICS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= rank) return bucket_high(b) < max ? bucket_high(b) : max;
+  }
+  return max;
+}
+
+/*Write a histogram as a JSON object, the buckets that counted something
+as [lowest value, count] pairs*/
+static void write_histogram(FILE* out, struct histogram* h) {
+  uint64_t buckets[METRICS_BUCKETS];
+  uint64_t count = 0;
+  /*Percentiles come from the copy, so they agree with each other even
+  while the desk keeps counting*/
+  for (int b = 0; b < METRICS_BUCKETS; b++) {
+    buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+    count += buckets[b];
+  }
+  uint64_t sum = atomic_load_explicit(&h->sum_ns, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+  fprintf(out,
+          "{\"count\":%llu,\"mean_ns\":%llu,\"p50_ns\":%llu,"
+          "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+          "\"max_ns\":%llu,\"buckets\":[",
+          (unsigned long long)count,
+          (unsigned long long)(count ? sum / count : 0),
+          (unsigned long long)percentile(buckets, count, max, 50),
+          (unsigned long long)percentile(buckets, count, max, 90),
+          (unsigned long long)percentile(buckets, count, max, 99),
+          (unsigned long long)percentile(buckets, count, max, 99.9),
+          (unsigned long long)max);
+  const char* sep = "";
+  for (int b = 0; b < METRICS_BUCKETS; b++) {
+    if (buckets[b] == 0) continue;
+    fprintf(out, "%s[%llu,%llu]", sep, (unsigned long long)bucket_low(b),
+            (unsigned long long)buckets[b]);
+    sep = ",";
+  }
+  fprintf(out, "]}");
+}
+
+void metrics_write_desk(FILE* out, struct desk_metrics* m) {
+  fprintf(out, "\"lock_waits\":%llu,\"queue_wait\":",
+          (unsigned long long)atomic_load_explicit(&m->lock_waits,
+                                                   memory_order_relaxed));
+  write_histogram(out, &m->queue_wait);
+  fprintf(out, ",\"commands\":{");
+  for (int i = 0; i < METRICS_OPS; i++) {
+    struct command_metrics* c = &m->commands[i];
+    fprintf(out, "%s\"%s\":{\"errors\":%llu,\"latency\":", i ? "," : "",
+            op_names[i],
+            (unsigned long long)atomic_load_explicit(&c->errors,
+                                                     memory_order_relaxed));
+    write_histogram(out, &c->latency);
+    fprintf(out, "}");
+  }
+  fprintf(out, "}");
+}
+
+/*Thread that answers connections to the socket*/
+static void* answer(void* arg) {
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (atomic_load(&stop)) {
+      if (fd >= 0) close(fd);
+      break;
+    }
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("Could not accept metrics connection");
+      break;
+    }
+    FILE* out = fdopen(fd, "w");
+    if (out == NULL) {
+      close(fd);
+      continue;
+    }
+    write_snapshot(out, snapshot_arg);
+    fclose(out);
+  }
+  return NULL;
+}
+
+int metrics_listen(const char* path, void (*snapshot)(FILE* out, void* arg),
+                   void* arg) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) return -1;
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 16) < 0)
+    goto fail;
+  if ((socket_path = strdup(path)) == NULL) goto fail;
+  write_snapshot = snapshot;
+  snapshot_arg = arg;
+  atomic_store(&stop, 0);
+  if (pthread_create(&listener, NULL, answer, NULL) != 0) {
+    free(socket_path);
+    goto fail;
+  }
+  return 0;
+fail:
+  close(listen_fd);
+  listen_fd = -1;
+  return -1;
+}
+
+void metrics_close(void) {
+  if (listen_fd < 0) return;
+  atomic_store(&stop, 1);
+  /*Wakes the thread up from accept*/
+  shutdown(listen_fd, SHUT_RDWR);
+  pthread_join(listener, NULL);
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(socket_path);
+  free(socket_path);
+}
@@ -0,0 +1,149 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/**
+ * @file metrics.h
+ * @brief Latency histograms and counters of the desks
+ *
+ * Every desk has its own struct desk_metrics and is the only thread that
+ * writes it, so recording a command is a few plain loads and stores without
+ * a lock or an atomic read-modify-write. Other threads read the counters
+ * with relaxed loads whenever they like, a snapshot may be a few commands
+ * behind.
+ *
+ * A histogram counts nanoseconds in buckets like an HDR histogram: values
+ * below METRICS_SUB_BUCKETS get a bucket each, larger ones are split into
+ * METRICS_SUB_BUCKETS buckets per power of two, so a bucket is never more
+ * than 1/16 of its values wide. Values of 2^METRICS_MAX_BITS ns, about a
+ * minute, and above count in the last bucket.
+ *
+ * Snapshots are written as JSON, and can be fetched from a Unix socket that
+ * answers every connection with one snapshot.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "protocol.h"
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS \
+  ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+/*Commands are counted per opcode, the last entry counts unknown ones*/
+#define METRICS_OPS 7
+
+struct histogram {
+  atomic_ullong count;
+  atomic_ullong sum_ns;
+  atomic_ullong max_ns;
+  atomic_ullong buckets[METRICS_BUCKETS];
+};
+
+struct command_metrics {
+  /*Time from reading the command, or finishing the previous one in the
+  same read, until its reply is ready*/
+  struct histogram latency;
+  /*Commands that did not succeed*/
+  atomic_ullong errors;
+};
+
+struct desk_metrics {
+  _Alignas(CACHE_LINE) struct command_metrics commands[METRICS_OPS];
+  /*Time clients waited in the queue before the desk took them*/
+  struct histogram queue_wait;
+  /*Times the desk found an account lock taken or had to retry a
+  compare-and-swap on a balance*/
+  atomic_ullong lock_waits;
+};
+
+/*Add n to a counter only the calling thread writes*/
+static inline void metrics_add(atomic_ullong* c, uint64_t n) {
+  atomic_store_explicit(
+      c, atomic_load_explicit(c, memory_order_relaxed) + n,
+      memory_order_relaxed);
+}
+
+static inline int metrics_bucket(uint64_t ns) {
+  if (ns < METRICS_SUB_BUCKETS) return ns;
+  int bits = 63 - __builtin_clzll(ns);
+  if (bits >= METRICS_MAX_BITS) return METRICS_BUCKETS - 1;
+  return (bits - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+         ((ns >> (bits - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+}
+
+static inline void histogram_record(struct histogram* h, uint64_t ns) {
+  metrics_add(&h->count, 1);
+  metrics_add(&h->sum_ns, ns);
+  if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed))
+    atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+  metrics_add(&h->buckets[metrics_bucket(ns)], 1);
+}
+
+/*Entry of the commands array for op*/
+static inline int metrics_op(uint8_t op) {
+  switch (op) {
+    case OP_LIST:
+      return 0;
+    case OP_WITHDRAW:
+      return 1;
+    case OP_DEPOSIT:
+      return 2;
+    case OP_TRANSFER:
+      return 3;
+    case OP_TRANSACT:
+      return 4;
+    case OP_OPEN:
+      return 5;
+    default:
+      return METRICS_OPS - 1;
+  }
+}
+
+/*Count a command that took ns and ended with status*/
+static inline void metrics_command(struct desk_metrics* m, uint8_t op,
+                                   enum proto_status status, uint64_t ns) {
+  struct command_metrics* c = &m->commands[metrics_op(op)];
+  histogram_record(&c->latency, ns);
+  if (status != ST_OK) metrics_add(&c->errors, 1);
+}
+
+/**
+ * @brief Allocate zeroed metrics for n desks, each on its own cache lines
+ *
+ * @return the metrics, free them with free(), NULL if there is not enough
+ * memory
+ */
+struct desk_metrics* metrics_create(int n);
+
+/**
+ * @brief Write the counters and histograms of a desk as the members of a
+ * JSON object, without the braces
+ */
+void metrics_write_desk(FILE* out, struct desk_metrics* m);
+
+/**
+ * @brief Listen on a Unix socket and answer every connection with a
+ * snapshot
+ *
+ * @param path of the socket, an old one is removed
+ * @param snapshot called from the thread of the socket to write a snapshot
+ * @param arg passed to snapshot
+ * @return 0 on success, -1 on failure
+ */
+int metrics_listen(const char* path, void (*snapshot)(FILE* out, void* arg),
+                   void* arg);
+
+/**
+ * @brief Stop answering and remove the socket
+ */
+void metrics_close(void);
+
+#endif  // __METRICS_H__
@@ -0,0 +1,252 @@
+#include "protocol.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void put_u16(unsigned char* p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint16_t get_u16(const unsigned char* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+/*Parse the legs of a text transaction, at least one and at most
+PROTO_MAX_LEGS*/
+static int parse_legs(const char* p, struct request* req) {
+  long long accno;
+  int amount;
+  int used;
+
+  while (sscanf(p, " %lld %d%n", &accno, &amount, &used) == 2) {
+    if (req->nlegs == PROTO_MAX_LEGS) return -1;
+    /*Negative numbers become account numbers nobody has*/
+    req->legs[req->nlegs].account = (uint64_t)(int64_t)accno;
+    req->legs[req->nlegs].amount = amount;
+    req->nlegs++;
+    p += used;
+  }
+  /*Anything left over that is not whitespace is an error*/
+  while (*p == ' ' || *p == '\n') p++;
+  return req->nlegs > 0 && *p == '\0' ? 0 : -1;
+}
+
+int parse_text_request(const char* line, struct request* req) {
+  long long accno1 = -1;
+  long long accno2 = -1;
+  int amount = 0;
+  int ok;
+
+  memset(req, 0, sizeof(*req));
+  req->op = line[0];
+  switch (line[0]) {
+    case 'q':
+      return 0;
+    case 'l':
+      ok = sscanf(line, "l %lld", &accno1) == 1;
+      break;
+    case 'w':
+      ok = sscanf(line, "w %lld %d", &accno1, &amount) == 2;
+      break;
+    case 'd':
+      ok = sscanf(line, "d %lld %d", &accno1, &amount) == 2;
+      break;
+    case 't':
+      ok = sscanf(line, "t %lld %lld %d", &accno1, &accno2, &amount) == 3;
+      break;
+    case 'o':
+      ok = sscanf(line, "o %lld", &accno1) == 1;
+      break;
+    case 'x':
+      return parse_legs(line + 1, req);
+    default:
+      req->op = 0;
+      return -2;
+  }
+  if (!ok) return -1;
+  /*Negative numbers become account numbers nobody has*/
+  req->acc1 = (uint64_t)(int64_t)accno1;
+  req->acc2 = (uint64_t)(int64_t)accno2;
+  req->amount = amount;
+  return 0;
+}
+
+int format_text_request(const struct request* req, char* out, size_t size) {
+  long long acc1 = (long long)req->acc1;
+  long long acc2 = (long long)req->acc2;
+  long long amount = req->amount;
+  switch (req->op) {
+    case OP_LIST:
+    case OP_OPEN:
+      return snprintf(out, size, "%c %lld\n", req->op, acc1);
+    case OP_WITHDRAW:
+    case OP_DEPOSIT:
+      return snprintf(out, size, "%c %lld %lld\n", req->op, acc1, amount);
+    case OP_TRANSFER:
+      return snprintf(out, size, "t %lld %lld %lld\n", acc1, acc2, amount);
+    case OP_TRANSACT: {
+      /*Stop writing once out is full but keep counting, as snprintf*/
+      size_t len = snprintf(out, size, "x");
+      for (int i = 0; i < req->nlegs; i++)
+        len += snprintf(len < size ? out + len : NULL,
+                        len < size ? size - len : 0, " %lld %lld",
+                        (long long)req->legs[i].account,
+                        (long long)req->legs[i].amount);
+      return len + snprintf(len < size ? out + len : NULL,
+                            len < size ? size - len : 0, "\n");
+    }
+    default:
+      return snprintf(out, size, "%c\n", req->op);
+  }
+}
+
+int format_text_response(const struct request* req,
+                         const struct response* resp, char* out,
+                         size_t size) {
+  long long acc1 = (long long)req->acc1;
+  long long acc2 = (long long)req->acc2;
+  long long amount = req->amount;
+  long long value = resp->value;
+
+  switch (resp->status) {
+    case ST_BAD_REQUEST:
+      return snprintf(out, size, "fail: Error in command%s",
+                      req->op == OP_LIST ? "\n" : "");
+    case ST_EXISTS:
+      return snprintf(out, size, "Account %lld already exists", acc1);
+    case ST_FULL:
+      return snprintf(out, size, "fail: No room for more accounts");
+    case ST_UNKNOWN:
+      return snprintf(out, size, "fail: Unknown command");
+    case ST_BAD_AMOUNT:
+      return snprintf(out, size, "fail: Amount out of range");
+    case ST_NO_ACCOUNT:
+      if (req->op == OP_TRANSFER)
+        return snprintf(out, size,
+                        "No account with that number in record or the "
+                        "account numbers belonged to the same account");
+      return snprintf(out, size, "No account with that number in record");
+    case ST_INSUFFICIENT:
+      if (req->op == OP_TRANSACT)
+        return snprintf(out, size,
+                        "Current balance %lld of account %lld is not "
+                        "sufficient for transaction",
+                        value, (long long)resp->account);
+      if (req->op == OP_TRANSFER)
+        return snprintf(out, size,
+                        "Current balance %lld of account %lld is not "
+                        "sufficient for transfer",
+                        value, acc1);
+      return snprintf(out, size,
+                      "Current balance %lld is not sufficient for withdrawal",
+                      value);
+    default:
+      break;
+  }
+  switch (req->op) {
+    case OP_LIST:
+      return snprintf(out, size, "%lld", value);
+    case OP_WITHDRAW:
+      return snprintf(out, size,
+                      "Withdrew %lld from account %lld, remaining balance "
+                      "%lld",
+                      amount, acc1, value);
+    case OP_DEPOSIT:
+      return snprintf(out, size,
+                      "Deposited %lld to account %lld, new balance %lld",
+                      amount, acc1, value);
+    case OP_TRANSFER:
+      return snprintf(out, size,
+                      "Transferred %lld from account %lld to account %lld",
+                      amount, acc1, acc2);
+    case OP_TRANSACT:
+      return snprintf(out, size, "Transaction of %d legs done", req->nlegs);
+    case OP_OPEN:
+      return snprintf(out, size, "Opened account %lld", acc1);
+    default:
+      return snprintf(out, size, "ok");
+  }
+}
+
+size_t encode_request(const struct request* req, unsigned char* buf) {
+  uint16_t body_len = req->body_len;
+  if (req->op == OP_TRANSACT) body_len = req->nlegs * LEG_SIZE;
+  buf[0] = req->op;
+  buf[1] = req->flags;
+  put_u16(buf + 2, body_len);
+  memset(buf + 4, 0, 4);
+  put_u64(buf + 8, req->acc1);
+  put_u64(buf + 16, req->acc2);
+  put_u64(buf + 24, (uint64_t)req->amount);
+  if (req->op == OP_TRANSACT) {
+    for (int i = 0; i < req->nlegs; i++) {
+      unsigned char* p = buf + REQ_HEADER_SIZE + i * LEG_SIZE;
+      put_u64(p, req->legs[i].account);
+      put_u64(p + 8, (uint64_t)req->legs[i].amount);
+    }
+  } else if (body_len > 0) {
+    memcpy(buf + REQ_HEADER_SIZE, req->body, body_len);
+  }
+  return REQ_HEADER_SIZE + body_len;
+}
+
+ssize_t decode_request(const unsigned char* buf, size_t len,
+                       struct request* req) {
+  if (len < REQ_HEADER_SIZE) return 0;
+  req->op = buf[0];
+  req->flags = buf[1];
+  req->body_len = get_u16(buf + 2);
+  if (req->body_len > MAX_BODY_SIZE) return -1;
+  if (len < (size_t)REQ_HEADER_SIZE + req->body_len) return 0;
+  req->acc1 = get_u64(buf + 8);
+  req->acc2 = get_u64(buf + 16);
+  req->amount = (int64_t)get_u64(buf + 24);
+  req->body = buf + REQ_HEADER_SIZE;
+  req->nlegs = 0;
+  if (req->op == OP_TRANSACT && req->body_len % LEG_SIZE == 0 &&
+      req->body_len / LEG_SIZE <= PROTO_MAX_LEGS) {
+    req->nlegs = req->body_len / LEG_SIZE;
+    for (int i = 0; i < req->nlegs; i++) {
+      req->legs[i].account = get_u64(req->body + i * LEG_SIZE);
+      req->legs[i].amount = (int64_t)get_u64(req->body + i * LEG_SIZE + 8);
+    }
+  }
+  return REQ_HEADER_SIZE + req->body_len;
+}
+
+size_t encode_response(const struct response* resp, unsigned char* buf) {
+  buf[0] = resp->op;
+  buf[1] = resp->status;
+  put_u16(buf + 2, resp->body_len);
+  if (resp->body_len >= 8) put_u64(buf + RESP_HEADER_SIZE, resp->value);
+  if (resp->body_len >= 16) put_u64(buf + RESP_HEADER_SIZE + 8, resp->account);
+  return RESP_HEADER_SIZE + resp->body_len;
+}
+
+ssize_t decode_response(const unsigned char* buf, size_t len,
+                        struct response* resp) {
+  if (len < RESP_HEADER_SIZE) return 0;
+  resp->op = buf[0];
+  resp->status = buf[1];
+  resp->body_len = get_u16(buf + 2);
+  if (resp->body_len > MAX_BODY_SIZE) return -1;
+  if (len < (size_t)RESP_HEADER_SIZE + resp->body_len) return 0;
+  resp->value = 0;
+  resp->account = 0;
+  if (resp->body_len >= 8)
+    resp->value = (int64_t)get_u64(buf + RESP_HEADER_SIZE);
+  if (resp->body_len >= 16)
+    resp->account = get_u64(buf + RESP_HEADER_SIZE + 8);
+  return RESP_HEADER_SIZE + resp->body_len;
+}
@@ -0,0 +1,202 @@
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+/**
+ * @file protocol.h
+ * @brief Requests and responses exchanged between connection and server
+ *
+ * A request or response exists in two encodings. The text encoding is what
+ * a user types ("w 1 123") and reads back. The binary encoding is a fixed
+ * little-endian header followed by an optional body:
+ *
+ * request:  op u8 | flags u8 | body_len u16 | reserved u32 |
+ *           acc1 u64 | acc2 u64 | amount i64 | body
+ * response: op u8 | status u8 | body_len u16 | body
+ *
+ * The body of a transaction request is its legs, account u64 | amount i64
+ * each, a positive amount is paid into the account and a negative one taken
+ * from it. The response body of every current command is the resulting
+ * balance as an i64, a transaction adds the account u64 it belongs to.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*Size of the fixed part of a binary request and response*/
+#define REQ_HEADER_SIZE 32
+#define RESP_HEADER_SIZE 4
+
+/*Largest body accepted in either direction*/
+#define MAX_BODY_SIZE 4096
+
+/*Most accounts a transaction may touch, and the size of one in a binary
+request*/
+#define PROTO_MAX_LEGS 16
+#define LEG_SIZE 16
+/*Largest binary request the client sends*/
+#define MAX_REQUEST_SIZE (REQ_HEADER_SIZE + PROTO_MAX_LEGS * LEG_SIZE)
+
+/*Protocol a client asked for when connecting*/
+enum proto_mode { PROTO_TEXT, PROTO_BINARY };
+
+/*What the server answers to a connection, the client falls back to text
+if the server does not know the binary protocol*/
+#define READY_TEXT "ready\n"
+#define READY_BINARY "ready b\n"
+
+/*Unix socket in the directory of the server that clients can connect to
+instead of passing pipes through the message queue. A client sends
+HELLO_TEXT or HELLO_BINARY as its first byte and is answered with a ready
+message, then commands go over the socket both ways.*/
+#define BANK_SOCKET "bank.sock"
+#define HELLO_TEXT 't'
+#define HELLO_BINARY 'b'
+
+/*A client of the socket that passes a shared memory channel along with its
+first byte is answered with one of these if the server takes the channel,
+then commands go through the channel instead of the socket*/
+#define READY_SHM_TEXT "ready s\n"
+#define READY_SHM_BINARY "ready b s\n"
+
+/*Opcodes use the same letters as the text commands*/
+enum proto_op {
+  OP_LIST = 'l',
+  OP_WITHDRAW = 'w',
+  OP_DEPOSIT = 'd',
+  OP_TRANSFER = 't',
+  OP_TRANSACT = 'x',
+  OP_OPEN = 'o',
+  OP_QUIT = 'q'
+};
+
+enum proto_status {
+  ST_OK = 0,
+  /*Account number out of range*/
+  ST_NO_ACCOUNT = 1,
+  /*Balance too low for a withdrawal or transfer*/
+  ST_INSUFFICIENT = 2,
+  /*Malformed command*/
+  ST_BAD_REQUEST = 3,
+  /*Amount does not fit an account balance*/
+  ST_BAD_AMOUNT = 4,
+  /*Unknown opcode*/
+  ST_UNKNOWN = 5,
+  /*Account to open is already open*/
+  ST_EXISTS = 6,
+  /*No room for another account*/
+  ST_FULL = 7
+};
+
+/*Amount paid into (positive) or taken from (negative) one account as part
+of a transaction*/
+struct leg {
+  uint64_t account;
+  int64_t amount;
+};
+
+/*Decoded request, a transaction has its legs in legs and none is nlegs 0*/
+struct request {
+  uint8_t op;
+  uint8_t flags;
+  uint16_t body_len;
+  uint64_t acc1;
+  uint64_t acc2;
+  int64_t amount;
+  const unsigned char* body;
+  int nlegs;
+  struct leg legs[PROTO_MAX_LEGS];
+};
+
+/*Decoded response, value is the balance the command reports and account
+the account of a transaction it belongs to*/
+struct response {
+  uint8_t op;
+  uint8_t status;
+  uint16_t body_len;
+  int64_t value;
+  uint64_t account;
+};
+
+/**
+ * @brief Parse a text command such as "t 1 2 100"
+ *
+ * A transaction is "x" followed by the account and amount of every leg,
+ * "x 1 -100 2 60 3 40" takes 100 from account 1 and pays it to 2 and 3.
+ *
+ * @param line
+ * @param req
+ * @return 0 on success, -1 if the command is malformed (req->op is still
+ * set when the command letter was recognized), -2 if it is unknown
+ */
+int parse_text_request(const char* line, struct request* req);
+
+/**
+ * @brief Write the text form of a request, as parse_text_request reads it
+ *
+ * @param req
+ * @param out
+ * @param size
+ * @return number of characters written, as snprintf
+ */
+int format_text_request(const struct request* req, char* out, size_t size);
+
+/**
+ * @brief Write the text a user sees for the response to a request
+ *
+ * @param req
+ * @param resp
+ * @param out
+ * @param size
+ * @return number of characters written, as snprintf
+ */
+int format_text_response(const struct request* req,
+                         const struct response* resp, char* out, size_t size);
+
+/**
+ * @brief Encode a binary request
+ *
+ * The body of a transaction is made from its legs.
+ *
+ * @param req
+ * @param buf at least REQ_HEADER_SIZE + req->body_len bytes, or
+ * MAX_REQUEST_SIZE for a transaction
+ * @return number of bytes written
+ */
+size_t encode_request(const struct request* req, unsigned char* buf);
+
+/**
+ * @brief Decode one binary request from the start of buf
+ *
+ * @param buf
+ * @param len bytes available in buf
+ * @param req body points into buf, the legs of a transaction whose body is
+ * not a whole number of legs up to PROTO_MAX_LEGS are left out
+ * @return bytes consumed, 0 if buf does not yet hold a whole request, -1 if
+ * the request is invalid
+ */
+ssize_t decode_request(const unsigned char* buf, size_t len,
+                       struct request* req);
+
+/**
+ * @brief Encode a binary response
+ *
+ * @param resp
+ * @param buf at least RESP_HEADER_SIZE + resp->body_len bytes
+ * @return number of bytes written
+ */
+size_t encode_response(const struct response* resp, unsigned char* buf);
+
+/**
+ * @brief Decode one binary response from the start of buf
+ *
+ * @param buf
+ * @param len bytes available in buf
+ * @param resp
+ * @return bytes consumed, 0 if buf does not yet hold a whole response, -1
+ * if the response is invalid
+ */
+ssize_t decode_response(const unsigned char* buf, size_t len,
+                        struct response* resp);
+
+#endif  // __PROTOCOL_H__
@@ -1,47 +1,408 @@
 #include "queue.h"
 
+#include <stdint.h>
+#include <unistd.h>
+
+struct Ring* createRing(size_t min_capacity) {
+  size_t capacity = 1;
+  while (capacity < min_capacity) capacity <<= 1;
+
+  /*aligned_alloc wants a multiple of the alignment, the cells already are*/
+  size_t bytes = sizeof(struct Ring) + capacity * sizeof(struct RingCell);
+  struct Ring* ring = aligned_alloc(CACHE_LINE, bytes);
+  if (ring == NULL) return NULL;
+
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  ring->mask = capacity - 1;
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&ring->cells[i].seq, i);
+  }
+  return ring;
+}
+
+bool ringPush(struct Ring* ring, const struct ConnDesc* c) {
+  struct RingCell* cell;
+  size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  for (;;) {
+    cell = &ring->cells[pos & ring->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      /*Slot is free for this lap, try to claim it*/
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      /*Slot still holds the element from the previous lap*/
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+  cell->data = *c;
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+bool ringPop(struct Ring* ring, struct ConnDesc* out) {
+  struct RingCell* cell;
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  for (;;) {
+    cell = &ring->cells[pos & ring->mask];
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      /*Nothing has been published to this slot yet*/
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+  *out = cell->data;
+  /*Hand the slot to the producer of the next lap*/
+  atomic_store_explicit(&cell->seq, pos + ring->mask + 1,
+                        memory_order_release);
+  return true;
+}
+
+size_t ringSize(struct Ring* ring) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  /*The counters are read separately and may be momentarily inconsistent*/
+  if (head <= tail) return 0;
+  if (head - tail > ring->mask + 1) return ring->mask + 1;
+  return head - tail;
+}
+
+size_t ringCapacity(struct Ring* ring) { return ring->mask + 1; }
+
+void destroyRing(struct Ring* ring) { free(ring); }
+
 struct Queue createQueue() {
   struct Queue queue;
-  queue.q = (char**)malloc(SIZE * sizeof(char*));
-  for (int i = 0; i < SIZE; i++) {
-    queue.q[i] = malloc(100);
-  }
-  queue.size = 0;
-  queue.front = 0;
-  queue.rear = -1;
+  queue.ring = createRing(SIZE);
+  queue.last = malloc(ITEM_SIZE);
   queue.serving_cust = false;
   return queue;
 }
 
-char* peek(struct Queue queue) { return queue.q[queue.front]; }
+char* peek(struct Queue queue) {
+  size_t tail = atomic_load_explicit(&queue.ring->tail, memory_order_relaxed);
+  return queue.ring->cells[tail & queue.ring->mask].data.path;
+}
 
-bool isEmpty(struct Queue queue) { return queue.size == 0; }
+bool isEmpty(struct Queue queue) { return ringSize(queue.ring) == 0; }
 
-bool isFull(struct Queue queue) { return queue.size == SIZE; }
+bool isFull(struct Queue queue) {
+  return ringSize(queue.ring) == ringCapacity(queue.ring);
+}
+
+int queueSize(struct Queue queue) { return (int)ringSize(queue.ring); }
 
 bool insert(struct Queue* queue, char* c) {
-  if (!isFull(*queue)) {
-    if (queue->rear == SIZE - 1) {
-      queue->rear = -1;
+  struct ConnDesc desc;
+  desc.fd = -1;
+  strncpy(desc.path, c, ITEM_SIZE - 1);
+  desc.path[ITEM_SIZE - 1] = '\0';
+  return ringPush(queue->ring, &desc);
+}
+
+char* removeData(struct Queue* queue) {
+  struct ConnDesc desc;
+  if (ringPop(queue->ring, &desc)) {
+    memcpy(queue->last, desc.path, ITEM_SIZE);
+    queue->serving_cust = true;
+    return queue->last;
+  }
+  queue->serving_cust = false;
+  return NULL;
+}
+
+void destroyQueue(struct Queue* queue) {
+  destroyRing(queue->ring);
+  free(queue->last);
+}
+
+int createBlockingQueue(struct BlockingQueue* bq, size_t capacity) {
+  if ((bq->ring = createRing(capacity)) == NULL) return -1;
+  atomic_init(&bq->sleepers, 0);
+  atomic_init(&bq->interrupts, 0);
+  atomic_init(&bq->shutdown, false);
+  atomic_init(&bq->serving, false);
+  if (pthread_mutex_init(&bq->lock, NULL) != 0) {
+    destroyRing(bq->ring);
+    return -1;
+  }
+  if (pthread_cond_init(&bq->not_empty, NULL) != 0) {
+    pthread_mutex_destroy(&bq->lock);
+    destroyRing(bq->ring);
+    return -1;
+  }
+  return 0;
+}
+
+/*Wake one sleeping consumer. Sleepers register themselves under the lock
+before their final emptiness check, so after the fence either they see our
+element or we see them.*/
+static void wakeOne(struct BlockingQueue* bq) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&bq->sleepers) > 0) {
+    pthread_mutex_lock(&bq->lock);
+    pthread_cond_signal(&bq->not_empty);
+    pthread_mutex_unlock(&bq->lock);
+  }
+}
+
+bool blockingInsert(struct BlockingQueue* bq, const struct ConnDesc* c) {
+  if (atomic_load(&bq->shutdown)) return false;
+  if (!ringPush(bq->ring, c)) return false;
+  /*One element can only be served by one consumer*/
+  wakeOne(bq);
+  return true;
+}
+
+/*Consume one pending interrupt if there is one*/
+static bool takeInterrupt(atomic_int* interrupts) {
+  int pending = atomic_load(interrupts);
+  while (pending > 0) {
+    if (atomic_compare_exchange_weak(interrupts, &pending, pending - 1))
+      return true;
+  }
+  return false;
+}
+
+enum queue_status blockingRemove(struct BlockingQueue* bq,
+                                 struct ConnDesc* out) {
+  atomic_store(&bq->serving, false);
+  for (;;) {
+    if (atomic_load(&bq->shutdown)) return QUEUE_SHUTDOWN;
+    if (takeInterrupt(&bq->interrupts)) return QUEUE_INTERRUPTED;
+    if (ringPop(bq->ring, out)) {
+      atomic_store(&bq->serving, true);
+      return QUEUE_ITEM;
+    }
+    pthread_mutex_lock(&bq->lock);
+    atomic_fetch_add(&bq->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!atomic_load(&bq->shutdown) && atomic_load(&bq->interrupts) == 0 &&
+           ringSize(bq->ring) == 0) {
+      pthread_cond_wait(&bq->not_empty, &bq->lock);
+    }
+    atomic_fetch_sub(&bq->sleepers, 1);
+    pthread_mutex_unlock(&bq->lock);
+  }
+}
+
+void interruptQueue(struct BlockingQueue* bq) {
+  atomic_fetch_add(&bq->interrupts, 1);
+  wakeOne(bq);
+}
+
+void shutdownQueue(struct BlockingQueue* bq) {
+  atomic_store(&bq->shutdown, true);
+  pthread_mutex_lock(&bq->lock);
+  pthread_cond_broadcast(&bq->not_empty);
+  pthread_mutex_unlock(&bq->lock);
+}
+
+int blockingSize(struct BlockingQueue* bq) {
+  return (int)ringSize(bq->ring);
+}
+
+bool blockingServing(struct BlockingQueue* bq) {
+  return atomic_load(&bq->serving);
+}
+
+void destroyBlockingQueue(struct BlockingQueue* bq) {
+  destroyRing(bq->ring);
+  pthread_cond_destroy(&bq->not_empty);
+  pthread_mutex_destroy(&bq->lock);
+}
+
+int createWorkQueues(struct WorkQueues* wq, int count, size_t capacity) {
+  int i;
+  wq->count = count;
+  wq->rings = aligned_alloc(CACHE_LINE, sizeof(struct WorkRing) * count);
+  if (wq->rings == NULL) return -1;
+  for (i = 0; i < count; i++) {
+    struct WorkRing* wr = &wq->rings[i];
+    if ((wr->ring = createRing(capacity)) == NULL) goto err;
+    if (pthread_cond_init(&wr->wake, NULL) != 0) {
+      destroyRing(wr->ring);
+      goto err;
+    }
+    wr->sleeping = false;
+    atomic_init(&wr->notify_fd, -1);
+    atomic_init(&wr->interrupts, 0);
+    atomic_init(&wr->serving, false);
+  }
+  atomic_init(&wq->sleepers, 0);
+  atomic_init(&wq->shutdown, false);
+  if (pthread_mutex_init(&wq->lock, NULL) == 0) return 0;
+
+err:
+  /*Free the rings created before the one that failed*/
+  while (i-- > 0) {
+    destroyRing(wq->rings[i].ring);
+    pthread_cond_destroy(&wq->rings[i].wake);
+  }
+  free(wq->rings);
+  wq->rings = NULL;
+  return -1;
+}
+
+/*Wake consumer idx if it sleeps, otherwise any sleeping consumer. Called
+with the lock held. The woken consumer is marked awake right away so the
+next wakeup goes to someone else.*/
+static void wakeConsumer(struct WorkQueues* wq, int idx) {
+  if (!wq->rings[idx].sleeping) {
+    for (int i = 1; i < wq->count; i++) {
+      int j = (idx + i) % wq->count;
+      if (wq->rings[j].sleeping) {
+        idx = j;
+        break;
+      }
+    }
+  }
+  if (wq->rings[idx].sleeping) {
+    wq->rings[idx].sleeping = false;
+    pthread_cond_signal(&wq->rings[idx].wake);
+  }
+}
+
+/*Tell a consumer waiting in epoll that it has something to do*/
+static void notifyConsumer(struct WorkRing* wr) {
+  int fd = atomic_load(&wr->notify_fd);
+  if (fd >= 0) {
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+  }
+}
+
+bool workInsert(struct WorkQueues* wq, int idx, const struct ConnDesc* c) {
+  if (atomic_load(&wq->shutdown)) return false;
+  if (!ringPush(wq->rings[idx].ring, c)) return false;
+  notifyConsumer(&wq->rings[idx]);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&wq->sleepers) > 0) {
+    pthread_mutex_lock(&wq->lock);
+    wakeConsumer(wq, idx);
+    pthread_mutex_unlock(&wq->lock);
+  }
+  return true;
+}
+
+/*Take the oldest element of the longest ring other than idx*/
+static bool steal(struct WorkQueues* wq, int idx, struct ConnDesc* out) {
+  for (;;) {
+    int victim = -1;
+    size_t longest = 0;
+    for (int i = 1; i < wq->count; i++) {
+      int j = (idx + i) % wq->count;
+      size_t size = ringSize(wq->rings[j].ring);
+      if (size > longest) {
+        longest = size;
+        victim = j;
+      }
     }
-    strcpy(queue->q[++queue->rear], c);
-    queue->size++;
-    return true;
+    if (victim < 0) return false;
+    if (ringPop(wq->rings[victim].ring, out)) return true;
+    /*Lost the race for the element, look again*/
+  }
+}
+
+static bool anyWork(struct WorkQueues* wq) {
+  for (int i = 0; i < wq->count; i++) {
+    if (ringSize(wq->rings[i].ring) > 0) return true;
   }
   return false;
 }
 
-char* removeData(struct Queue* queue) {
-  if (queue->size > 0) {
-    char* c = queue->q[queue->front++];
-    if (queue->front == SIZE) {
-      queue->front = 0;
+enum queue_status workRemove(struct WorkQueues* wq, int idx,
+                             struct ConnDesc* out, bool* stolen) {
+  struct WorkRing* wr = &wq->rings[idx];
+  atomic_store(&wr->serving, false);
+  for (;;) {
+    if (atomic_load(&wq->shutdown)) return QUEUE_SHUTDOWN;
+    if (takeInterrupt(&wr->interrupts)) return QUEUE_INTERRUPTED;
+    if (ringPop(wr->ring, out)) {
+      *stolen = false;
+      atomic_store(&wr->serving, true);
+      return QUEUE_ITEM;
     }
+    if (steal(wq, idx, out)) {
+      *stolen = true;
+      atomic_store(&wr->serving, true);
+      return QUEUE_ITEM;
+    }
+    pthread_mutex_lock(&wq->lock);
+    atomic_fetch_add(&wq->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    wr->sleeping = true;
+    while (wr->sleeping && !atomic_load(&wq->shutdown) &&
+           atomic_load(&wr->interrupts) == 0 && !anyWork(wq)) {
+      pthread_cond_wait(&wr->wake, &wq->lock);
+    }
+    wr->sleeping = false;
+    atomic_fetch_sub(&wq->sleepers, 1);
+    pthread_mutex_unlock(&wq->lock);
+  }
+}
 
-    queue->size--;
-    queue->serving_cust = true;
-    return c;
+enum queue_status workTryRemove(struct WorkQueues* wq, int idx,
+                                struct ConnDesc* out) {
+  struct WorkRing* wr = &wq->rings[idx];
+  if (atomic_load(&wq->shutdown)) return QUEUE_SHUTDOWN;
+  if (takeInterrupt(&wr->interrupts)) return QUEUE_INTERRUPTED;
+  if (ringPop(wr->ring, out)) return QUEUE_ITEM;
+  return QUEUE_EMPTY;
+}
+
+void workSetNotify(struct WorkQueues* wq, int idx, int fd) {
+  atomic_store(&wq->rings[idx].notify_fd, fd);
+}
+
+void workInterrupt(struct WorkQueues* wq, int idx) {
+  atomic_fetch_add(&wq->rings[idx].interrupts, 1);
+  notifyConsumer(&wq->rings[idx]);
+  pthread_mutex_lock(&wq->lock);
+  if (wq->rings[idx].sleeping) {
+    wq->rings[idx].sleeping = false;
+    pthread_cond_signal(&wq->rings[idx].wake);
   }
-  queue->serving_cust = false;
-  return NULL;
-}
\ No newline at end of file
+  pthread_mutex_unlock(&wq->lock);
+}
+
+void workShutdown(struct WorkQueues* wq) {
+  atomic_store(&wq->shutdown, true);
+  pthread_mutex_lock(&wq->lock);
+  for (int i = 0; i < wq->count; i++) {
+    pthread_cond_signal(&wq->rings[i].wake);
+    notifyConsumer(&wq->rings[i]);
+  }
+  pthread_mutex_unlock(&wq->lock);
+}
+
+int workSize(struct WorkQueues* wq, int idx) {
+  return (int)ringSize(wq->rings[idx].ring);
+}
+
+bool workServing(struct WorkQueues* wq, int idx) {
+  return atomic_load(&wq->rings[idx].serving);
+}
+
+void destroyWorkQueues(struct WorkQueues* wq) {
+  for (int i = 0; i < wq->count; i++) {
+    destroyRing(wq->rings[i].ring);
+    pthread_cond_destroy(&wq->rings[i].wake);
+  }
+  free(wq->rings);
+  pthread_mutex_destroy(&wq->lock);
+}
@@ -5,7 +5,7 @@
  * @file queue.h
  * @author David Enberg david.enberg@aalto.fi
  * @brief Quick implementation of a queue structure
- * @version 0.1
+ * @version 0.2
  * @date 2022-11-24
  *
  * @copyright Copyright (c) 2022
@@ -13,23 +13,106 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define SIZE 100
 
+#define ITEM_SIZE 100
+
+#define CACHE_LINE 64
+
+/*Fixed-size description of a client waiting to be served*/
+typedef struct ConnDesc {
+  char path[ITEM_SIZE];
+  /*Connected socket of the client, -1 for a client whose pipes are in path*/
+  int fd;
+  long long enqueued_ns;
+} ConnDesc;
+
+/*Slot of the ring, the sequence number tells who may use it next*/
+struct RingCell {
+  _Alignas(CACHE_LINE) atomic_size_t seq;
+  struct ConnDesc data;
+};
+
+/*Bounded lock-free multi-producer/multi-consumer ring. Producers and
+consumers claim slots with a compare-and-swap on their own counter and
+hand them over through the per-slot sequence number. The struct and its
+slots are one cache-aligned allocation.*/
+typedef struct Ring {
+  _Alignas(CACHE_LINE) atomic_size_t head;
+  _Alignas(CACHE_LINE) atomic_size_t tail;
+  _Alignas(CACHE_LINE) size_t mask;
+  struct RingCell cells[];
+} Ring;
+
+/**
+ * @brief Create a ring that can hold at least min_capacity elements
+ *
+ * @param min_capacity rounded up to the next power of two
+ * @return struct Ring* or NULL if allocation failed
+ */
+struct Ring* createRing(size_t min_capacity);
+
+/**
+ * @brief Copy an element into the ring
+ *
+ * @param ring
+ * @param c
+ * @return true if insertion was successful
+ * @return false if the ring was full
+ */
+bool ringPush(struct Ring* ring, const struct ConnDesc* c);
+
+/**
+ * @brief Copy the oldest element out of the ring
+ *
+ * @param ring
+ * @param out
+ * @return true if an element was removed
+ * @return false if the ring was empty
+ */
+bool ringPop(struct Ring* ring, struct ConnDesc* out);
+
+/**
+ * @brief Number of elements in the ring, exact only when no other thread
+ * is using it
+ *
+ * @param ring
+ * @return size_t
+ */
+size_t ringSize(struct Ring* ring);
+
+/**
+ * @brief Number of elements the ring can hold
+ *
+ * @param ring
+ * @return size_t
+ */
+size_t ringCapacity(struct Ring* ring);
+
+/**
+ * @brief Free a ring
+ *
+ * @param ring
+ */
+void destroyRing(struct Ring* ring);
+
+/*The original queue interface, now a thin layer over a ring*/
 typedef struct Queue {
-  int size;
-  int front;
-  int rear;
+  struct Ring* ring;
   bool serving_cust;
-  char** q;
+  char* last;
 } Queue;
 
 /**
- * @brief Create a Queue struct
+ * @brief Create a Queue struct that holds at least SIZE elements
  *
  * @return struct Queue
  */
@@ -61,6 +144,14 @@ bool isEmpty(struct Queue queue);
  */
 bool isFull(struct Queue queue);
 
+/**
+ * @brief Number of elements in given queue struct
+ *
+ * @param queue
+ * @return int
+ */
+int queueSize(struct Queue queue);
+
 /**
  * @brief Insert string into given queue struct
  *
@@ -76,8 +167,230 @@ bool insert(struct Queue* queue, char* c);
  * @brief Pops first element from queue
  *
  * @param queue
- * @return char* pointer to the removed element, if unsuccessful return NULL
+ * @return char* pointer to the removed element, valid until the next call,
+ * if unsuccessful return NULL
  */
 char* removeData(struct Queue* queue);
 
-#endif  // __QUEUE_H__
\ No newline at end of file
+/**
+ * @brief Free the resources of a queue
+ *
+ * @param queue
+ */
+void destroyQueue(struct Queue* queue);
+
+/*Return values of blockingRemove*/
+enum queue_status {
+  QUEUE_ITEM,
+  QUEUE_INTERRUPTED,
+  QUEUE_SHUTDOWN,
+  QUEUE_EMPTY
+};
+
+/*Ring where consumers sleep until there is work for them. Inserts and
+removes are lock-free, the mutex is only taken to sleep and to wake
+sleeping consumers.*/
+typedef struct BlockingQueue {
+  struct Ring* ring;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  atomic_int sleepers;
+  atomic_int interrupts;
+  atomic_bool shutdown;
+  atomic_bool serving;
+} BlockingQueue;
+
+/**
+ * @brief Initialize a blocking queue in place
+ *
+ * @param bq
+ * @param capacity minimum number of elements, rounded up to a power of two
+ * @return 0 on success, -1 otherwise
+ */
+int createBlockingQueue(struct BlockingQueue* bq, size_t capacity);
+
+/**
+ * @brief Insert an element into the queue and wake one waiting consumer
+ *
+ * @param bq
+ * @param c
+ * @return true if insertion was successful
+ * @return false if the queue was full or shut down
+ */
+bool blockingInsert(struct BlockingQueue* bq, const struct ConnDesc* c);
+
+/**
+ * @brief Block until an element is available, the queue is interrupted or
+ * the queue is shut down
+ *
+ * @param bq
+ * @param out receives the element
+ * @return QUEUE_ITEM if out was filled, QUEUE_INTERRUPTED if woken by
+ * interruptQueue, QUEUE_SHUTDOWN if woken by shutdownQueue
+ */
+enum queue_status blockingRemove(struct BlockingQueue* bq,
+                                 struct ConnDesc* out);
+
+/**
+ * @brief Wake one consumer without giving it an element
+ *
+ * @param bq
+ */
+void interruptQueue(struct BlockingQueue* bq);
+
+/**
+ * @brief Wake all consumers and make every later blockingRemove return
+ * QUEUE_SHUTDOWN
+ *
+ * @param bq
+ */
+void shutdownQueue(struct BlockingQueue* bq);
+
+/**
+ * @brief Number of elements waiting in the queue
+ *
+ * @param bq
+ * @return int
+ */
+int blockingSize(struct BlockingQueue* bq);
+
+/**
+ * @brief Check if the consumer of the queue is serving an element
+ *
+ * @param bq
+ * @return true if the last blockingRemove returned an element
+ * @return false if the consumer is idle
+ */
+bool blockingServing(struct BlockingQueue* bq);
+
+/**
+ * @brief Free the resources of a blocking queue
+ *
+ * @param bq
+ */
+void destroyBlockingQueue(struct BlockingQueue* bq);
+
+/*One consumer's ring in a WorkQueues group*/
+struct WorkRing {
+  _Alignas(CACHE_LINE) struct Ring* ring;
+  pthread_cond_t wake;
+  bool sleeping;
+  atomic_int notify_fd;
+  atomic_int interrupts;
+  atomic_bool serving;
+};
+
+/*Group of rings, one per consumer. A consumer serves its own ring first
+and when that is empty takes the oldest element of the longest other ring,
+so an element never waits behind a busy consumer while another is idle.
+All consumers share one lock that is only taken to sleep and to wake.*/
+typedef struct WorkQueues {
+  int count;
+  struct WorkRing* rings;
+  pthread_mutex_t lock;
+  atomic_int sleepers;
+  atomic_bool shutdown;
+} WorkQueues;
+
+/**
+ * @brief Initialize a group of count rings in place
+ *
+ * @param wq
+ * @param count number of consumers
+ * @param capacity minimum number of elements per ring
+ * @return 0 on success, -1 otherwise
+ */
+int createWorkQueues(struct WorkQueues* wq, int count, size_t capacity);
+
+/**
+ * @brief Insert an element into the ring of consumer idx and wake that
+ * consumer, or any sleeping consumer if it is busy
+ *
+ * @param wq
+ * @param idx
+ * @param c
+ * @return true if insertion was successful
+ * @return false if the ring was full or the group shut down
+ */
+bool workInsert(struct WorkQueues* wq, int idx, const struct ConnDesc* c);
+
+/**
+ * @brief Block until consumer idx has an element from its own ring or one
+ * stolen from another, is interrupted or the group is shut down
+ *
+ * @param wq
+ * @param idx
+ * @param out receives the element
+ * @param stolen set to true if the element came from another ring
+ * @return QUEUE_ITEM if out was filled, QUEUE_INTERRUPTED if woken by
+ * workInterrupt, QUEUE_SHUTDOWN if woken by workShutdown
+ */
+enum queue_status workRemove(struct WorkQueues* wq, int idx,
+                             struct ConnDesc* out, bool* stolen);
+
+/**
+ * @brief Take an element from the ring of consumer idx without blocking,
+ * for consumers that wait for work with poll or epoll instead
+ *
+ * @param wq
+ * @param idx
+ * @param out receives the element
+ * @return QUEUE_ITEM, QUEUE_INTERRUPTED or QUEUE_SHUTDOWN as workRemove,
+ * QUEUE_EMPTY if there is nothing to do
+ */
+enum queue_status workTryRemove(struct WorkQueues* wq, int idx,
+                                struct ConnDesc* out);
+
+/**
+ * @brief Make inserts, interrupts and shutdown for consumer idx also add
+ * one to the eventfd fd, so the consumer can wait for it with epoll
+ *
+ * @param wq
+ * @param idx
+ * @param fd eventfd, or -1 to stop notifying
+ */
+void workSetNotify(struct WorkQueues* wq, int idx, int fd);
+
+/**
+ * @brief Wake consumer idx without giving it an element
+ *
+ * @param wq
+ * @param idx
+ */
+void workInterrupt(struct WorkQueues* wq, int idx);
+
+/**
+ * @brief Wake all consumers and make every later workRemove return
+ * QUEUE_SHUTDOWN
+ *
+ * @param wq
+ */
+void workShutdown(struct WorkQueues* wq);
+
+/**
+ * @brief Number of elements waiting in the ring of consumer idx
+ *
+ * @param wq
+ * @param idx
+ * @return int
+ */
+int workSize(struct WorkQueues* wq, int idx);
+
+/**
+ * @brief Check if consumer idx is serving an element
+ *
+ * @param wq
+ * @param idx
+ * @return true if the last workRemove returned an element
+ * @return false if the consumer is idle
+ */
+bool workServing(struct WorkQueues* wq, int idx);
+
+/**
+ * @brief Free the resources of a group of rings
+ *
+ * @param wq
+ */
+void destroyWorkQueues(struct WorkQueues* wq);
+
+#endif  // __QUEUE_H__
@@ -11,23 +11,70 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "aggregate.h"
+#include "bank.h"
+#include "engine.h"
+#include "hot.h"
+#include "log.h"
+#include "metrics.h"
+#include "protocol.h"
 #include "queue.h"
+#include "shm.h"
+#include "store.h"
+#include "wal.h"
 
 #define BUFSIZE 255
 
-#define QUEUESIZE 4
+/*Upper limit for the number of desks given on the command line*/
+#define MAX_DESKS 1024
+
+/*Events handled per epoll_wait call by a desk in event mode*/
+#define MAX_EVENTS 64
+
+/*Input buffered per client, fits the largest binary request*/
+#define SESSION_BUFSIZE 8192
+/*Replies batched per write, fits the replies to a full input buffer*/
+#define REPLY_BUFSIZE 8192
 
 #define ACC_CAPACITY 1000
 
+/*Write-ahead log of the mutations made since the last checkpoint of the
+accounts file*/
+#define WAL_FILE "accounts.wal"
+
+/*Mutations logged before the balances are written to the accounts file
+while the desks run, 40 MB of log, and the most seconds between two such
+checkpoints while anything is logged*/
+#define CHECKPOINT_RECORDS (1L << 20)
+#define CHECKPOINT_SECONDS 60
+
+/*Connection requests taken from the message queue in one pass*/
+#define ADMIT_BATCH 64
+
+/*Message types on the message queue: clients send MSG_CONNECT, the server
+sends itself MSG_SHUTDOWN to stop waiting for them*/
+#define MSG_CONNECT 1
+#define MSG_SHUTDOWN 2
+
+/*Answers every connection with the metrics of the desks*/
+#define METRICS_SOCKET "metrics.sock"
+
 /*Macro to check that memory was allocated properly*/
 #define CHECK_ALLOC(ptr)     \
   if ((ptr) == NULL) {       \
@@ -41,359 +88,1031 @@ struct client {
   char mtext[100];
 };
 
-/*Account struct as used by the server*/
-struct account {
-  int accnumber;
-  int balance;
-  pthread_rwlock_t lock;
-} account;
+/*Statistics of a desk, written by the desk and read by the master at any
+time without stopping the desk. The statistics of each desk are on cache
+lines of their own, so desks do not slow each other down.*/
+struct desk_stats {
+  _Alignas(CACHE_LINE) atomic_int sessions;
+  /*Deposits minus withdrawals made at the desk since the server started*/
+  atomic_llong balance;
+  atomic_long served;
+  atomic_long stolen;
+  atomic_llong wait_ns;
+  atomic_llong max_wait_ns;
+};
 
-/*Struct as used for storing accounts*/
-struct account_storage {
-  int accnumber;
-  int balance;
-} account_storage;
+/*Statistics of a desk at one point in time*/
+struct desk_snapshot {
+  int sessions;
+  long long balance;
+  long served;
+  long stolen;
+  long long wait_ns;
+  long long max_wait_ns;
+};
 
 /*Struct for passing data to desk threads*/
 struct for_thread {
-  struct Queue* q;
+  struct WorkQueues* q;
+  int id;
   int pipe;
+  struct desk_stats stats;
+};
+
+/*Client served by a desk, input and output are the same descriptor for a
+client of the socket. A client that shares memory with the desk sends and
+receives through shm, the socket only tells whether it is still there.*/
+struct session {
+  int input;
+  int output;
+  struct shm_channel* shm;
+  enum proto_mode mode;
+  size_t inlen;
+  unsigned char inbuf[SESSION_BUFSIZE];
+  /*In event mode, replies the client was not ready for yet, from outoff to
+  outlen, and whether epoll watches the output for them. No more commands
+  are read until they are written.*/
+  unsigned char* outbuf;
+  size_t outoff;
+  size_t outlen;
+  size_t outcap;
+  bool waiting_out;
+  /*Set when a write found the client gone*/
+  bool gone;
+  /*In event mode, set until a client of the socket sent its first byte*/
+  bool greeting;
 };
 
 /*Struct for passing data to master thread*/
 struct for_master {
-  int pipe1, pipe2, pipe3, pipe4;
+  struct WorkQueues* queues;
+  struct for_thread* desks;
 };
 
-/*Global array of our accounts, data integrity protected by
+/*Our accounts, mapped from the accounts file. Data integrity protected by
 RW locks.*/
-struct account** accounts;
+struct account_store store;
 
 /*Some necessary global variables*/
-int query = 0;
-int cont = 0;
-int shutdown = 0;
-/*Pipes for our signal handler so it know that
+int shutdown_requested = 0;
+/*Number of desk threads and the read ends of their pipes, so we know that
 the desk threads were properly shut down*/
-int desk1, desk2, desk3, desk4;
-FILE* logfile;
+int num_desks;
+int* desk_pipes;
+/*Desks serve many clients each with epoll instead of one at a time*/
+int event_mode = 0;
+/*Mutations are logged here before clients get their replies*/
+struct wal wal;
+/*How desks change the balances*/
+const struct engine* engine = &rwlock_engine;
+/*The accounts, the engine and the log that commands run against*/
+struct bank bank;
+/*Latency histograms and counters, one entry per desk*/
+struct desk_metrics* desk_metrics;
+long long start_ns;
+/*Commands hold it while checkpoints run, see bank_checkpoint*/
+pthread_rwlock_t pause_lock;
+/*Mutations that make a checkpoint, 0 to checkpoint only at shutdown*/
+long checkpoint_records = CHECKPOINT_RECORDS;
+pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t checkpoint_wake = PTHREAD_COND_INITIALIZER;
+int checkpoint_stop = 0;
+/*Listening socket for clients that connect to BANK_SOCKET*/
+int listen_fd = -1;
+atomic_int stop_accepting;
+
+/*Metrics of the desk running on this thread, and when the command it is
+running started*/
+static __thread struct desk_metrics* my_metrics;
+static __thread long long command_start_ns;
+
+/*Monotonic time in nanoseconds*/
+long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-/*Log an event to a file, includes timestamp*/
-void log_event(FILE* log, char* msg) {
-  char buf[20];
-  struct tm* t;
+/*Close the pipes or the socket of a client and free its session*/
+void close_client_conn(struct session* s) {
+  if (s->output >= 0 && s->output != s->input) close(s->output);
+  if (s->input >= 0) close(s->input);
+  if (s->shm != NULL) shm_channel_unmap(s->shm);
+  free(s->outbuf);
+  free(s);
+}
 
-  time_t now = time(0);
-  t = localtime(&now);
+/*Write to a client in event mode without waiting for it, what it is not
+ready for is kept for later. A client of the socket is written with
+send, so a client that went away is an error and not a SIGPIPE.*/
+void send_out(struct session* s, const void* buf, size_t len) {
+  const char* p = buf;
+  if (s->gone) return;
+  if (s->outoff == s->outlen) {
+    ssize_t n = s->input == s->output
+                    ? send(s->output, p, len, MSG_NOSIGNAL)
+                    : write(s->output, p, len);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      s->gone = true;
+      return;
+    }
+    if (n > 0) {
+      p += n;
+      len -= n;
+    }
+    s->outoff = s->outlen = 0;
+  }
+  if (len == 0) return;
+  if (s->outlen + len > s->outcap) {
+    size_t cap = s->outcap > 0 ? s->outcap : REPLY_BUFSIZE;
+    while (cap < s->outlen + len) cap *= 2;
+    s->outbuf = realloc(s->outbuf, cap);
+    CHECK_ALLOC(s->outbuf);
+    s->outcap = cap;
+  }
+  memcpy(s->outbuf + s->outlen, p, len);
+  s->outlen += len;
+}
 
-  strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", t);
-  fprintf(log, "%s Server: %s \n", buf, msg);
+/*Write what a client in event mode was not ready for, returns -1 if the
+client is gone*/
+int drain_out(struct session* s) {
+  while (s->outoff < s->outlen) {
+    size_t len = s->outlen - s->outoff;
+    ssize_t n = s->input == s->output
+                    ? send(s->output, s->outbuf + s->outoff, len,
+                           MSG_NOSIGNAL)
+                    : write(s->output, s->outbuf + s->outoff, len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    s->outoff += n;
+  }
+  s->outoff = s->outlen = 0;
+  return 0;
 }
 
-/*Signal handler for SIGINT, set global shutdown variable to 1
-and checks that the desk threads were properly shut down*/
-void sig_int(int signum) {
-  log_event(logfile, "shutting down");
+/*Thread that waits for SIGINT, which every other thread blocks, sets
+shutdown_requested and wakes up the main thread waiting on the message queue
+with a shutdown message. The main thread wakes the desk threads and waits
+for them to shut down.*/
+void* signal_thread(void* arg) {
+  int msgid = *(int*)arg;
+  struct client msg = {MSG_SHUTDOWN, ""};
+  sigset_t set;
+  int sig;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigwait(&set, &sig);
   printf("Caught signal SIGINT, shutting down\n");
-  char buf[100];
-  shutdown = 1;
-  read(desk1, buf, 100);
-  printf("Desk 1 shutdown\n");
-  read(desk2, buf, 100);
-  printf("Desk 2 shutdown\n");
-  read(desk3, buf, 100);
-  printf("Desk 3 shutdown\n");
-  read(desk4, buf, 100);
-  printf("Desk 4 shutdown\n");
-}
-
-/*Function use by desk threads to query balance of desks*/
-void master_query(int* bal, int fd) {
-  if (query) {
-    char* out = calloc(sizeof(char), 100);
-    CHECK_ALLOC(out);
-    sprintf(out, "%d", *bal);
-    write(fd, out, 100);
-    free(out);
-    while (cont == 0) usleep(1000);
-  }
-}
-
-/*Function that parses client input and responds*/
-int interact_with_client(int input, int output, int* bal) {
-  int quit = 0;
-  char* buf = malloc(BUFSIZE);
-  CHECK_ALLOC(buf);
-  log_event(logfile,
-            "Established connection with client, starting interaction");
-  while (!quit) {
-    /*Read input from client and respond accordingly*/
-    if (read(input, buf, BUFSIZE)) {
-      switch (buf[0]) {
-        case 'q':
-          log_event(logfile, "Processing command 'q'");
-          quit = 1;
-          log_event(logfile, "Done with client");
-          printf("Done with client\n");
-          break;
-        case 'l': {
-          log_event(logfile, "Processing command 'l'");
-          int accno = -1;
-          if (sscanf(buf, "l %d", &accno) == 1) {
-            if (accno < ACC_CAPACITY && accno >= 0) {
-              pthread_rwlock_rdlock(&accounts[accno]->lock);
-              int balance = accounts[accno]->balance;
-              char* out = calloc(sizeof(char), BUFSIZE);
-              CHECK_ALLOC(out);
-              sprintf(out, "%d", balance);
-              write(output, out, BUFSIZE);
-              free(out);
-              pthread_rwlock_unlock(&accounts[accno]->lock);
-            } else {
-              write(output, "No account with that number in record", BUFSIZE);
-            }
-          } else
-            write(output, "fail: Error in command\n", BUFSIZE);
-          break;
-        }
-        case 'w': {
-          log_event(logfile, "Processing command 'w'");
-          int accno = -1;
-          int amount = 0;
-          if (sscanf(buf, "w %d %d", &accno, &amount) == 2) {
-            if (accno < ACC_CAPACITY && accno >= 0) {
-              pthread_rwlock_wrlock(&accounts[accno]->lock);
-              if (accounts[accno]->balance >= amount) {
-                *bal -= amount;
-                accounts[accno]->balance -= amount;
-                char* out = calloc(sizeof(char), BUFSIZE);
-                CHECK_ALLOC(out);
-                sprintf(out,
-                        "Withdrew %d from account %d, remaining balance %d",
-                        amount, accno, accounts[accno]->balance);
-                write(output, out, BUFSIZE);
-                free(out);
-              } else {
-                char* out = calloc(sizeof(char), BUFSIZE);
-                CHECK_ALLOC(out);
-                sprintf(out,
-                        "Current balance %d is not sufficient for withdrawal",
-                        accounts[accno]->balance);
-                write(output, out, BUFSIZE);
-                free(out);
-              }
-              pthread_rwlock_unlock(&accounts[accno]->lock);
-            } else {
-              write(output, "No account with that number in record", BUFSIZE);
-            }
-          } else
-            write(output, "fail: Error in command", BUFSIZE);
-          break;
-        }
+  shutdown_requested = 1;
+  if (msgsnd(msgid, &msg, 0, 0) < 0)
+    perror("Could not wake up the main thread");
+  pthread_detach(pthread_self());
+  return NULL;
+}
 
-        case 't': {
-          int accno1 = -1;
-          int accno2 = -1;
-          int amount = 0;
-          log_event(logfile, "Processing command 't'");
-          if (sscanf(buf, "t %d %d %d", &accno1, &accno2, &amount) == 3) {
-            if (accno1 >= 0 && accno1 < ACC_CAPACITY && accno2 >= 0 &&
-                accno2 < ACC_CAPACITY && (accno1 != accno2)) {
-              pthread_rwlock_wrlock(&accounts[accno1]->lock);
-              pthread_rwlock_wrlock(&accounts[accno2]->lock);
-              if (accounts[accno1]->balance >= amount) {
-                accounts[accno1]->balance -= amount;
-                accounts[accno2]->balance += amount;
-                char* out = calloc(sizeof(char), BUFSIZE);
-                CHECK_ALLOC(out);
-                sprintf(out, "Transferred %d from account %d to account %d",
-                        amount, accno1, accno2);
-                write(output, out, BUFSIZE);
-                free(out);
-              } else {
-                char* out = calloc(sizeof(char), BUFSIZE);
-                CHECK_ALLOC(out);
-                sprintf(out,
-                        "Current balance %d of account %d is not sufficient "
-                        "for transfer",
-                        accounts[accno1]->balance, accno1);
-                write(output, out, BUFSIZE);
-                free(out);
-              }
-              pthread_rwlock_unlock(&accounts[accno1]->lock);
-              pthread_rwlock_unlock(&accounts[accno2]->lock);
-            } else {
-              write(output,
-                    "No account with that number in record or the account "
-                    "numbers belonged to the same account",
-                    BUFSIZE);
-            }
-          } else {
-            write(output, "fail: Error in command", BUFSIZE);
-          }
-          break;
-        }
+/*Wake up desk threads sleeping on their queues and check that they were
+properly shut down*/
+void shutdown_desks(struct WorkQueues* queues) {
+  char buf[BUFSIZE];
+  workShutdown(queues);
+  for (int i = 0; i < num_desks; i++) {
+    read(desk_pipes[i], buf, BUFSIZE);
+    printf("Desk %d shutdown\n", i + 1);
+  }
+}
 
-        case 'd': {
-          log_event(logfile, "Processing command 'd'");
-          int accno = -1;
-          int amount = 0;
-          if (sscanf(buf, "d %d %d", &accno, &amount) == 2) {
-            if (accno < ACC_CAPACITY && accno >= 0) {
-              pthread_rwlock_wrlock(&accounts[accno]->lock);
-              *bal += amount;
-              accounts[accno]->balance += amount;
-              char* out = calloc(sizeof(char), BUFSIZE);
-              CHECK_ALLOC(out);
-              sprintf(out, "Deposited %d to account %d, new balance %d", amount,
-                      accno, accounts[accno]->balance);
-              write(output, out, BUFSIZE);
-              free(out);
-              pthread_rwlock_unlock(&accounts[accno]->lock);
-
-            } else {
-              write(output, "No account with that number in record", BUFSIZE);
-            }
-          } else
-            write(output, "fail: Error in command", BUFSIZE);
-          break;
-        }
+/*Read the statistics of a desk while it keeps working*/
+void snapshot_desk(struct desk_stats* st, struct desk_snapshot* out) {
+  out->sessions = atomic_load_explicit(&st->sessions, memory_order_relaxed);
+  out->balance = atomic_load_explicit(&st->balance, memory_order_relaxed);
+  out->served = atomic_load_explicit(&st->served, memory_order_relaxed);
+  out->stolen = atomic_load_explicit(&st->stolen, memory_order_relaxed);
+  out->wait_ns = atomic_load_explicit(&st->wait_ns, memory_order_relaxed);
+  out->max_wait_ns =
+      atomic_load_explicit(&st->max_wait_ns, memory_order_relaxed);
+}
 
-        default:
-          break;
-      }
+/*A change replayed before the account it changes was opened*/
+struct deferred_change {
+  uint64_t id;
+  int64_t amount;
+};
+
+/*Changes waiting for their accounts while the log is replayed. A command
+reserves its place in the log before it runs, so it can land before the
+open of an account that was opened while it ran. Its commit waits for the
+open, so the open is always further on in the log.*/
+struct replay_state {
+  struct deferred_change* deferred;
+  size_t ndeferred;
+  size_t capacity;
+};
+
+/*Add amount to the balance of account id while replaying the log*/
+void replay_change(struct replay_state* rs, uint64_t id, int64_t amount) {
+  int64_t n = store_find(&store, id);
+  if (n < 0) {
+    if (rs->ndeferred == rs->capacity) {
+      rs->capacity = rs->capacity > 0 ? rs->capacity * 2 : 16;
+      rs->deferred =
+          realloc(rs->deferred, rs->capacity * sizeof(*rs->deferred));
+      CHECK_ALLOC(rs->deferred);
     }
+    rs->deferred[rs->ndeferred].id = id;
+    rs->deferred[rs->ndeferred++].amount = amount;
+    return;
   }
-  free(buf);
+  *store_balance(&store, n) += amount;
+  store_mark_dirty(&store, n);
+}
+
+/*Apply the changes that waited for account id to be opened*/
+void replay_deferred(struct replay_state* rs, uint64_t id) {
+  size_t kept = 0;
+  for (size_t i = 0; i < rs->ndeferred; i++) {
+    if (rs->deferred[i].id == id)
+      replay_change(rs, id, rs->deferred[i].amount);
+    else
+      rs->deferred[kept++] = rs->deferred[i];
+  }
+  rs->ndeferred = kept;
+}
+
+/*Apply a mutation from the write-ahead log to the accounts*/
+void replay_record(const struct wal_record* r, void* arg) {
+  struct replay_state* rs = arg;
+  uint64_t slot;
+  switch (r->op) {
+    case OP_OPEN:
+      if (store_open_account(&store, r->acc1, &slot) >= 0)
+        replay_deferred(rs, r->acc1);
+      break;
+    case OP_WITHDRAW:
+      replay_change(rs, r->acc1, -r->amount);
+      break;
+    case OP_DEPOSIT:
+    case OP_TRANSACT:
+      replay_change(rs, r->acc1, r->amount);
+      break;
+    case OP_TRANSFER:
+      replay_change(rs, r->acc1, -r->amount);
+      replay_change(rs, r->acc2, r->amount);
+      break;
+  }
+}
+
+/*Log which command is being processed*/
+void log_command(uint8_t op) {
+  log_eventf(LOG_DEBUG, "Processing command '%c'", op, 0);
+}
+
+/*Count a command of the desk, the next one starts now*/
+void record_command(uint8_t op, enum proto_status status) {
+  long long now = now_ns();
+  if (my_metrics != NULL)
+    metrics_command(my_metrics, op, status, now - command_start_ns);
+  command_start_ns = now;
+}
+
+/*Function that executes a request against the accounts, independent of
+how the client encoded it*/
+void execute_request(const struct request* req, struct response* resp,
+                     atomic_llong* bal) {
+  log_command(req->op);
+  bank_execute(&bank, req, resp, bal);
+  if (req->op == OP_QUIT) {
+    log_event(LOG_INFO, "Done with client");
+    printf("Done with client\n");
+    return;
+  }
+  record_command(req->op, resp->status);
+}
+
+/*Return values of handle_command*/
+enum command_result { CMD_REPLY, CMD_NO_REPLY, CMD_QUIT };
+
+/*Function that parses one text command from a client and writes the
+response to out, which holds BUFSIZE bytes*/
+enum command_result handle_command(const char* buf, char* out,
+                                   atomic_llong* bal) {
+  struct request req;
+  struct response resp;
+  int parsed = parse_text_request(buf, &req);
+  /*Unknown commands are not answered*/
+  if (parsed == -2) return CMD_NO_REPLY;
+  if (parsed < 0) {
+    log_command(req.op);
+    resp.status = ST_BAD_REQUEST;
+    record_command(req.op, resp.status);
+  } else {
+    execute_request(&req, &resp, bal);
+  }
+  if (req.op == OP_QUIT) return CMD_QUIT;
+  memset(out, 0, BUFSIZE);
+  format_text_response(&req, &resp, out, BUFSIZE);
+  return CMD_REPLY;
+}
+
+/*Replies to one read from a client, written back in a single write, to
+the shared memory of the client if it has some*/
+struct reply_batch {
+  int fd;
+  struct shm_ring* ring;
+  /*The session of a client in event mode, which is written without
+  waiting for it*/
+  struct session* session;
+  size_t len;
+  char buf[REPLY_BUFSIZE];
+};
+
+/*Write out the batched replies, once the changes they report are on disk*/
+void flush_replies(struct reply_batch* rb) {
+  if (rb->len == 0) return;
+  if (wal_commit_mine(&wal) < 0) {
+    log_event(LOG_ERROR, "Could not write to the write-ahead log");
+    perror("Could not write to the write-ahead log");
+    exit(EXIT_FAILURE);
+  }
+  if (rb->session != NULL)
+    send_out(rb->session, rb->buf, rb->len);
+  else if (rb->ring != NULL)
+    shm_write(rb->ring, rb->buf, rb->len, rb->fd);
+  else
+    write(rb->fd, rb->buf, rb->len);
+  rb->len = 0;
+}
+
+/*Make room for a reply of len bytes, writes out what is batched if it
+would not fit*/
+char* reserve_reply(struct reply_batch* rb, size_t len) {
+  if (rb->len + len > sizeof(rb->buf)) flush_replies(rb);
+  char* p = rb->buf + rb->len;
+  rb->len += len;
+  return p;
+}
+
+/*Serve text commands buffered in the session, every command is one
+BUFSIZE message. Returns -1 when the session is over.*/
+int serve_text(struct session* s, struct reply_batch* rb, atomic_llong* bal) {
+  char out[BUFSIZE];
+  size_t off = 0;
+  int ret = 0;
+
+  for (; off + BUFSIZE <= s->inlen; off += BUFSIZE) {
+    char* cmd = (char*)s->inbuf + off;
+    cmd[BUFSIZE - 1] = '\0';
+    enum command_result res = handle_command(cmd, out, bal);
+    if (res == CMD_QUIT) {
+      ret = -1;
+      break;
+    }
+    if (res == CMD_REPLY) memcpy(reserve_reply(rb, BUFSIZE), out, BUFSIZE);
+  }
+  memmove(s->inbuf, s->inbuf + off, s->inlen - off);
+  s->inlen -= off;
+  return ret;
+}
+
+/*Serve binary requests buffered in the session, returns -1 when the
+session is over*/
+int serve_binary(struct session* s, struct reply_batch* rb, atomic_llong* bal) {
+  struct request req;
+  struct response resp;
+  size_t off = 0;
+  int ret = 0;
+
+  while (off < s->inlen) {
+    ssize_t used = decode_request(s->inbuf + off, s->inlen - off, &req);
+    if (used == 0) break;
+    if (used < 0) {
+      log_event(LOG_WARN, "Malformed request from client");
+      return -1;
+    }
+    off += used;
+    execute_request(&req, &resp, bal);
+    if (req.op == OP_QUIT) {
+      ret = -1;
+      break;
+    }
+    unsigned char* p = (unsigned char*)reserve_reply(
+        rb, RESP_HEADER_SIZE + resp.body_len);
+    encode_response(&resp, p);
+  }
+  /*Keep a partial request for the next read*/
+  memmove(s->inbuf, s->inbuf + off, s->inlen - off);
+  s->inlen -= off;
+  return ret;
+}
+
+/*Read from a client and serve every command it sent, returns -1 when the
+session is over. Clients may send many commands in one write, their
+replies are written back in order with as few writes as possible.*/
+int serve_session(struct session* s, struct reply_batch* rb,
+                  atomic_llong* bal) {
+  void* in = s->inbuf + s->inlen;
+  size_t room = sizeof(s->inbuf) - s->inlen;
+  ssize_t n = s->shm != NULL ? shm_read(&s->shm->requests, in, room, s->input)
+                             : read(s->input, in, room);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+  if (n <= 0) {
+    log_event(LOG_WARN, "Client disconnected without quitting");
+    return -1;
+  }
+  s->inlen += n;
+  rb->fd = s->output;
+  rb->ring = s->shm != NULL ? &s->shm->replies : NULL;
+  rb->session = event_mode ? s : NULL;
+  rb->len = 0;
+  command_start_ns = now_ns();
+  int ret = s->mode == PROTO_BINARY ? serve_binary(s, rb, bal)
+                                    : serve_text(s, rb, bal);
+  flush_replies(rb);
+  return s->gone ? -1 : ret;
+}
+
+/*Function that reads client input and responds until the client quits*/
+int interact_with_client(struct session* s, atomic_llong* bal) {
+  struct reply_batch* rb = malloc(sizeof(struct reply_batch));
+  CHECK_ALLOC(rb);
+  log_event(LOG_INFO,
+            "Established connection with client, starting interaction");
+  /*Read input from client and respond accordingly*/
+  while (serve_session(s, rb, bal) == 0) {
+  }
+  free(rb);
   return 0;
 }
 
-/*Function that establishes connection with a new client*/
-int establish_client_conn(const char* path, int* bal) {
+/*Open the pipes of a client that connected through the message queue. The
+path is "in|out" or "in|out|b" for a client that asks for the binary
+protocol. Without waiting the input is opened nonblocking, and the output
+for reading and writing, which on Linux does not wait for the client to
+open its end either.*/
+int open_client_pipes(struct session* s, const char* path, bool wait) {
   char* path_in;
   char* path_out;
-  int output, input;
+  char* mode;
   char temp_path[100];
   strcpy(temp_path, path);
 
   const char delim[2] = "|";
   path_out = strtok(temp_path, delim);
   path_in = strtok(NULL, delim);
-  output = open(path_out, O_WRONLY);
-  input = open(path_in, O_RDONLY);
+  mode = strtok(NULL, delim);
+  s->mode = (mode != NULL && !strcmp(mode, "b")) ? PROTO_BINARY : PROTO_TEXT;
+  if (path_out == NULL || path_in == NULL) return -1;
+  s->output = open(path_out, wait ? O_WRONLY : O_RDWR | O_NONBLOCK);
+  s->input = open(path_in, wait ? O_RDONLY : O_RDONLY | O_NONBLOCK);
+  return s->output < 0 || s->input < 0 ? -1 : 0;
+}
 
-  if (output < 0 || input < 0) {
-    goto err_exit;
+/*Read the first byte from a client of the socket, which says which
+protocol it wants, and map the shared memory it may pass along. Desks in
+event mode wait for many clients at once and cannot sleep on the memory of
+one, they serve such a client over the socket. With MSG_DONTWAIT in flags
+it returns 1 if the byte is not there yet.*/
+int open_client_socket(struct session* s, int fd, int flags) {
+  char hello;
+  struct iovec iov = {&hello, 1};
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+
+  s->input = s->output = fd;
+  ssize_t n = recvmsg(fd, &msg, flags);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR) && (flags & MSG_DONTWAIT))
+    return 1;
+  if (n != 1) return -1;
+  s->mode = hello == HELLO_BINARY ? PROTO_BINARY : PROTO_TEXT;
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+    int shm_fd;
+    memcpy(&shm_fd, CMSG_DATA(c), sizeof(int));
+    if (!event_mode) s->shm = shm_channel_map(shm_fd);
+    close(shm_fd);
   }
+  return 0;
+}
 
-  /*Tell client that interaction is ready to begin*/
-  if (write(output, "ready\n", 8)) {
-    if (interact_with_client(input, output, bal) < 0) {
-      goto err_exit;
-    }
-  } else {
-    log_event(logfile, "Error in writing to client");
+/*Session of a new client, not connected yet*/
+struct session* new_session(void) {
+  struct session* s = malloc(sizeof(struct session));
+  CHECK_ALLOC(s);
+  s->inlen = 0;
+  s->input = -1;
+  s->output = -1;
+  s->shm = NULL;
+  s->outbuf = NULL;
+  s->outoff = s->outlen = s->outcap = 0;
+  s->waiting_out = false;
+  s->gone = false;
+  s->greeting = false;
+  return s;
+}
+
+/*What tells a client that interaction is ready to begin, which protocol we
+agreed on and whether we took its shared memory*/
+const char* ready_message(const struct session* s) {
+  if (s->shm != NULL)
+    return s->mode == PROTO_BINARY ? READY_SHM_BINARY : READY_SHM_TEXT;
+  return s->mode == PROTO_BINARY ? READY_BINARY : READY_TEXT;
+}
+
+/*Function that opens the pipes or the socket of a new client and tells it
+that interaction is ready to begin*/
+struct session* open_client_conn(const struct ConnDesc* conn) {
+  struct session* s = new_session();
+
+  if (conn->fd >= 0 ? open_client_socket(s, conn->fd, 0) < 0
+                    : open_client_pipes(s, conn->path, true) < 0)
+    goto err_exit;
+
+  const char* ready = ready_message(s);
+  if (write(s->output, ready, strlen(ready) + 1) <= 0) {
+    log_event(LOG_ERROR, "Error in writing to client");
     goto err_exit;
   }
-  close(output);
-  close(input);
+  return s;
+
+err_exit:
+  log_event(LOG_ERROR, "Could not establish contact with client");
+  close_client_conn(s);
+  return NULL;
+}
+
+/*Function that establishes connection with a new client and serves it*/
+int establish_client_conn(const struct ConnDesc* conn, atomic_llong* bal) {
+  struct session* s = open_client_conn(conn);
+  if (s == NULL) return -1;
+  interact_with_client(s, bal);
+  close_client_conn(s);
   return 0;
+}
+
+/*Start serving a new client in event mode without waiting for it to open
+its pipes or send its first byte, every descriptor of the session is
+nonblocking. Returns NULL if the connection could not be set up.*/
+struct session* start_session(const struct ConnDesc* conn) {
+  struct session* s = new_session();
+  if (conn->fd >= 0) {
+    /*Epoll reports the first byte like any command*/
+    s->input = s->output = conn->fd;
+    fcntl(s->input, F_SETFL, fcntl(s->input, F_GETFL) | O_NONBLOCK);
+    s->greeting = true;
+    return s;
+  }
+  if (open_client_pipes(s, conn->path, false) < 0) goto err_exit;
+  const char* ready = ready_message(s);
+  send_out(s, ready, strlen(ready) + 1);
+  if (s->gone) goto err_exit;
+  return s;
 
 err_exit:
-  log_event(logfile, "Could not establish contact with client");
-  close(output);
-  close(input);
-  return -1;
+  log_event(LOG_ERROR, "Could not establish contact with client");
+  close_client_conn(s);
+  return NULL;
+}
+
+/*Read the first byte of a client of the socket in event mode once epoll
+reports it, and tell the client we are ready. Returns -1 if the client is
+gone.*/
+int greet_client(struct session* s) {
+  int ret = open_client_socket(s, s->input, MSG_DONTWAIT);
+  if (ret != 0) return ret > 0 ? 0 : -1;
+  s->greeting = false;
+  const char* ready = ready_message(s);
+  send_out(s, ready, strlen(ready) + 1);
+  return s->gone ? -1 : 0;
+}
+
+/*Have epoll report commands of a session, or only room for its replies
+while there are some the client was not ready for*/
+void watch_session(int epfd, struct session* s) {
+  bool waiting = s->outoff < s->outlen;
+  if (waiting == s->waiting_out) return;
+  s->waiting_out = waiting;
+  struct epoll_event ev = {.events = waiting ? EPOLLOUT : EPOLLIN,
+                           .data.ptr = s};
+  if (s->input == s->output) {
+    epoll_ctl(epfd, EPOLL_CTL_MOD, s->input, &ev);
+    return;
+  }
+  ev.events = waiting ? 0 : EPOLLIN;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, s->input, &ev);
+  ev.events = waiting ? EPOLLOUT : 0;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, s->output, &ev);
+}
+
+/*Book keeping when a desk takes a client from the queues*/
+void record_wait(struct desk_stats* stats, struct ConnDesc* conn,
+                 bool stolen) {
+  long long wait = now_ns() - conn->enqueued_ns;
+  histogram_record(&my_metrics->queue_wait, wait);
+  atomic_fetch_add(&stats->served, 1);
+  if (stolen) atomic_fetch_add(&stats->stolen, 1);
+  atomic_fetch_add(&stats->wait_ns, wait);
+  if (wait > atomic_load(&stats->max_wait_ns))
+    atomic_store(&stats->max_wait_ns, wait);
 }
 
 /*Initialize a desk thread*/
 void* init_thread(void* vargp) {
   struct for_thread* my_inf = (struct for_thread*)vargp;
-  struct Queue* queue = my_inf->q;
-  int my_bal = 0;
-  int* bal_pointer = &my_bal;
+  struct WorkQueues* queues = my_inf->q;
+  struct desk_stats* stats = &my_inf->stats;
   int fd = my_inf->pipe;
-  char* paths;
+  struct ConnDesc conn;
+  bool stolen;
 
+  my_metrics = &desk_metrics[my_inf->id];
+  engine_count_waits(&my_metrics->lock_waits);
+  hot_set_desk(my_inf->id);
   for (;;) {
-    /*Check if we have received a new client in our queue*/
-    if ((paths = removeData(queue)) != NULL) {
-      log_event(logfile,
+    /*Sleep until we receive a new client or shutdown*/
+    enum queue_status status =
+        workRemove(queues, my_inf->id, &conn, &stolen);
+    if (status == QUEUE_ITEM) {
+      record_wait(stats, &conn, stolen);
+      log_event(LOG_INFO,
                 "Got path from queue, attempting to establish connection");
       /*Establish connection with the new client*/
       printf("Starting communication with new client\n");
-      establish_client_conn(paths, bal_pointer);
+      establish_client_conn(&conn, &stats->balance);
     }
-    /*Check if we should query our balance*/
-    master_query(bal_pointer, fd);
-    if (shutdown) {
+    if (status == QUEUE_SHUTDOWN || shutdown_requested) {
       /*Tell master thread we are shutting down*/
-      write(fd, "Shutdown", BUFSIZE);
+      write(fd, "Shutdown", sizeof("Shutdown"));
       break;
     }
+  }
+  pthread_detach(pthread_self());
+  return (void*)0;
+}
+
+/*Desk thread in event mode, serves all of its clients from one epoll set*/
+void* event_thread(void* vargp) {
+  struct for_thread* my_inf = (struct for_thread*)vargp;
+  struct WorkQueues* queues = my_inf->q;
+  struct desk_stats* stats = &my_inf->stats;
+  int fd = my_inf->pipe;
+  struct ConnDesc conn;
+  struct epoll_event events[MAX_EVENTS];
+  struct reply_batch* rb = malloc(sizeof(struct reply_batch));
+  CHECK_ALLOC(rb);
+  bool stopping = false;
 
-    sleep(1);
+  my_metrics = &desk_metrics[my_inf->id];
+  engine_count_waits(&my_metrics->lock_waits);
+  hot_set_desk(my_inf->id);
+
+  int epfd = epoll_create1(0);
+  int efd = eventfd(0, EFD_NONBLOCK);
+  if (epfd < 0 || efd < 0) {
+    perror("Could not create event loop");
+    exit(EXIT_FAILURE);
   }
+  /*The queue marks new clients, queries and shutdown on the eventfd, its
+  epoll entry is the one without a session*/
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev);
+  workSetNotify(queues, my_inf->id, efd);
+  uint64_t one = 1;
+  write(efd, &one, sizeof(one));
+
+  while (!stopping || atomic_load(&stats->sessions) > 0) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      struct session* s = events[i].data.ptr;
+      if (s != NULL) {
+        int ret;
+        if (s->waiting_out)
+          /*A client that hung up does not take its replies any more*/
+          ret = events[i].events & (EPOLLHUP | EPOLLERR) ? -1 : drain_out(s);
+        else if (s->greeting)
+          ret = greet_client(s);
+        else
+          ret = serve_session(s, rb, &stats->balance);
+        if (ret < 0) {
+          epoll_ctl(epfd, EPOLL_CTL_DEL, s->input, NULL);
+          if (s->output != s->input)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->output, NULL);
+          close_client_conn(s);
+          atomic_fetch_sub(&stats->sessions, 1);
+        } else {
+          watch_session(epfd, s);
+        }
+        continue;
+      }
+      uint64_t count;
+      read(efd, &count, sizeof(count));
+      enum queue_status status;
+      while (!stopping && (status = workTryRemove(queues, my_inf->id,
+                                                  &conn)) != QUEUE_EMPTY) {
+        if (status == QUEUE_SHUTDOWN) {
+          /*Finish the clients we have but do not take new ones*/
+          stopping = true;
+        } else if (status == QUEUE_ITEM) {
+          record_wait(stats, &conn, false);
+          log_event(LOG_INFO,
+                    "Got path from queue, attempting to establish "
+                    "connection");
+          printf("Starting communication with new client\n");
+          if ((s = start_session(&conn)) == NULL) continue;
+          log_event(LOG_INFO,
+                    "Established connection with client, starting "
+                    "interaction");
+          ev.events = EPOLLIN;
+          ev.data.ptr = s;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, s->input, &ev);
+          /*The output is only watched while replies wait for room*/
+          if (s->output != s->input) {
+            ev.events = 0;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, s->output, &ev);
+          }
+          watch_session(epfd, s);
+          atomic_fetch_add(&stats->sessions, 1);
+        }
+      }
+    }
+  }
+  /*Tell master thread we are shutting down*/
+  workSetNotify(queues, my_inf->id, -1);
+  write(fd, "Shutdown", sizeof("Shutdown"));
+  close(efd);
+  close(epfd);
+  free(rb);
   pthread_detach(pthread_self());
   return (void*)0;
 }
 
-/*Adds a new path to the shortest queue*/
-void enqueue(char* path, struct Queue** queues) {
-  int shortest = 100;
-  int shortest_idx = 0;
-  for (int i = 0; i < QUEUESIZE; i++) {
-    if ((queues[i])->size < shortest) {
-      shortest = (queues[i])->size;
-      shortest_idx = i;
-    } else if ((queues[i])->size == shortest &&
-               (!(queues[i]->serving_cust) &&
-                ((queues[shortest_idx]->serving_cust)))) {
-      /*If two queues are the same length but one is not
-        serving a customer, give priority to the one not
-        serving a customer*/
-      shortest = (queues[i])->size;
-      shortest_idx = i;
+/*Adds new clients to the shortest queues, in event mode counting the
+clients a desk is already serving as well. The lengths are read once for the
+whole batch and counted up as clients are added.*/
+void enqueue(struct ConnDesc* conns, int n, struct WorkQueues* queues,
+             struct for_thread* desks) {
+  int sizes[num_desks];
+  for (int i = 0; i < num_desks; i++) {
+    sizes[i] = workSize(queues, i);
+    if (event_mode) sizes[i] += atomic_load(&desks[i].stats.sessions);
+  }
+  long long now = now_ns();
+  for (int r = 0; r < n; r++) {
+    int shortest = event_mode ? INT_MAX : SIZE;
+    int shortest_idx = 0;
+    for (int i = 0; i < num_desks; i++) {
+      if (sizes[i] < shortest) {
+        shortest = sizes[i];
+        shortest_idx = i;
+      } else if (sizes[i] == shortest &&
+                 (!workServing(queues, i) &&
+                  workServing(queues, shortest_idx))) {
+        /*If two queues are the same length but one is not
+          serving a customer, give priority to the one not
+          serving a customer*/
+        shortest = sizes[i];
+        shortest_idx = i;
+      }
+    }
+    conns[r].enqueued_ns = now;
+    log_event(LOG_INFO, "Inserting new client into queue");
+    /*Wakes up the desk, or another idle desk that will take the client*/
+    if (!workInsert(queues, shortest_idx, &conns[r])) {
+      log_event(LOG_ERROR, "Could not insert client");
+      if (conns[r].fd >= 0) close(conns[r].fd);
+    } else {
+      sizes[shortest_idx]++;
+    }
+  }
+}
+
+/*Wait for connection requests and take all that are waiting, up to
+ADMIT_BATCH. Returns the number of requests, -1 once a shutdown message
+arrives.*/
+int admit(int msgid, struct ConnDesc* conns) {
+  /*A shutdown taken along with a batch of requests, the next call
+  returns -1 without waiting for a message that will not come again*/
+  static bool shutdown_taken = false;
+  struct client req;
+  int n = 0;
+  if (shutdown_taken) return -1;
+  /*Block for the first message, then take what else is there. The lowest
+  type comes first, so requests sent before a shutdown are still taken.*/
+  while (n < ADMIT_BATCH) {
+    ssize_t len = msgrcv(msgid, &req, sizeof(req.mtext), -MSG_SHUTDOWN,
+                         n == 0 ? 0 : IPC_NOWAIT);
+    if (len < 0) {
+      if (errno == ENOMSG) break;
+      if (errno == EINTR) continue;
+      log_event(LOG_ERROR, "Something went wrong when receiving message");
+      /*Do not spin on a queue that keeps failing*/
+      if (n == 0) usleep(1000);
+      break;
+    }
+    if (req.message_type == MSG_SHUTDOWN) {
+      shutdown_taken = true;
+      return n == 0 ? -1 : n;
+    }
+    strncpy(conns[n].path, req.mtext, ITEM_SIZE - 1);
+    conns[n].path[ITEM_SIZE - 1] = '\0';
+    conns[n].fd = -1;
+    n++;
+  }
+  return n;
+}
+
+/*Listen for clients on the socket at path, an old one is removed. Returns
+the listening socket, -1 on failure.*/
+int open_listener(const char* path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*Thread that accepts clients of the socket and puts them in the queues,
+the same way the main thread does with requests from the message queue*/
+void* accept_thread(void* arg) {
+  struct for_master* fm = arg;
+  struct ConnDesc conn;
+  conn.path[0] = '\0';
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (atomic_load(&stop_accepting)) {
+      if (fd >= 0) close(fd);
+      break;
     }
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      log_event(LOG_ERROR, "Could not accept client of the socket");
+      perror("Could not accept client of the socket");
+      break;
+    }
+    printf("Received new connection request\n");
+    conn.fd = fd;
+    enqueue(&conn, 1, fm->queues, fm->desks);
+  }
+  return NULL;
+}
+
+/*Stop accepting clients of the socket and remove it*/
+void close_listener(pthread_t atid) {
+  if (listen_fd < 0) return;
+  atomic_store(&stop_accepting, 1);
+  /*Wakes the thread up from accept*/
+  shutdown(listen_fd, SHUT_RDWR);
+  pthread_join(atid, NULL);
+  close(listen_fd);
+  listen_fd = -1;
+  unlink(BANK_SOCKET);
+}
+
+/*Thread that writes the balances to the accounts file and empties the
+log once enough mutations are logged, or a while after the last time*/
+void* checkpoint_thread(void* arg) {
+  long long last = now_ns();
+  pthread_mutex_lock(&checkpoint_lock);
+  while (!checkpoint_stop) {
+    /*Look ten times a second how much is logged*/
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&checkpoint_wake, &checkpoint_lock, &deadline);
+    if (checkpoint_stop) break;
+    /*Only this thread checkpoints until the server shuts down*/
+    long logged = wal_last_lsn(&wal) - store.header->checkpoint_lsn;
+    if (logged == 0 || (logged < checkpoint_records &&
+                        now_ns() - last < CHECKPOINT_SECONDS * 1000000000LL))
+      continue;
+    pthread_mutex_unlock(&checkpoint_lock);
+    if (bank_checkpoint(&bank) == 0)
+      log_eventf(LOG_INFO, "Checkpoint of %d mutations", logged, 0);
+    else
+      log_event(LOG_ERROR, "Could not write a checkpoint");
+    last = now_ns();
+    pthread_mutex_lock(&checkpoint_lock);
   }
-  log_event(logfile, "Inserting new client into queue");
-  if (!insert(queues[shortest_idx], path)) {
-    log_event(logfile, "Could not insert client");
+  pthread_mutex_unlock(&checkpoint_lock);
+  return NULL;
+}
+
+/*Stop the checkpoint thread and wait for a checkpoint it is writing*/
+void stop_checkpoints(pthread_t ctid) {
+  pthread_mutex_lock(&checkpoint_lock);
+  checkpoint_stop = 1;
+  pthread_cond_signal(&checkpoint_wake);
+  pthread_mutex_unlock(&checkpoint_lock);
+  pthread_join(ctid, NULL);
+}
+
+/*Write the metrics of every desk as one line of JSON, with how many
+clients wait in its queue and how many it serves now*/
+void write_metrics(FILE* out, void* arg) {
+  struct for_master* fm = arg;
+  long long now = now_ns();
+  fprintf(out, "{\"time_ns\":%lld,\"uptime_ns\":%lld,\"desks\":[", now,
+          now - start_ns);
+  for (int i = 0; i < num_desks; i++) {
+    struct desk_snapshot st;
+    snapshot_desk(&fm->desks[i].stats, &st);
+    fprintf(out,
+            "%s{\"desk\":%d,\"queue_depth\":%d,\"sessions\":%d,"
+            "\"balance\":%lld,\"served\":%ld,\"stolen\":%ld,",
+            i ? "," : "", i + 1, workSize(fm->queues, i), st.sessions,
+            st.balance, st.served, st.stolen);
+    metrics_write_desk(out, &desk_metrics[i]);
+    fprintf(out, "}");
   }
+  fprintf(out, "]");
+  if (bank.hot != NULL)
+    fprintf(out, ",\"hot\":{\"accounts\":%d,\"promoted\":%llu,"
+            "\"demoted\":%llu}",
+            atomic_load(&bank.hot->active), atomic_load(&bank.hot->promoted),
+            atomic_load(&bank.hot->demoted));
+  fprintf(out, "}\n");
 }
 
 /*Cleanup function for master thread*/
 void cleanup(void* arg) { free((char*)arg); }
 
-/*Master thread that queries desk balance*/
+/*Master thread that reads commands from the console*/
 void* master_thread(void* vargp) {
-  char buf1[100], buf2[100], buf3[100], buf4[100];
+  struct desk_snapshot st;
   char* buf = calloc(sizeof(char), BUFSIZE);
   CHECK_ALLOC(buf);
   pthread_cleanup_push(cleanup, (void*)buf);
 
   if (vargp) {
     struct for_master* fm = (struct for_master*)vargp;
-    desk1 = fm->pipe1;
-    desk2 = fm->pipe2;
-    desk3 = fm->pipe3;
-    desk4 = fm->pipe4;
     for (;;) {
       if (fgets(buf, BUFSIZE, stdin) == NULL) break;
       switch (buf[0]) {
         case 'l': {
-          cont = 0;
-          query = 1;
-          read(fm->pipe1, buf1, 100);
-          read(fm->pipe2, buf2, 100);
-          read(fm->pipe3, buf3, 100);
-          read(fm->pipe4, buf4, 100);
-
-          printf("Balances\nDesk 1: %s\nDesk 2: %s\nDesk 3: %s\nDesk 4: %s\n",
-                 buf1, buf2, buf3, buf4);
-
-          query = 0;
-          cont = 1;
+          /*Statistics are read without disturbing the desks*/
+          printf("Balances\n");
+          for (int i = 0; i < num_desks; i++) {
+            snapshot_desk(&fm->desks[i].stats, &st);
+            printf("Desk %d: %lld\n", i + 1, st.balance);
+          }
+          break;
+        }
+        case 's': {
+          printf("Queues\n");
+          for (int i = 0; i < num_desks; i++) {
+            snapshot_desk(&fm->desks[i].stats, &st);
+            printf(
+                "Desk %d: served %ld, stolen %ld, average wait %.3f ms, "
+                "longest wait %.3f ms\n",
+                i + 1, st.served, st.stolen,
+                st.served ? st.wait_ns / 1e6 / st.served : 0.0,
+                st.max_wait_ns / 1e6);
+          }
+          break;
+        }
+        case 'm': {
+          write_metrics(stdout, fm);
+          fflush(stdout);
+          break;
+        }
+        case 'a': {
+          /*Totals over all accounts, with the largest n balances*/
+          struct aggregate* agg = malloc(sizeof(struct aggregate));
+          CHECK_ALLOC(agg);
+          int n = 10;
+          sscanf(buf + 1, "%d", &n);
+          int ret = aggregate_run(&store, engine, bank.hot,
+                                  sysconf(_SC_NPROCESSORS_ONLN), n, agg);
+          if (ret == -2) {
+            printf("No snapshots with the %s engine\n", engine->name);
+          } else if (ret < 0) {
+            printf("Could not take a snapshot of the accounts\n");
+          } else {
+            aggregate_write(stdout, agg);
+            fflush(stdout);
+          }
+          free(agg);
+          break;
         }
         case 'q': {
           kill(getpid(), SIGINT);
@@ -411,59 +1130,175 @@ void* master_thread(void* vargp) {
 int main(int argc, char** argv) {
   const char* fname = "runfile";
   const char* acc_file = "accounts";
-  logfile = fopen("server_log", "a");
-  FILE* accfile;
   FILE* runfile = fopen(fname, "w");
-  char* buf = malloc(BUFSIZE);
-  CHECK_ALLOC(buf);
 
   pid_t pid = getpid();
-  struct account_storage* acc_input = malloc(sizeof(struct account));
 
-  int pipe1[2], pipe2[2], pipe3[3], pipe4[4];
+  struct ConnDesc conns[ADMIT_BATCH];
+  struct client stale;
 
-  struct client recv_client;
+  /*SIGINT is taken by signal_thread, every thread started from here on
+  inherits the blocked signal*/
+  sigset_t sigint;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, NULL);
 
-  /*Init queues*/
-  struct Queue q1 = createQueue();
-  struct Queue q2 = createQueue();
-  struct Queue q3 = createQueue();
-  struct Queue q4 = createQueue();
-
-  struct Queue** queues = malloc(sizeof(struct Queue*) * QUEUESIZE);
-  CHECK_ALLOC(queues);
-
-  accounts = malloc(sizeof(struct account*) * ACC_CAPACITY);
-  CHECK_ALLOC(accounts);
-
-  /*Allocate memory and init rw locks*/
-  for (int i = 0; i < ACC_CAPACITY; i++) {
-    accounts[i] = malloc(sizeof(struct account));
-    CHECK_ALLOC(accounts[i]);
-    accounts[i]->accnumber = i;
-    accounts[i]->balance = 0;
-    pthread_rwlock_init(&accounts[i]->lock, NULL);
-  }
-  /*Try to read in previous account data*/
-  log_event(logfile, "Opening storage of accounts");
-  if ((accfile = fopen(acc_file, "r")) != NULL) {
-    for (int i = 0; i < ACC_CAPACITY; i++) {
-      fread(acc_input, sizeof(struct account_storage), 1, accfile);
-      accounts[i]->accnumber = acc_input->accnumber;
-      accounts[i]->balance = acc_input->balance;
+  /*By default use one desk per online CPU*/
+  num_desks = sysconf(_SC_NPROCESSORS_ONLN);
+  /*By default sync the log as soon as there is something to sync, more
+  desks join a group while the previous sync is running*/
+  long wal_window_us = 0;
+  int wal_group = 0;
+  /*Layout of a new accounts file*/
+  int layout = STORE_LAYOUT_PADDED;
+  /*By default every command is logged*/
+  int log_level = LOG_DEBUG;
+  /*By default no account is split into sub-balances*/
+  int hot_accounts = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:ew:g:l:m:v:H")) != -1) {
+    switch (opt) {
+      case 'c':
+        checkpoint_records = atol(optarg);
+        break;
+      case 'd':
+        num_desks = atoi(optarg);
+        break;
+      case 'e':
+        event_mode = 1;
+        break;
+      case 'w':
+        wal_window_us = atol(optarg);
+        break;
+      case 'g':
+        wal_group = atoi(optarg);
+        break;
+      case 'l':
+        layout = store_layout_by_name(optarg);
+        break;
+      case 'm':
+        engine = engine_by_name(optarg);
+        break;
+      case 'v':
+        log_level = log_level_by_name(optarg);
+        break;
+      case 'H':
+        hot_accounts = 1;
+        break;
+      default:
+        printf(
+            "Usage: %s [-c checkpoint_records] [-d numdesks] [-e] "
+            "[-w wal_window_us] "
+            "[-g wal_group] [-l records|padded|columns] "
+            "[-m rwlock|atomic|combine] [-v debug|info|warn|error|off] "
+            "[-H]\n",
+            argv[0]);
+        return -1;
+    }
+  }
+  if (layout < 0 || engine == NULL || log_level < 0) {
+    printf("Unknown account layout, engine or log level\n");
+    return -1;
+  }
+  if (log_open("server_log", log_level) < 0) {
+    perror("Could not open the server log");
+    exit(EXIT_FAILURE);
+  }
+  if (num_desks < 1) num_desks = 1;
+  if (num_desks > MAX_DESKS) num_desks = MAX_DESKS;
+  if (event_mode) {
+    /*Every client takes two descriptors, allow as many as we can*/
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
     }
-    fclose(accfile);
-  } else
-    log_event(logfile, "Could not open storage of accounts");
+  }
 
-  free(acc_input);
+  /*Init queues*/
+  struct WorkQueues queues;
+  if (createWorkQueues(&queues, num_desks, SIZE) < 0) {
+    perror("Could not create queues");
+    exit(EXIT_FAILURE);
+  }
 
-  queues[0] = &q1;
-  queues[1] = &q2;
-  queues[2] = &q3;
-  queues[3] = &q4;
+  /*Map the accounts, a new accounts file starts with ACC_CAPACITY empty
+  accounts*/
+  log_event(LOG_INFO, "Opening storage of accounts");
+  if (store_open(&store, acc_file, ACC_CAPACITY, layout) < 0) {
+    log_event(LOG_ERROR, "Could not open storage of accounts");
+    perror("Could not open storage of accounts");
+    exit(EXIT_FAILURE);
+  }
+
+  /*Redo what was committed after the last checkpoint*/
+  uint64_t last_lsn;
+  struct replay_state rs = {NULL, 0, 0};
+  long replayed = wal_replay(WAL_FILE, store.header->checkpoint_lsn,
+                             replay_record, &rs, &last_lsn);
+  if (replayed == -2) {
+    fprintf(stderr, "%s is not a write-ahead log of this version\n",
+            WAL_FILE);
+    exit(EXIT_FAILURE);
+  }
+  if (replayed < 0) {
+    perror("Could not read the write-ahead log");
+    exit(EXIT_FAILURE);
+  }
+  /*Committed changes to accounts that were never opened mean the log does
+  not belong to these accounts, starting would lose them*/
+  if (rs.ndeferred > 0) {
+    log_eventf(LOG_ERROR, "The write-ahead log changes %d unknown accounts",
+               rs.ndeferred, 0);
+    fprintf(stderr,
+            "The write-ahead log changes account %llu, which was never "
+            "opened\n",
+            (unsigned long long)rs.deferred[0].id);
+    exit(EXIT_FAILURE);
+  }
+  free(rs.deferred);
+  if (replayed > 0) {
+    log_eventf(LOG_INFO, "Replayed %d mutations from the write-ahead log",
+               replayed, 0);
+    printf("Replayed %ld mutations from the write-ahead log\n", replayed);
+  }
+  if (wal_open(&wal, WAL_FILE, last_lsn, wal_window_us, wal_group) < 0) {
+    perror("Could not open the write-ahead log");
+    exit(EXIT_FAILURE);
+  }
+  bank.store = &store;
+  bank.engine = engine;
+  bank.wal = &wal;
+  bank.hot = NULL;
+  bank.pause = NULL;
+  if (checkpoint_records > 0) {
+    /*Checkpoints would wait forever for desks that keep taking it*/
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&pause_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    bank.pause = &pause_lock;
+  }
+  if (hot_accounts && (bank.hot = hot_create(&store, engine, num_desks)) ==
+                          NULL) {
+    perror("Could not allocate the hot accounts");
+    exit(EXIT_FAILURE);
+  }
 
-  pthread_t tid1, tid2, tid3, tid4, mtid;
+  pthread_t mtid;
+  pthread_t* tids = malloc(sizeof(pthread_t) * num_desks);
+  CHECK_ALLOC(tids);
+  struct for_thread* fts =
+      aligned_alloc(CACHE_LINE, sizeof(struct for_thread) * num_desks);
+  CHECK_ALLOC(fts);
+  desk_pipes = malloc(sizeof(int) * num_desks);
+  CHECK_ALLOC(desk_pipes);
+  desk_metrics = metrics_create(num_desks);
+  CHECK_ALLOC(desk_metrics);
+  start_ns = now_ns();
 
   key_t key;
   int msgid;
@@ -471,106 +1306,105 @@ int main(int argc, char** argv) {
   key = ftok("progfile", 65);
 
   msgid = msgget(key, 0666 | IPC_CREAT);
+  /*A server that crashed may have left its shutdown message behind*/
+  while (msgrcv(msgid, &stale, sizeof(stale.mtext), MSG_SHUTDOWN,
+                IPC_NOWAIT) >= 0) {
+  }
 
   fprintf(runfile, "%d\n", msgid);
   fprintf(runfile, "%d\n", pid);
 
   fclose(runfile);
 
-  /*Init pipes for ipc between master thread and desk threads*/
-  pipe(pipe1);
-  pipe(pipe2);
-  pipe(pipe3);
-  pipe(pipe4);
-
-  /*Struct for passing queue and pipe to desk threads*/
-  struct for_thread ft1 = {queues[0], pipe1[1]};
-  struct for_thread ft2 = {queues[1], pipe2[1]};
-  struct for_thread ft3 = {queues[2], pipe3[1]};
-  struct for_thread ft4 = {queues[3], pipe4[1]};
-
-  /*Struct for passing the desk pipes to master thread*/
-  struct for_master fm = {pipe1[0], pipe2[0], pipe3[0], pipe4[0]};
-  log_event(logfile, "Creating threads");
+  /*Init pipes for ipc between master thread and desk threads, and the
+  structs for passing queue and pipe to desk threads*/
+  for (int i = 0; i < num_desks; i++) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("Could not create pipe");
+      exit(EXIT_FAILURE);
+    }
+    desk_pipes[i] = fds[0];
+    fts[i].q = &queues;
+    fts[i].id = i;
+    fts[i].pipe = fds[1];
+    atomic_init(&fts[i].stats.sessions, 0);
+    atomic_init(&fts[i].stats.balance, 0);
+    atomic_init(&fts[i].stats.served, 0);
+    atomic_init(&fts[i].stats.stolen, 0);
+    atomic_init(&fts[i].stats.wait_ns, 0);
+    atomic_init(&fts[i].stats.max_wait_ns, 0);
+  }
+
+  /*Struct for passing the desks to master thread*/
+  struct for_master fm = {&queues, fts};
+  if (metrics_listen(METRICS_SOCKET, write_metrics, &fm) < 0)
+    perror("Could not open the metrics socket");
+  log_event(LOG_INFO, "Creating threads");
   /*Init threads*/
   pthread_create(&mtid, NULL, master_thread, (void*)&fm);
 
-  pthread_create(&tid1, NULL, init_thread, (void*)(&ft1));
-  pthread_create(&tid2, NULL, init_thread, (void*)(&ft2));
-  pthread_create(&tid3, NULL, init_thread, (void*)(&ft3));
-  pthread_create(&tid4, NULL, init_thread, (void*)(&ft4));
-  log_event(logfile, "Threads created");
+  for (int i = 0; i < num_desks; i++) {
+    pthread_create(&tids[i], NULL, event_mode ? event_thread : init_thread,
+                   (void*)(&fts[i]));
+  }
+  pthread_t ctid;
+  if (bank.pause != NULL)
+    pthread_create(&ctid, NULL, checkpoint_thread, NULL);
+  log_event(LOG_INFO, "Threads created");
+  /*Clients can connect to the socket as well as through the message queue*/
+  pthread_t atid;
+  if ((listen_fd = open_listener(BANK_SOCKET)) < 0 ||
+      pthread_create(&atid, NULL, accept_thread, &fm) != 0) {
+    perror("Could not open the client socket");
+    if (listen_fd >= 0) close(listen_fd);
+    listen_fd = -1;
+  }
   /*Start signal handler*/
-  signal(SIGINT, sig_int);
+  pthread_t stid;
+  pthread_create(&stid, NULL, signal_thread, &msgid);
 
-  printf("Server has been started\n");
+  printf("Server has been started with %d desks\n", num_desks);
   for (;;) {
-    /*Check the message queue for new clients trying to connect*/
-    if (msgrcv(msgid, &recv_client, sizeof(recv_client.mtext), 1, IPC_NOWAIT) ==
-        -1) {
-      if (errno != ENOMSG) {
-        log_event(logfile, "Something went wrong when receiving message\n");
-      }
-    } else {
-      printf("Received new connection request\n");
-      strcpy(buf, recv_client.mtext);
-      enqueue(buf, queues);
-      errno = 0;
+    /*Sleep until clients want to connect or the server shuts down*/
+    int n = admit(msgid, conns);
+    if (n > 0) {
+      for (int i = 0; i < n; i++) printf("Received new connection request\n");
+      enqueue(conns, n, &queues, fts);
     }
-    if (shutdown) {
-      /*The shutdown variable has been set so kill the master thread, other
-      threads handle the signal on their own*/
+    if (n < 0) {
+      log_event(LOG_INFO, "shutting down");
+      /*Shutdown has been requested so kill the master thread and
+      wake up the desks so they can exit*/
       pthread_cancel(mtid);
       pthread_detach(mtid);
+      close_listener(atid);
+      shutdown_desks(&queues);
+      metrics_close();
       break;
     }
-    /*Delay as we use non blocking msgrcv to not send an unecessary amount of
-     *request*/
-    usleep(1000);
   }
-  free(buf);
-  /*We dont write the locks to storage, only account numbers and balance so
-   init different struct for storage*/
-  struct account_storage** acc_storage;
-  acc_storage = malloc(sizeof(struct account_storage) * ACC_CAPACITY);
-  CHECK_ALLOC(acc_storage);
-
-  for (int i = 0; i < ACC_CAPACITY; i++) {
-    acc_storage[i] = malloc(sizeof(struct account_storage));
-    CHECK_ALLOC(acc_storage[i]);
-  }
-  for (int i = 0; i < ACC_CAPACITY; i++) {
-    acc_storage[i]->accnumber = accounts[i]->accnumber;
-    acc_storage[i]->balance = accounts[i]->balance;
-  }
-
-  /*Try to write account data to file*/
-  accfile = fopen(acc_file, "w");
-  if (accfile == NULL) printf("could not open accfile\n");
-  for (int i = 0; i < ACC_CAPACITY; i++) {
-    if (fwrite(acc_storage[i], sizeof(struct account_storage), 1, accfile) ==
-        0) {
-      printf("could not write to file\n");
-    }
-    pthread_rwlock_destroy(&accounts[i]->lock);
-    free(accounts[i]);
-  }
-  fclose(accfile);
-
-  free(accounts);
+  /*Every desk has stopped, put what the hot accounts got back into their
+  balances, make sure the last mutations are in the log and write the
+  balances they changed. The log is only needed until the accounts file
+  holds its mutations.*/
+  if (bank.pause != NULL) stop_checkpoints(ctid);
+  if (bank_checkpoint(&bank) < 0) printf("could not write to file\n");
+  if (bank.hot != NULL) hot_destroy(bank.hot);
+  wal_close(&wal);
+  if (bank.pause != NULL) pthread_rwlock_destroy(&pause_lock);
+  store_close(&store);
+  log_close();
 
-  for (int i = 0; i < ACC_CAPACITY; i++) {
-    free(acc_storage[i]);
-  }
-  free(acc_storage);
-
-  for (int i = 0; i < QUEUESIZE; i++) {
-    for (int j = 0; j < SIZE; j++) {
-      free(queues[i]->q[j]);
-    }
-    free(queues[i]->q);
+  for (int i = 0; i < num_desks; i++) {
+    close(desk_pipes[i]);
+    close(fts[i].pipe);
   }
-  free(queues);
+  destroyWorkQueues(&queues);
+  free(desk_pipes);
+  free(desk_metrics);
+  free(fts);
+  free(tids);
   remove(fname);
   return 0;
 }
\ No newline at end of file
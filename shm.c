@@ -0,0 +1,144 @@
+#include "shm.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Checks of the ring before sleeping, none with one CPU where the other
+side cannot run while we spin*/
+static int spins = -1;
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/*Sleep while word is still val, at most SHM_WAIT_MS. The word is shared
+with another process, so the futex is not a private one.*/
+static void futex_wait(atomic_uint* word, unsigned int val) {
+  struct timespec ts = {0, SHM_WAIT_MS * 1000000L};
+  syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*Nothing is sent on the socket after the handshake, so if it is readable
+the other side has closed it*/
+static int peer_gone(int peer) {
+  struct pollfd p = {.fd = peer, .events = POLLIN};
+  return poll(&p, 1, 0) > 0;
+}
+
+/*Wait until word is no longer val, the other side wakes us if it sees
+sleeps set. Returns -1 if the other side went away.*/
+static int wait_change(atomic_uint* word, unsigned int val, atomic_int* sleeps,
+                       int peer) {
+  if (spins < 0) spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+  for (int i = 0; i < spins; i++) {
+    if (atomic_load_explicit(word, memory_order_acquire) != val) return 0;
+    cpu_relax();
+  }
+  for (;;) {
+    /*Set the flag before the last look, so either we see the change or
+    the other side sees the flag*/
+    atomic_store(sleeps, 1);
+    if (atomic_load(word) == val) futex_wait(word, val);
+    atomic_store_explicit(sleeps, 0, memory_order_relaxed);
+    if (atomic_load_explicit(word, memory_order_acquire) != val) return 0;
+    if (peer_gone(peer)) return -1;
+  }
+}
+
+/*Wake the other side if it sleeps on word, after word was changed*/
+static void wake(atomic_uint* word, atomic_int* sleeps) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(sleeps, memory_order_relaxed)) futex_wake(word);
+}
+
+struct shm_channel* shm_channel_create(int* fd) {
+  static atomic_int made;
+  char name[64];
+  snprintf(name, sizeof(name), "/bank-%d-%d", (int)getpid(),
+           atomic_fetch_add(&made, 1));
+  *fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (*fd < 0) return NULL;
+  /*Only the descriptor is needed from here on*/
+  shm_unlink(name);
+  struct shm_channel* ch = NULL;
+  /*The new region is zeroed, which is an empty channel*/
+  if (ftruncate(*fd, sizeof(struct shm_channel)) == 0)
+    ch = shm_channel_map(*fd);
+  if (ch == NULL) {
+    close(*fd);
+    *fd = -1;
+  }
+  return ch;
+}
+
+struct shm_channel* shm_channel_map(int fd) {
+  struct stat st;
+  /*A smaller region would fault when we touch its end*/
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct shm_channel))
+    return NULL;
+  void* p = mmap(NULL, sizeof(struct shm_channel), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+void shm_channel_unmap(struct shm_channel* ch) {
+  munmap(ch, sizeof(struct shm_channel));
+}
+
+ssize_t shm_read(struct shm_ring* r, void* buf, size_t len, int peer) {
+  unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) {
+    if (wait_change(&r->head, tail, &r->reader_sleeps, peer) < 0) return 0;
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+  }
+  size_t n = head - tail;
+  if (n > len) n = len;
+  size_t off = tail & (SHM_RING_SIZE - 1);
+  size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+  memcpy(buf, r->data + off, first);
+  memcpy((unsigned char*)buf + first, r->data, n - first);
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+  wake(&r->tail, &r->writer_sleeps);
+  return n;
+}
+
+ssize_t shm_write(struct shm_ring* r, const void* buf, size_t len, int peer) {
+  const unsigned char* p = buf;
+  size_t left = len;
+  unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  while (left > 0) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t room = SHM_RING_SIZE - (head - tail);
+    if (room == 0) {
+      if (wait_change(&r->tail, tail, &r->writer_sleeps, peer) < 0)
+        return -1;
+      continue;
+    }
+    size_t n = left < room ? left : room;
+    size_t off = head & (SHM_RING_SIZE - 1);
+    size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+    memcpy(r->data + off, p, first);
+    memcpy(r->data, p + first, n - first);
+    head += n;
+    p += n;
+    left -= n;
+    atomic_store_explicit(&r->head, head, memory_order_release);
+    wake(&r->head, &r->reader_sleeps);
+  }
+  return len;
+}
@@ -0,0 +1,102 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+/**
+ * @file shm.h
+ * @brief Shared memory channel between a client and its desk
+ *
+ * A channel is a region made with shm_open and mapped by both processes.
+ * It holds two single-producer single-consumer byte rings, one for requests
+ * and one for replies, that carry the same bytes the pipes or the socket
+ * would. Moving bytes is a copy and a store, no system call.
+ *
+ * A side that finds its ring empty, or full, spins for a while, unless
+ * there is only one CPU, then sets a flag in the region and sleeps on a
+ * futex. The other side only makes the wake system call when it sees the
+ * flag, so while both sides are busy neither enters the kernel. Sleeps are
+ * bounded by SHM_WAIT_MS, after which the waiting side checks the socket of
+ * the connection to see whether the other side went away.
+ *
+ * The client makes the region and passes its descriptor to the server over
+ * the socket, the name is removed right after it was made, so nothing is
+ * left behind when either side exits.
+ */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+/*Bytes per ring, a power of two*/
+#define SHM_RING_SIZE (1 << 16)
+
+/*Times an idle side checks its ring before it goes to sleep*/
+#define SHM_SPIN 4000
+
+/*Longest sleep before checking whether the other side is still there*/
+#define SHM_WAIT_MS 100
+
+/*Counters only grow, positions in data are taken modulo SHM_RING_SIZE.
+Each cache line is written by one side only.*/
+struct shm_ring {
+  /*Written by the producer: bytes written so far, also the futex a
+  sleeping consumer waits on, and whether the producer sleeps*/
+  _Alignas(CACHE_LINE) atomic_uint head;
+  atomic_int writer_sleeps;
+  /*Written by the consumer: bytes read so far, also the futex a sleeping
+  producer waits on, and whether the consumer sleeps*/
+  _Alignas(CACHE_LINE) atomic_uint tail;
+  atomic_int reader_sleeps;
+  _Alignas(CACHE_LINE) unsigned char data[SHM_RING_SIZE];
+};
+
+struct shm_channel {
+  /*Client to server*/
+  struct shm_ring requests;
+  /*Server to client*/
+  struct shm_ring replies;
+};
+
+/**
+ * @brief Make and map a new channel, for the client
+ *
+ * @param fd set to the descriptor of the region, to be passed to the server
+ * and closed once it has it
+ * @return the channel, NULL on failure
+ */
+struct shm_channel* shm_channel_create(int* fd);
+
+/**
+ * @brief Map a channel made by a client, for the server
+ *
+ * @param fd the descriptor passed by the client, not closed
+ * @return the channel, NULL on failure
+ */
+struct shm_channel* shm_channel_map(int fd);
+
+/**
+ * @brief Unmap a channel
+ */
+void shm_channel_unmap(struct shm_channel* ch);
+
+/**
+ * @brief Read what is in a ring, up to len bytes, waiting until there is
+ * something
+ *
+ * @param peer socket of the connection, checked while waiting
+ * @return the number of bytes read, 0 if the other side went away
+ */
+ssize_t shm_read(struct shm_ring* r, void* buf, size_t len, int peer);
+
+/**
+ * @brief Write len bytes to a ring, waiting for room as long as it is full
+ *
+ * @param peer socket of the connection, checked while waiting
+ * @return len, -1 if the other side went away
+ */
+ssize_t shm_write(struct shm_ring* r, const void* buf, size_t len, int peer);
+
+#endif  // __SHM_H__
@@ -0,0 +1,546 @@
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CKPT_MAGIC "BANKCKPT"
+
+/*Start of the file a checkpoint writes its pages to before it writes them
+to the accounts file. It is written after the pages, so a file without it
+was never used. Every page follows as its index and STORE_HEADER_SIZE
+bytes.*/
+struct ckpt_header {
+  char magic[8];
+  uint64_t pages;
+};
+
+/*Record of the accounts file before it was a store*/
+struct legacy_record {
+  int accnumber;
+  int balance;
+};
+
+static const char* layout_names[] = {"records", "padded", "columns"};
+
+int store_layout_by_name(const char* name) {
+  for (int i = 0; i < 3; i++)
+    if (!strcmp(name, layout_names[i])) return i;
+  return -1;
+}
+
+const char* store_layout_name(enum store_layout layout) {
+  return layout_names[layout];
+}
+
+/*Bytes from one balance to the next*/
+static size_t balance_stride(enum store_layout layout) {
+  switch (layout) {
+    case STORE_LAYOUT_PADDED:
+      return CACHE_LINE;
+    case STORE_LAYOUT_COLUMNS:
+      return sizeof(int32_t);
+    default:
+      return sizeof(struct account_record);
+  }
+}
+
+/*Where the flags of the first slot of a segment are, and the numbers of
+the accounts*/
+static size_t flags_offset(enum store_layout layout) {
+  if (layout == STORE_LAYOUT_COLUMNS)
+    return (size_t)STORE_SEGMENT_ACCOUNTS * sizeof(int32_t);
+  return offsetof(struct account_record, flags);
+}
+
+static size_t ids_offset(enum store_layout layout) {
+  size_t off = (size_t)STORE_SEGMENT_ACCOUNTS * balance_stride(layout);
+  if (layout == STORE_LAYOUT_COLUMNS)
+    off += (size_t)STORE_SEGMENT_ACCOUNTS * sizeof(uint32_t);
+  return off;
+}
+
+static size_t segment_size(enum store_layout layout) {
+  return ids_offset(layout) +
+         (size_t)STORE_SEGMENT_ACCOUNTS * sizeof(uint64_t);
+}
+
+static size_t file_size(uint64_t segments, enum store_layout layout) {
+  return STORE_HEADER_SIZE + segments * segment_size(layout);
+}
+
+static uint64_t segments_for(uint64_t count) {
+  return (count + STORE_SEGMENT_ACCOUNTS - 1) / STORE_SEGMENT_ACCOUNTS;
+}
+
+/*Offset in the file of the balance of slot n*/
+static size_t balance_offset(uint64_t n, enum store_layout layout) {
+  return STORE_HEADER_SIZE +
+         (n >> STORE_SEGMENT_SHIFT) * segment_size(layout) +
+         (n & (STORE_SEGMENT_ACCOUNTS - 1)) * balance_stride(layout);
+}
+
+static size_t flags_file_offset(uint64_t n, enum store_layout layout) {
+  if (layout != STORE_LAYOUT_COLUMNS)
+    return balance_offset(n, layout) + flags_offset(layout);
+  return STORE_HEADER_SIZE +
+         (n >> STORE_SEGMENT_SHIFT) * segment_size(layout) +
+         flags_offset(layout) +
+         (n & (STORE_SEGMENT_ACCOUNTS - 1)) * sizeof(uint32_t);
+}
+
+/*Number of the account in slot n*/
+static uint64_t* store_id(struct account_store* s, uint64_t n) {
+  return (uint64_t*)(store_segment(s, n)->base + s->ids_offset +
+                     (n & (STORE_SEGMENT_ACCOUNTS - 1)) * sizeof(uint64_t));
+}
+
+/*Write a new store with accounts 0 to count - 1 to path, through a
+temporary file so that a crash leaves either the old file or the complete
+new one. balances and flags may be NULL for empty accounts.*/
+static int create_store(const char* path, uint64_t count,
+                        enum store_layout layout, const int32_t* balances,
+                        const uint32_t* flags, uint64_t lsn) {
+  char tmp[PATH_MAX];
+  struct store_header h;
+  int ok;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return -1;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, STORE_MAGIC, sizeof(h.magic));
+  h.version = STORE_VERSION;
+  h.record_size = balance_stride(layout);
+  h.count = count;
+  h.checkpoint_lsn = lsn;
+  h.layout = layout;
+  h.segments = segments_for(count);
+  h.numbered = count;
+  /*The accounts of a new store are a hole in the file that reads as zero,
+  only what is not zero has to be written*/
+  ok = ftruncate(fd, file_size(h.segments, layout)) == 0 &&
+       pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+  for (uint64_t i = 0; ok && balances != NULL && i < count; i++) {
+    if (balances[i] == 0) continue;
+    ok = pwrite(fd, &balances[i], sizeof(int32_t),
+                balance_offset(i, layout)) == sizeof(int32_t);
+  }
+  for (uint64_t i = 0; ok && flags != NULL && i < count; i++) {
+    if (flags[i] == 0) continue;
+    ok = pwrite(fd, &flags[i], sizeof(uint32_t),
+                flags_file_offset(i, layout)) == sizeof(uint32_t);
+  }
+  ok = ok && fsync(fd) == 0;
+  close(fd);
+  if (ok && rename(tmp, path) == 0) return 0;
+  unlink(tmp);
+  return -1;
+}
+
+/*Convert an accounts file of count legacy records, optionally followed by
+the lsn of its last checkpoint*/
+static int convert_legacy(const char* path, int fd, size_t size,
+                          uint64_t count, enum store_layout layout) {
+  size_t records = count * sizeof(struct legacy_record);
+  uint64_t lsn = 0;
+  if (size != records && size != records + sizeof(lsn)) return -1;
+
+  struct legacy_record* old = malloc(records);
+  int32_t* balances = malloc(count * sizeof(int32_t));
+  int ok = old != NULL && balances != NULL &&
+           pread(fd, old, records, 0) == (ssize_t)records;
+  if (ok && size > records)
+    ok = pread(fd, &lsn, sizeof(lsn), records) == sizeof(lsn);
+  for (uint64_t i = 0; ok && i < count; i++) balances[i] = old[i].balance;
+  if (ok) ok = create_store(path, count, layout, balances, NULL, lsn) == 0;
+  free(old);
+  free(balances);
+  return ok ? 0 : -1;
+}
+
+/*Convert a store of version 1 or 2, which has all accounts one after the
+other in a single segment and no account numbers*/
+static int convert_unsegmented(const char* path, int fd, size_t size,
+                               const struct store_header* h) {
+  enum store_layout layout =
+      h->version == 1 ? STORE_LAYOUT_RECORDS : h->layout;
+  if (layout > STORE_LAYOUT_COLUMNS ||
+      h->record_size != balance_stride(layout))
+    return -1;
+  size_t len = STORE_HEADER_SIZE + h->count * h->record_size;
+  if (layout == STORE_LAYOUT_COLUMNS) len += h->count * sizeof(uint32_t);
+  if (size < len) return -1;
+
+  char* map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return -1;
+  int32_t* balances = malloc(h->count * sizeof(int32_t));
+  uint32_t* flags = malloc(h->count * sizeof(uint32_t));
+  int ok = balances != NULL && flags != NULL;
+  for (uint64_t i = 0; ok && i < h->count; i++) {
+    char* rec = map + STORE_HEADER_SIZE + i * h->record_size;
+    balances[i] = *(int32_t*)rec;
+    if (layout == STORE_LAYOUT_COLUMNS)
+      flags[i] = *(uint32_t*)(map + STORE_HEADER_SIZE +
+                              h->count * sizeof(int32_t) +
+                              i * sizeof(uint32_t));
+    else
+      flags[i] = *(uint32_t*)(rec + offsetof(struct account_record, flags));
+  }
+  munmap(map, len);
+  if (ok)
+    ok = create_store(path, h->count, layout, balances, flags,
+                      h->checkpoint_lsn) == 0;
+  free(balances);
+  free(flags);
+  return ok ? 0 : -1;
+}
+
+/*Copy the pages of a complete checkpoint file into the accounts file*/
+static int finish_checkpoint(int fd, const char* ckpt_path) {
+  unsigned char page[STORE_HEADER_SIZE];
+  struct ckpt_header ch;
+  struct stat st;
+  uint64_t index;
+  int ok = 1;
+
+  int cfd = open(ckpt_path, O_RDONLY);
+  if (cfd < 0) return errno == ENOENT ? 0 : -1;
+  if (pread(cfd, &ch, sizeof(ch), 0) == sizeof(ch) &&
+      !memcmp(ch.magic, CKPT_MAGIC, sizeof(ch.magic)) && fstat(fd, &st) == 0) {
+    off_t off = sizeof(ch);
+    for (uint64_t i = 0; ok && i < ch.pages; i++) {
+      ok = pread(cfd, &index, sizeof(index), off) == sizeof(index) &&
+           pread(cfd, page, sizeof(page), off + sizeof(index)) == sizeof(page);
+      off += sizeof(index) + sizeof(page);
+      off_t to = index * STORE_HEADER_SIZE;
+      size_t len = sizeof(page);
+      if (ok && to + (off_t)len > st.st_size) len = st.st_size - to;
+      ok = ok && to < st.st_size && pwrite(fd, page, len, to) == (ssize_t)len;
+    }
+    ok = ok && fsync(fd) == 0;
+  }
+  close(cfd);
+  if (ok) unlink(ckpt_path);
+  return ok ? 0 : -1;
+}
+
+/*Map segment k of the file*/
+static int map_segment(struct account_store* s, uint32_t k) {
+  struct store_segment* seg = &s->segments[k];
+  off_t off = STORE_HEADER_SIZE + (off_t)k * s->segment_size;
+  void* map = mmap(NULL, s->segment_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, s->fd, off);
+  if (map == MAP_FAILED) return -1;
+  seg->dirty = calloc(s->segment_size / STORE_HEADER_SIZE, 1);
+  if (seg->dirty == NULL) {
+    munmap(map, s->segment_size);
+    return -1;
+  }
+  seg->base = map;
+  return 0;
+}
+
+/*Add a segment to the end of the file, with grow_lock held*/
+static int add_segment(struct account_store* s) {
+  struct stat st;
+  uint32_t k = atomic_load(&s->nsegments);
+  if (k == STORE_MAX_SEGMENTS) return -1;
+  /*A crash may have left the file longer than the header says*/
+  off_t len = file_size(k + 1, s->layout);
+  if (fstat(s->fd, &st) < 0 ||
+      (st.st_size < len && ftruncate(s->fd, len) < 0))
+    return -1;
+  if (map_segment(s, k) < 0) return -1;
+  atomic_store(&s->nsegments, k + 1);
+  return 0;
+}
+
+/*Hand out the next free slot to account id*/
+static int64_t next_slot(uint64_t id, void* arg) {
+  struct account_store* s = arg;
+  int64_t slot = -1;
+  pthread_mutex_lock(&s->grow_lock);
+  uint64_t n = atomic_load(&s->count);
+  if ((n >> STORE_SEGMENT_SHIFT) < atomic_load(&s->nsegments) ||
+      add_segment(s) == 0) {
+    *store_balance(s, n) = 0;
+    *store_flags(s, n) = 0;
+    *store_id(s, n) = id;
+    store_mark_dirty(s, n);
+    struct store_segment* seg = store_segment(s, n);
+    atomic_store(&seg->dirty[((char*)store_id(s, n) - seg->base) /
+                             STORE_HEADER_SIZE],
+                 1);
+    atomic_store(&s->count, n + 1);
+    slot = n;
+  }
+  pthread_mutex_unlock(&s->grow_lock);
+  return slot;
+}
+
+/*Slot of an account that is already in the store, when building the
+index*/
+static int64_t known_slot(uint64_t id, void* arg) { return *(uint64_t*)arg; }
+
+/*Free what store_open set up, anything not set up yet is NULL*/
+static void release(struct account_store* s) {
+  if (s->segments != NULL) {
+    for (uint32_t k = 0; k < atomic_load(&s->nsegments); k++) {
+      munmap(s->segments[k].base, s->segment_size);
+      free(s->segments[k].dirty);
+    }
+  }
+  if (s->locks != NULL)
+    for (int i = 0; i < STORE_LOCKS; i++)
+      pthread_rwlock_destroy(store_lock(s, i));
+  if (s->header != NULL) munmap(s->header, STORE_HEADER_SIZE);
+  index_destroy(&s->index);
+  free(s->segments);
+  free(s->locks);
+  free(s->waiting);
+  free(s->seqs);
+  free(s->snap_copied);
+  free(s->ckpt_path);
+  pthread_mutex_destroy(&s->grow_lock);
+  pthread_mutex_destroy(&s->snap_lock);
+  close(s->fd);
+}
+
+int store_open(struct account_store* s, const char* path, uint64_t count,
+               enum store_layout layout) {
+  struct store_header h;
+  struct stat st;
+  char ckpt_path[PATH_MAX];
+
+  snprintf(ckpt_path, sizeof(ckpt_path), "%s.ckpt", path);
+  int fd = open(path, O_RDWR);
+  if (fd < 0 && errno == ENOENT) {
+    if (create_store(path, count, layout, NULL, NULL, 0) < 0) return -1;
+    fd = open(path, O_RDWR);
+  }
+  if (fd < 0) return -1;
+  if (finish_checkpoint(fd, ckpt_path) < 0 || fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  int is_store = st.st_size >= (off_t)sizeof(h) &&
+                 pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+                 !memcmp(h.magic, STORE_MAGIC, sizeof(h.magic));
+  if (!is_store || h.version < STORE_VERSION) {
+    /*Not a store of this version yet, convert it and open the result*/
+    int ok = is_store ? convert_unsegmented(path, fd, st.st_size, &h)
+                      : convert_legacy(path, fd, st.st_size, count, layout);
+    close(fd);
+    if (ok < 0) return -1;
+    return store_open(s, path, count, layout);
+  }
+  if (h.version > STORE_VERSION || h.layout > STORE_LAYOUT_COLUMNS ||
+      h.record_size != balance_stride(h.layout) ||
+      h.segments > STORE_MAX_SEGMENTS ||
+      h.count > (uint64_t)h.segments * STORE_SEGMENT_ACCOUNTS ||
+      h.numbered > h.count ||
+      (uint64_t)st.st_size < file_size(h.segments, h.layout)) {
+    close(fd);
+    return -1;
+  }
+
+  memset(s, 0, sizeof(*s));
+  s->fd = fd;
+  s->layout = h.layout;
+  s->numbered = h.numbered;
+  atomic_init(&s->count, h.count);
+  atomic_init(&s->nsegments, 0);
+  s->balance_stride = h.record_size;
+  s->flags_offset = flags_offset(h.layout);
+  s->flags_stride = s->layout == STORE_LAYOUT_COLUMNS ? sizeof(uint32_t)
+                                                      : s->balance_stride;
+  s->ids_offset = ids_offset(h.layout);
+  s->segment_size = segment_size(h.layout);
+  pthread_mutex_init(&s->grow_lock, NULL);
+  pthread_mutex_init(&s->snap_lock, NULL);
+
+  void* map = mmap(NULL, STORE_HEADER_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE, fd, 0);
+  s->header = map == MAP_FAILED ? NULL : map;
+  s->segments = calloc(STORE_MAX_SEGMENTS, sizeof(struct store_segment));
+  /*In the padded layout the lock stripes get a cache line each too*/
+  s->lock_stride = sizeof(pthread_rwlock_t);
+  if (s->layout == STORE_LAYOUT_PADDED)
+    s->lock_stride =
+        (s->lock_stride + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  s->locks = aligned_alloc(CACHE_LINE, STORE_LOCKS * s->lock_stride);
+  s->waiting = aligned_alloc(CACHE_LINE, STORE_LOCKS * s->lock_stride);
+  s->seqs = aligned_alloc(CACHE_LINE, STORE_LOCKS * s->lock_stride);
+  s->snap_copied = aligned_alloc(CACHE_LINE, STORE_LOCKS * s->lock_stride);
+  s->ckpt_path = strdup(ckpt_path);
+  if (s->header == NULL || s->segments == NULL || s->locks == NULL ||
+      s->waiting == NULL || s->seqs == NULL || s->snap_copied == NULL ||
+      s->ckpt_path == NULL ||
+      index_init(&s->index) < 0)
+    goto err;
+  for (int i = 0; i < STORE_LOCKS; i++) {
+    pthread_rwlock_init(store_lock(s, i), NULL);
+    atomic_init(store_waiting(s, i), 0);
+    atomic_init(store_seq(s, i), 0);
+    atomic_init(store_snap_copied(s, i), 0);
+  }
+  for (uint32_t k = 0; k < h.segments; k++) {
+    if (map_segment(s, k) < 0) goto err;
+    atomic_store(&s->nsegments, k + 1);
+  }
+
+  /*Accounts that are not numbered by their slot go in the index*/
+  for (uint64_t n = h.numbered; n < h.count; n++) {
+    int added;
+    if (index_add(&s->index, *store_id(s, n), known_slot, &n, &added) < 0)
+      goto err;
+  }
+  return 0;
+
+err:
+  release(s);
+  return -1;
+}
+
+int store_open_account(struct account_store* s, uint64_t id,
+                       uint64_t* slot) {
+  int added;
+  if (id < s->numbered) {
+    *slot = id;
+    return 1;
+  }
+  int64_t n = index_add(&s->index, id, next_slot, s, &added);
+  if (n < 0) return -1;
+  *slot = n;
+  return added ? 0 : 1;
+}
+
+static int write_all(int fd, const void* buf, size_t len, off_t off) {
+  return pwrite(fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+}
+
+/*Index in the accounts file of the first page of segment k*/
+static uint64_t first_page(struct account_store* s, uint32_t k) {
+  return (STORE_HEADER_SIZE + (uint64_t)k * s->segment_size) /
+         STORE_HEADER_SIZE;
+}
+
+/*Append a page to the checkpoint file, as its index in the accounts file
+followed by its bytes*/
+static int write_ckpt_page(int cfd, off_t* off, uint64_t index,
+                           const char* page) {
+  int ok = write_all(cfd, &index, sizeof(index), *off) == 0 &&
+           write_all(cfd, page, STORE_HEADER_SIZE, *off + sizeof(index)) == 0;
+  *off += sizeof(index) + STORE_HEADER_SIZE;
+  return ok ? 0 : -1;
+}
+
+int store_checkpoint(struct account_store* s, uint64_t lsn) {
+  size_t seg_pages = s->segment_size / STORE_HEADER_SIZE;
+  uint32_t segments = atomic_load(&s->nsegments);
+  struct ckpt_header ch;
+  int ok;
+
+  s->header->count = atomic_load(&s->count);
+  s->header->segments = segments;
+  s->header->numbered = s->numbered;
+  s->header->checkpoint_lsn = lsn;
+
+  /*Write the header and the changed pages to the checkpoint file first,
+  then mark it complete*/
+  int cfd = open(s->ckpt_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (cfd < 0) return -1;
+  memcpy(ch.magic, CKPT_MAGIC, sizeof(ch.magic));
+  ch.pages = 1;
+  off_t off = sizeof(ch);
+  ok = write_ckpt_page(cfd, &off, 0, (char*)s->header) == 0;
+  for (uint32_t k = 0; ok && k < segments; k++) {
+    struct store_segment* seg = &s->segments[k];
+    for (size_t p = 0; ok && p < seg_pages; p++) {
+      if (!atomic_load_explicit(&seg->dirty[p], memory_order_relaxed))
+        continue;
+      ok = write_ckpt_page(cfd, &off, first_page(s, k) + p,
+                           seg->base + p * STORE_HEADER_SIZE) == 0;
+      ch.pages++;
+    }
+  }
+  ok = ok && fdatasync(cfd) == 0 && write_all(cfd, &ch, sizeof(ch), 0) == 0 &&
+       fdatasync(cfd) == 0;
+  close(cfd);
+  if (!ok) {
+    unlink(s->ckpt_path);
+    return -1;
+  }
+
+  /*Now the accounts file itself, a crash from here on is finished by the
+  next open*/
+  ok = write_all(s->fd, s->header, STORE_HEADER_SIZE, 0) == 0;
+  for (uint32_t k = 0; ok && k < segments; k++) {
+    struct store_segment* seg = &s->segments[k];
+    for (size_t p = 0; ok && p < seg_pages; p++) {
+      if (!atomic_exchange(&seg->dirty[p], 0)) continue;
+      char* page = seg->base + p * STORE_HEADER_SIZE;
+      ok = write_all(s->fd, page, STORE_HEADER_SIZE,
+                     (first_page(s, k) + p) * STORE_HEADER_SIZE) == 0;
+      /*The file holds the page now, drop the private copy so the mapping
+      reads it from the file again instead of keeping it in memory*/
+      if (ok) madvise(page, STORE_HEADER_SIZE, MADV_DONTNEED);
+    }
+  }
+  if (!ok || fdatasync(s->fd) < 0) return -1;
+  unlink(s->ckpt_path);
+  return 0;
+}
+
+void store_close(struct account_store* s) { release(s); }
+
+uint64_t store_account(struct account_store* s, uint64_t n) {
+  return n < s->numbered ? n : *store_id(s, n);
+}
+
+int32_t* store_snapshot_begin(struct account_store* s, uint64_t* count) {
+  pthread_mutex_lock(&s->snap_lock);
+  *count = atomic_load(&s->count);
+  int32_t* snap = malloc(sizeof(int32_t) * (*count > 0 ? *count : 1));
+  if (snap == NULL) {
+    pthread_mutex_unlock(&s->snap_lock);
+    return NULL;
+  }
+  s->snap = snap;
+  s->snap_count = *count;
+  /*From here on every stripe is copied before it changes*/
+  atomic_fetch_add(&s->snap_epoch, 1);
+  return snap;
+}
+
+void store_snapshot_copy(struct account_store* s, uint64_t stripe) {
+  unsigned int epoch = atomic_load(&s->snap_epoch);
+  for (uint64_t n = stripe; n < s->snap_count; n += STORE_LOCKS)
+    s->snap[n] = __atomic_load_n(store_balance(s, n), __ATOMIC_RELAXED);
+  atomic_store_explicit(store_snap_copied(s, stripe), epoch,
+                        memory_order_relaxed);
+}
+
+void store_snapshot_stripes(struct account_store* s, uint64_t from,
+                            uint64_t to) {
+  for (uint64_t i = from; i < to; i++) {
+    pthread_rwlock_wrlock(store_lock(s, i));
+    store_before_write(s, i, store_snap_epoch(s));
+    pthread_rwlock_unlock(store_lock(s, i));
+  }
+}
+
+void store_snapshot_end(struct account_store* s) {
+  s->snap = NULL;
+  s->snap_count = 0;
+  pthread_mutex_unlock(&s->snap_lock);
+}
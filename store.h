@@ -0,0 +1,314 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+/**
+ * @file store.h
+ * @brief Account table kept in a memory-mapped file
+ *
+ * The accounts file starts with a header page followed by segments of
+ * STORE_SEGMENT_ACCOUNTS slots. Each segment holds the balances and flags
+ * of its slots in one of these layouts, chosen when the file is created,
+ * followed by the account number of every slot:
+ *
+ * records: one struct account_record per account, 8 accounts share a cache
+ * line
+ * padded: one account per cache line, so desks working on neighbouring
+ * accounts do not invalidate each other's caches
+ * columns: all balances, then all flags, so a scan over the balances reads
+ * only balances
+ *
+ * A new store has accounts 0 to count - 1, each in the slot of its number.
+ * Accounts opened later take the next free slot, whatever their number, and
+ * are found through a hash index that is built when the store is opened.
+ * When the slots run out the file grows by a segment, which is mapped on
+ * its own so the others stay where they are while desks use them.
+ *
+ * The file is mapped privately, desks change the balances in memory and the
+ * file only changes at a checkpoint. A checkpoint writes the pages changed
+ * since the last one together with the lsn of the last write-ahead log
+ * record they include, so the file always holds the balances as of that
+ * lsn. The pages are first written to a separate file, so a crash in the
+ * middle of a checkpoint is finished on the next open. The copies of the
+ * pages written are then dropped from the mapping, which reads them from
+ * the file again, so memory only holds the pages changed since the last
+ * checkpoint.
+ *
+ * Opening a store maps the file and checks the header, so restarting does
+ * not depend on the number of accounts numbered by their slot. Records are
+ * read in as they are used.
+ *
+ * A snapshot copies the balances of all accounts as they were at one
+ * moment into an array of their own, while desks go on changing them. It
+ * starts a new epoch, then copies one lock stripe at a time with the lock
+ * held. A desk about to change a balance of a stripe that has not been
+ * copied in this epoch copies the stripe first, so the snapshot holds
+ * every stripe as it was before the first change after the start. Engines
+ * that change balances without the locks do not do this, their snapshots
+ * may catch a command halfway.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "index.h"
+
+#ifndef CACHE_LINE
+#define CACHE_LINE 64
+#endif
+
+#define STORE_MAGIC "BANKACCT"
+#define STORE_VERSION 3
+
+/*Records start on the page after the header*/
+#define STORE_HEADER_SIZE 4096
+
+/*Accounts share this many locks, the account in slot n uses lock
+n % STORE_LOCKS*/
+#define STORE_LOCKS 4096
+
+/*Slots per segment and the most segments of a store, 1G accounts*/
+#define STORE_SEGMENT_SHIFT 16
+#define STORE_SEGMENT_ACCOUNTS (1 << STORE_SEGMENT_SHIFT)
+#define STORE_MAX_SEGMENTS 16384
+
+/*Version 1 files have no layout and are in the records layout*/
+enum store_layout {
+  STORE_LAYOUT_RECORDS = 0,
+  STORE_LAYOUT_PADDED = 1,
+  STORE_LAYOUT_COLUMNS = 2
+};
+
+/*Account record of the records layout, the padded layout stretches it to
+a cache line*/
+struct account_record {
+  int32_t balance;
+  uint32_t flags;
+};
+
+/*First bytes of the accounts file*/
+struct store_header {
+  char magic[8];
+  uint32_t version;
+  /*Bytes from one balance to the next*/
+  uint32_t record_size;
+  /*Slots in use*/
+  uint64_t count;
+  /*Lsn of the last write-ahead log record included in the records*/
+  uint64_t checkpoint_lsn;
+  uint32_t layout;
+  uint32_t segments;
+  /*Accounts below this number are in the slot of their number*/
+  uint64_t numbered;
+};
+
+/*Mapping of a segment*/
+struct store_segment {
+  char* base;
+  /*One flag per page changed since the last checkpoint*/
+  atomic_uchar* dirty;
+};
+
+struct account_store {
+  int fd;
+  struct store_header* header;
+  enum store_layout layout;
+  /*Slots in use, accounts below numbered are in the slot of their
+  number*/
+  _Atomic uint64_t count;
+  uint64_t numbered;
+  /*Where the balance, flags and number of the first slot of a segment are
+  and how far apart those of consecutive slots are*/
+  size_t balance_stride;
+  size_t flags_offset;
+  size_t flags_stride;
+  size_t ids_offset;
+  size_t segment_size;
+  /*STORE_MAX_SEGMENTS entries, of which nsegments are mapped*/
+  struct store_segment* segments;
+  _Atomic uint32_t nsegments;
+  /*Held while a slot is handed out or the file grows*/
+  pthread_mutex_t grow_lock;
+  /*Slots of the accounts not numbered by their slot*/
+  struct account_index index;
+  /*Pages of a checkpoint in progress*/
+  char* ckpt_path;
+  /*Lock stripes, a cache line each in the padded layout*/
+  char* locks;
+  size_t lock_stride;
+  /*Requests waiting for each lock stripe, spaced like the locks, for the
+  combining engine*/
+  char* waiting;
+  /*Epoch of the snapshot being taken or taken last, the epoch each stripe
+  was last copied in, spaced like the locks, and where the balances of the
+  snapshot go*/
+  atomic_uint snap_epoch;
+  char* snap_copied;
+  int32_t* snap;
+  uint64_t snap_count;
+  /*Held while a snapshot is taken*/
+  pthread_mutex_t snap_lock;
+  /*Sequence of each lock stripe, odd while balances of the stripe change,
+  spaced like the locks*/
+  char* seqs;
+};
+
+/**
+ * @brief Open the accounts file, creating it with count accounts if it does
+ * not exist
+ *
+ * A file in the old format, ACC_CAPACITY account_storage records followed
+ * by an optional checkpoint lsn, or from an older version of the store is
+ * converted on the first open.
+ *
+ * @param s
+ * @param path
+ * @param count number of accounts of a new store
+ * @param layout layout of a new store, an existing one keeps its own
+ * @return 0 on success, -1 if the file could not be opened or is not a
+ * valid store
+ */
+int store_open(struct account_store* s, const char* path, uint64_t count,
+               enum store_layout layout);
+
+/**
+ * @brief Layout named "records", "padded" or "columns"
+ *
+ * @return the layout, -1 if there is none by that name
+ */
+int store_layout_by_name(const char* name);
+
+/*Name of a layout*/
+const char* store_layout_name(enum store_layout layout);
+
+/**
+ * @brief Open account id with a balance of 0
+ *
+ * Desks may use other accounts while this runs.
+ *
+ * @param s
+ * @param id
+ * @param slot set to the slot of the account
+ * @return 0 if the account was opened, 1 if it already existed, -1 if
+ * there is no room for it
+ */
+int store_open_account(struct account_store* s, uint64_t id, uint64_t* slot);
+
+/**
+ * @brief Write the pages changed since the last checkpoint to disk and
+ * record that they include the log up to lsn
+ *
+ * Nothing may change the accounts while this runs.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int store_checkpoint(struct account_store* s, uint64_t lsn);
+
+/**
+ * @brief Unmap and close the store, changes not checkpointed may be lost
+ */
+void store_close(struct account_store* s);
+
+/*Number of the account in slot n*/
+uint64_t store_account(struct account_store* s, uint64_t n);
+
+/**
+ * @brief Start a snapshot of the balances of the accounts there are now,
+ * one snapshot at a time
+ *
+ * @param count set to the number of slots in the snapshot
+ * @return the balances by slot, filled in by store_snapshot_stripes() and
+ * the desks, to be freed by the caller after store_snapshot_end(), NULL if
+ * there is not enough memory
+ */
+int32_t* store_snapshot_begin(struct account_store* s, uint64_t* count);
+
+/**
+ * @brief Copy the lock stripes from to to - 1 into the snapshot, unless a
+ * desk already did, the stripes may be split over several threads
+ */
+void store_snapshot_stripes(struct account_store* s, uint64_t from,
+                            uint64_t to);
+
+/**
+ * @brief Finish a snapshot once all stripes are copied
+ */
+void store_snapshot_end(struct account_store* s);
+
+/*Copy the stripe into the snapshot being taken, with its lock held for
+writing*/
+void store_snapshot_copy(struct account_store* s, uint64_t stripe);
+
+/*Slot of account id, -1 if there is no such account*/
+static inline int64_t store_find(struct account_store* s, uint64_t id) {
+  if (id < s->numbered) return id;
+  return index_find(&s->index, id);
+}
+
+/*Lock protecting the account in slot n*/
+static inline pthread_rwlock_t* store_lock(struct account_store* s,
+                                           uint64_t n) {
+  return (pthread_rwlock_t*)(s->locks + (n % STORE_LOCKS) * s->lock_stride);
+}
+
+/*Requests waiting for the lock of the account in slot n*/
+static inline atomic_uintptr_t* store_waiting(struct account_store* s,
+                                              uint64_t n) {
+  return (atomic_uintptr_t*)(s->waiting + (n % STORE_LOCKS) * s->lock_stride);
+}
+
+/*Sequence of the lock stripe of the account in slot n*/
+static inline atomic_uint* store_seq(struct account_store* s, uint64_t n) {
+  return (atomic_uint*)(s->seqs + (n % STORE_LOCKS) * s->lock_stride);
+}
+
+/*Epoch of the snapshot the lock stripe of slot n was last copied into*/
+static inline atomic_uint* store_snap_copied(struct account_store* s,
+                                             uint64_t n) {
+  return (atomic_uint*)(s->snap_copied + (n % STORE_LOCKS) * s->lock_stride);
+}
+
+/*Epoch of the snapshot being taken or taken last. A command reads it
+once, with all its locks held, so it is in a snapshot completely or not
+at all.*/
+static inline unsigned int store_snap_epoch(struct account_store* s) {
+  return atomic_load_explicit(&s->snap_epoch, memory_order_acquire);
+}
+
+/*Copy the stripe of slot n into the snapshot of epoch, if nobody did yet,
+before changing a balance of it with its lock held for writing*/
+static inline void store_before_write(struct account_store* s, uint64_t n,
+                                      unsigned int epoch) {
+  if (atomic_load_explicit(store_snap_copied(s, n), memory_order_relaxed) !=
+      epoch)
+    store_snapshot_copy(s, n % STORE_LOCKS);
+}
+
+static inline struct store_segment* store_segment(struct account_store* s,
+                                                  uint64_t n) {
+  return &s->segments[n >> STORE_SEGMENT_SHIFT];
+}
+
+/*Balance of the account in slot n, to be changed only with its lock held
+for writing and, but by the atomic engine, its sequence odd*/
+static inline int32_t* store_balance(struct account_store* s, uint64_t n) {
+  return (int32_t*)(store_segment(s, n)->base +
+                    (n & (STORE_SEGMENT_ACCOUNTS - 1)) * s->balance_stride);
+}
+
+/*Flags of the account in slot n, protected like its balance*/
+static inline uint32_t* store_flags(struct account_store* s, uint64_t n) {
+  return (uint32_t*)(store_segment(s, n)->base + s->flags_offset +
+                     (n & (STORE_SEGMENT_ACCOUNTS - 1)) * s->flags_stride);
+}
+
+/*Note that the balance of the account in slot n has changed*/
+static inline void store_mark_dirty(struct account_store* s, uint64_t n) {
+  struct store_segment* seg = store_segment(s, n);
+  size_t page = ((char*)store_balance(s, n) - seg->base) / STORE_HEADER_SIZE;
+  if (!atomic_load_explicit(&seg->dirty[page], memory_order_relaxed))
+    atomic_store_explicit(&seg->dirty[page], 1, memory_order_relaxed);
+}
+
+#endif  // __STORE_H__
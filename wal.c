@@ -0,0 +1,329 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Lsn of the last record appended by this thread*/
+static __thread uint64_t my_lsn;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32(const unsigned char* p, size_t len) {
+  uint32_t c = 0xFFFFFFFFu;
+  pthread_once(&crc_once, crc_init);
+  for (size_t i = 0; i < len; i++) c = crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xFFFFFFFFu;
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static void encode_record(const struct wal_record* r, unsigned char* p) {
+  put_u64(p, r->lsn);
+  p[8] = r->op;
+  p[9] = r->flags;
+  memset(p + 10, 0, 6);
+  put_u64(p + 16, r->acc1);
+  put_u64(p + 24, r->acc2);
+  put_u64(p + 32, (uint64_t)r->amount);
+  put_u32(p + 12, crc32(p, WAL_RECORD_SIZE));
+}
+
+/*Returns -1 if the checksum does not match*/
+static int decode_record(const unsigned char* p, struct wal_record* r) {
+  unsigned char tmp[WAL_RECORD_SIZE];
+  memcpy(tmp, p, WAL_RECORD_SIZE);
+  memset(tmp + 12, 0, 4);
+  if (crc32(tmp, WAL_RECORD_SIZE) != get_u32(p + 12)) return -1;
+  r->lsn = get_u64(p);
+  r->op = p[8];
+  r->flags = p[9];
+  r->acc1 = get_u64(p + 16);
+  r->acc2 = get_u64(p + 24);
+  r->amount = (int64_t)get_u64(p + 32);
+  return 0;
+}
+
+static void encode_header(unsigned char* p) {
+  memset(p, 0, WAL_HEADER_SIZE);
+  memcpy(p, WAL_MAGIC, sizeof(WAL_MAGIC));
+  put_u32(p + 8, WAL_VERSION);
+  put_u32(p + 12, WAL_RECORD_SIZE);
+}
+
+long wal_replay(const char* path, uint64_t after_lsn,
+                void (*apply)(const struct wal_record*, void*), void* arg,
+                uint64_t* last_lsn) {
+  unsigned char buf[WAL_RECORD_SIZE];
+  unsigned char header[WAL_HEADER_SIZE];
+  struct wal_record batch[WAL_MAX_BATCH];
+  int pending = 0;
+  uint64_t prev = 0;
+  off_t good = WAL_HEADER_SIZE;
+  long applied = 0;
+
+  *last_lsn = after_lsn;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) return errno == ENOENT ? 0 : -1;
+  FILE* f = fdopen(fd, "r");
+  if (f == NULL) {
+    close(fd);
+    return -1;
+  }
+  unsigned char expected[WAL_HEADER_SIZE];
+  encode_header(expected);
+  if (fread(header, WAL_HEADER_SIZE, 1, f) != 1) {
+    /*Empty, or a crash while the header of a new log was written*/
+    good = 0;
+  } else if (memcmp(header, expected, WAL_HEADER_SIZE) != 0) {
+    fclose(f);
+    return -2;
+  }
+  while (good > 0 && fread(buf, WAL_RECORD_SIZE, 1, f) == 1) {
+    struct wal_record* r = &batch[pending];
+    /*Lsns only grow, anything else is left over from a torn write*/
+    if (decode_record(buf, r) < 0 || r->lsn <= prev) break;
+    prev = r->lsn;
+    pending++;
+    if (r->flags & WAL_MORE) {
+      if (pending == WAL_MAX_BATCH) break;
+      continue;
+    }
+    /*The batch is complete*/
+    good += pending * WAL_RECORD_SIZE;
+    for (int i = 0; i < pending; i++) {
+      if (batch[i].lsn <= after_lsn) continue;
+      /*New records follow void ones too*/
+      *last_lsn = batch[i].lsn;
+      if (batch[i].flags & WAL_VOID) continue;
+      apply(&batch[i], arg);
+      applied++;
+    }
+    pending = 0;
+  }
+  /*Cut a torn tail so new records follow the last good one*/
+  if (ftruncate(fd, good) < 0) applied = -1;
+  fclose(f);
+  return applied;
+}
+
+static int write_all(int fd, const unsigned char* p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*Thread that writes and syncs appended records in groups*/
+static void* flusher(void* arg) {
+  struct wal* w = arg;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->count == 0 && !w->stop) pthread_cond_wait(&w->work, &w->lock);
+    if (w->count == 0) break;
+    if (w->window_us > 0 && !w->stop) {
+      /*Give other desks a moment to join the group*/
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += w->window_us * 1000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      while (!w->stop && (w->max_group == 0 || w->count < w->max_group) &&
+             pthread_cond_timedwait(&w->work, &w->lock, &deadline) == 0) {
+      }
+    }
+    /*Reserved records are written once they are filled in*/
+    while (w->unfilled > 0) pthread_cond_wait(&w->work, &w->lock);
+    unsigned char* buf = w->active;
+    size_t n = w->count;
+    uint64_t last = w->next_lsn - 1;
+    w->active = w->flushing;
+    w->flushing = buf;
+    w->count = 0;
+    /*Appenders waiting for space can use the other buffer now*/
+    pthread_cond_broadcast(&w->done);
+    pthread_mutex_unlock(&w->lock);
+
+    int ok = write_all(w->fd, buf, n * WAL_RECORD_SIZE) == 0 &&
+             fdatasync(w->fd) == 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (!ok) w->error = 1;
+    w->durable_lsn = last;
+    atomic_fetch_add(&w->stats.records, n);
+    atomic_fetch_add(&w->stats.syncs, 1);
+    pthread_cond_broadcast(&w->done);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+int wal_open(struct wal* w, const char* path, uint64_t last_lsn,
+             long window_us, int max_group) {
+  unsigned char header[WAL_HEADER_SIZE];
+  struct stat st;
+  w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (w->fd < 0) return -1;
+  encode_header(header);
+  if (fstat(w->fd, &st) < 0 ||
+      (st.st_size == 0 && (write_all(w->fd, header, WAL_HEADER_SIZE) < 0 ||
+                           fdatasync(w->fd) < 0))) {
+    close(w->fd);
+    return -1;
+  }
+  w->active = malloc(WAL_BUFFER_RECORDS * WAL_RECORD_SIZE);
+  w->flushing = malloc(WAL_BUFFER_RECORDS * WAL_RECORD_SIZE);
+  if (w->active == NULL || w->flushing == NULL) {
+    free(w->active);
+    free(w->flushing);
+    close(w->fd);
+    return -1;
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  pthread_cond_init(&w->done, NULL);
+  w->count = 0;
+  w->unfilled = 0;
+  w->next_lsn = last_lsn + 1;
+  w->durable_lsn = last_lsn;
+  w->window_us = window_us;
+  w->max_group = max_group;
+  w->error = 0;
+  w->stop = 0;
+  atomic_init(&w->stats.records, 0);
+  atomic_init(&w->stats.syncs, 0);
+  if (pthread_create(&w->flusher, NULL, flusher, w) != 0) {
+    free(w->active);
+    free(w->flushing);
+    close(w->fd);
+    return -1;
+  }
+  return 0;
+}
+
+void wal_reserve(struct wal* w, int n, struct wal_slots* slots) {
+  pthread_mutex_lock(&w->lock);
+  /*A batch goes into one buffer, so it is synced as a whole*/
+  while (w->count + n > WAL_BUFFER_RECORDS)
+    pthread_cond_wait(&w->done, &w->lock);
+  size_t before = w->count;
+  slots->lsn = w->next_lsn;
+  slots->at = w->count;
+  slots->n = n;
+  w->next_lsn += n;
+  w->count += n;
+  w->unfilled += n;
+  /*Wake the flusher for the first record and when the group is full*/
+  if (before == 0 ||
+      ((int)before < w->max_group && (int)w->count >= w->max_group))
+    pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+}
+
+void wal_fill(struct wal* w, const struct wal_slots* slots,
+              const struct wal_record* records, int n) {
+  pthread_mutex_lock(&w->lock);
+  for (int i = 0; i < slots->n; i++) {
+    struct wal_record r = {0};
+    if (i < n) r = records[i];
+    r.lsn = slots->lsn + i;
+    r.flags = (i < n ? 0 : WAL_VOID) | (i < slots->n - 1 ? WAL_MORE : 0);
+    /*The flusher does not swap the buffers while records are unfilled*/
+    encode_record(&r, w->active + (slots->at + i) * WAL_RECORD_SIZE);
+  }
+  w->unfilled -= slots->n;
+  if (w->unfilled == 0) pthread_cond_signal(&w->work);
+  /*Whatever this command saw was reserved before now*/
+  my_lsn = w->next_lsn - 1;
+  pthread_mutex_unlock(&w->lock);
+}
+
+uint64_t wal_append_batch(struct wal* w, struct wal_record* records, int n) {
+  struct wal_slots slots;
+  wal_reserve(w, n, &slots);
+  wal_fill(w, &slots, records, n);
+  for (int i = 0; i < n; i++) {
+    records[i].lsn = slots.lsn + i;
+    records[i].flags = i < n - 1 ? WAL_MORE : 0;
+  }
+  return slots.lsn + n - 1;
+}
+
+uint64_t wal_append(struct wal* w, uint8_t op, uint64_t acc1, uint64_t acc2,
+                    int64_t amount) {
+  struct wal_record r = {0, op, 0, acc1, acc2, amount};
+  return wal_append_batch(w, &r, 1);
+}
+
+int wal_commit(struct wal* w, uint64_t lsn) {
+  pthread_mutex_lock(&w->lock);
+  while (w->durable_lsn < lsn && !w->error)
+    pthread_cond_wait(&w->done, &w->lock);
+  int ret = w->error ? -1 : 0;
+  pthread_mutex_unlock(&w->lock);
+  return ret;
+}
+
+int wal_commit_mine(struct wal* w) { return wal_commit(w, my_lsn); }
+
+int wal_truncate(struct wal* w) {
+  if (ftruncate(w->fd, WAL_HEADER_SIZE) < 0 || fsync(w->fd) < 0) return -1;
+  return 0;
+}
+
+uint64_t wal_last_lsn(struct wal* w) {
+  pthread_mutex_lock(&w->lock);
+  uint64_t lsn = w->next_lsn - 1;
+  pthread_mutex_unlock(&w->lock);
+  return lsn;
+}
+
+void wal_close(struct wal* w) {
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->flusher, NULL);
+  close(w->fd);
+  free(w->active);
+  free(w->flushing);
+  pthread_cond_destroy(&w->done);
+  pthread_cond_destroy(&w->work);
+  pthread_mutex_destroy(&w->lock);
+}
@@ -0,0 +1,219 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+/**
+ * @file wal.h
+ * @brief Write-ahead log of account mutations with group commit
+ *
+ * Every withdrawal, deposit, transfer and transaction that changed a balance
+ * is appended to the log before the client gets its reply. Desks append to
+ * a shared buffer and a flusher thread writes and syncs everything appended
+ * since the last sync in one go, so concurrent desks share the cost of an
+ * fsync.
+ *
+ * The log starts with a 16-byte header, little-endian:
+ *
+ * magic "BANKWAL\0" | version u32 | record size u32
+ *
+ * and a log with another magic, version or record size is not replayed.
+ * It is followed by records of 40 bytes, little-endian:
+ *
+ * lsn u64 | op u8 | flags u8 | reserved u8[2] | crc32 u32 | acc1 u64 |
+ * acc2 u64 | amount i64
+ *
+ * Records appended together, such as the legs of a transaction, have
+ * WAL_MORE set on all but the last one and are replayed all or none.
+ *
+ * Records hold the change, not the resulting balance. Changes to a balance
+ * commute, so replaying them on top of the last checkpoint gives the same
+ * balances whatever order concurrent desks appended them in. What is on
+ * disk after a crash must still never hold a change without the changes it
+ * relied on, such as a withdrawal without the deposit that paid for it.
+ * So a command reserves its records before it changes anything and fills
+ * them in afterwards, and commits everything reserved until then: any
+ * change it saw was reserved before, and is synced with it. A command that
+ * changed nothing fills its records with WAL_VOID, which replay skips.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAL_MAGIC "BANKWAL"
+#define WAL_VERSION 1
+#define WAL_HEADER_SIZE 16
+#define WAL_RECORD_SIZE 40
+
+/*Records buffered between two syncs before appenders have to wait*/
+#define WAL_BUFFER_RECORDS 4096
+
+/*Most records that can be appended together*/
+#define WAL_MAX_BATCH 64
+
+/*Flag of a record that is followed by more records of the same batch*/
+#define WAL_MORE 1
+
+/*Flag of a reserved record that was not used*/
+#define WAL_VOID 2
+
+/*Decoded log record*/
+struct wal_record {
+  uint64_t lsn;
+  uint8_t op;
+  uint8_t flags;
+  uint64_t acc1;
+  uint64_t acc2;
+  int64_t amount;
+};
+
+/*Records reserved together, to be filled in once*/
+struct wal_slots {
+  uint64_t lsn;
+  size_t at;
+  int n;
+};
+
+/*Counters of a log, for reporting*/
+struct wal_stats {
+  atomic_llong records;
+  atomic_llong syncs;
+};
+
+struct wal {
+  int fd;
+  pthread_mutex_t lock;
+  /*Signalled when there is something to flush*/
+  pthread_cond_t work;
+  /*Signalled when records became durable or buffer space was freed*/
+  pthread_cond_t done;
+  pthread_t flusher;
+  /*Records are appended to active while the flusher writes out the other
+  buffer*/
+  unsigned char* active;
+  unsigned char* flushing;
+  size_t count;
+  /*Reserved records in active that are not filled in yet, the flusher
+  waits for them*/
+  size_t unfilled;
+  uint64_t next_lsn;
+  uint64_t durable_lsn;
+  /*How long the flusher waits for more records before a sync, and how many
+  records make it sync right away, 0 means no limit*/
+  long window_us;
+  int max_group;
+  int error;
+  int stop;
+  struct wal_stats stats;
+};
+
+/**
+ * @brief Apply the records of a log to the accounts
+ *
+ * Stops at the first incomplete or corrupt record, which is what a crash in
+ * the middle of a write leaves behind, and cuts the file there. A batch
+ * that was not completely written is cut as well.
+ *
+ * @param path
+ * @param after_lsn records up to and including this lsn are already part of
+ * the checkpoint and are skipped
+ * @param apply called for every record in log order, but WAL_VOID ones
+ * @param arg passed to apply
+ * @param last_lsn set to the highest lsn in the log, or after_lsn
+ * @return number of records applied, -1 if the log could not be read, -2 if
+ * it is not a log of this version
+ */
+long wal_replay(const char* path, uint64_t after_lsn,
+                void (*apply)(const struct wal_record*, void*), void* arg,
+                uint64_t* last_lsn);
+
+/**
+ * @brief Open a log for appending and start its flusher thread
+ *
+ * Writes the header if the log is empty.
+ *
+ * @param w
+ * @param path
+ * @param last_lsn lsn of the last record already in the log or checkpoint
+ * @param window_us
+ * @param max_group
+ * @return 0 on success, -1 on failure
+ */
+int wal_open(struct wal* w, const char* path, uint64_t last_lsn,
+             long window_us, int max_group);
+
+/**
+ * @brief Append a record, it is durable once wal_commit returns
+ *
+ * @return lsn of the record
+ */
+uint64_t wal_append(struct wal* w, uint8_t op, uint64_t acc1, uint64_t acc2,
+                    int64_t amount);
+
+/**
+ * @brief Append records that are replayed all or none, with consecutive
+ * lsns
+ *
+ * @param w
+ * @param records op, acc1, acc2 and amount of every record, lsn and flags
+ * are set here
+ * @param n at most WAL_MAX_BATCH
+ * @return lsn of the last record
+ */
+uint64_t wal_append_batch(struct wal* w, struct wal_record* records, int n);
+
+/**
+ * @brief Reserve records that are appended together, before the change they
+ * log is made
+ *
+ * @param n at most WAL_MAX_BATCH
+ */
+void wal_reserve(struct wal* w, int n, struct wal_slots* slots);
+
+/**
+ * @brief Fill in reserved records, the ones past n become WAL_VOID
+ *
+ * Afterwards wal_commit_mine() waits for every record reserved so far.
+ *
+ * @param records op, acc1, acc2 and amount of the first n records, NULL if
+ * n is 0
+ */
+void wal_fill(struct wal* w, const struct wal_slots* slots,
+              const struct wal_record* records, int n);
+
+/**
+ * @brief Wait until the record with lsn and everything before it is on disk
+ *
+ * @return 0 on success, -1 if the log could not be written
+ */
+int wal_commit(struct wal* w, uint64_t lsn);
+
+/**
+ * @brief Wait until the records appended by the calling thread, and all
+ * records reserved before its last one was filled in, are on disk
+ *
+ * @return 0 on success, -1 if the log could not be written
+ */
+int wal_commit_mine(struct wal* w);
+
+/**
+ * @brief Empty the log once its records are part of a checkpoint, only
+ * its header stays
+ *
+ * Nothing may be appended while this runs.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int wal_truncate(struct wal* w);
+
+/**
+ * @brief Highest lsn handed out so far
+ */
+uint64_t wal_last_lsn(struct wal* w);
+
+/**
+ * @brief Flush what is left, stop the flusher and close the log
+ */
+void wal_close(struct wal* w);
+
+#endif  // __WAL_H__